@@ -24,6 +24,15 @@
 
 #include "alsa.h"
 
+/* Sample formats to try on the device, in order of preference. The
+ * player and timecoder work in either without conversion, so a
+ * device offering only float can be used without 'plughw' */
+
+static const snd_pcm_format_t formats[] = {
+    SND_PCM_FORMAT_S16,
+    SND_PCM_FORMAT_FLOAT_LE
+};
+
 
 /* This structure doesn't have corresponding functions to be an
  * abstraction of the ALSA calls; it is merely a container for these
@@ -35,7 +44,8 @@ struct alsa_pcm {
     struct pollfd *pe;
     size_t pe_count; /* number of pollfd entries */
 
-    signed short *buf;
+    void *buf;
+    snd_pcm_format_t format;
     snd_pcm_uframes_t period;
     int rate;
 };
@@ -57,7 +67,7 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
 {
     int r, dir;
     unsigned int p;
-    size_t bytes;
+    size_t n, bytes;
     snd_pcm_hw_params_t *hw_params;
     
     r = snd_pcm_open(&alsa->pcm, device_name, stream, SND_PCM_NONBLOCK);
@@ -81,13 +91,18 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
         return -1;
     }
     
-    r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params, SND_PCM_FORMAT_S16);
+    for (n = 0; n < sizeof formats / sizeof *formats; n++) {
+        r = snd_pcm_hw_params_set_format(alsa->pcm, hw_params, formats[n]);
+        if (r == 0)
+            break;
+    }
     if (r < 0) {
         alsa_error("hw_params_set_format", r);
-        fprintf(stderr, "16-bit signed format is not available. "
+        fprintf(stderr, "No 16-bit or float format is available. "
                 "You may need to use a 'plughw' device.\n");
         return -1;
     }
+    alsa->format = formats[n];
 
     r = snd_pcm_hw_params_set_rate(alsa->pcm, hw_params, rate, 0);
     if (r < 0) {
@@ -138,7 +153,8 @@ static int pcm_open(struct alsa_pcm *alsa, const char *device_name,
         return -1;
     }
 
-    bytes = alsa->period * DEVICE_CHANNELS * sizeof(signed short);
+    bytes = alsa->period * DEVICE_CHANNELS
+        * snd_pcm_format_physical_width(alsa->format) / 8;
     alsa->buf = malloc(bytes);
     if (!alsa->buf) {
         perror("malloc");
@@ -249,7 +265,21 @@ static int playback(struct device *dv)
     int r;
     struct alsa *alsa = (struct alsa*)dv->local;
 
-    device_collect(dv, alsa->playback.buf, alsa->playback.period);
+    switch (alsa->playback.format) {
+    case SND_PCM_FORMAT_FLOAT_LE:
+    {
+        float *out[DEVICE_CHANNELS];
+
+        out[0] = alsa->playback.buf;
+        out[1] = out[0] + 1;
+        device_collect_float(dv, out, DEVICE_CHANNELS,
+                             alsa->playback.period);
+        break;
+    }
+
+    default:
+        device_collect(dv, alsa->playback.buf, alsa->playback.period);
+    }
 
     r = snd_pcm_writei(alsa->playback.pcm, alsa->playback.buf,
                        alsa->playback.period);
@@ -283,7 +313,20 @@ static int capture(struct device *dv)
                 r, alsa->capture.period);
     }
 
-    device_submit(dv, alsa->capture.buf, r);
+    switch (alsa->capture.format) {
+    case SND_PCM_FORMAT_FLOAT_LE:
+    {
+        const float *in[DEVICE_CHANNELS];
+
+        in[0] = alsa->capture.buf;
+        in[1] = in[0] + 1;
+        device_submit_float(dv, in, DEVICE_CHANNELS, r);
+        break;
+    }
+
+    default:
+        device_submit(dv, alsa->capture.buf, r);
+    }
 
     return 0;
 }
@@ -0,0 +1,506 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "cache.h"
+#include "debug.h"
+#include "realtime.h"
+
+#define MAGIC "xwaxpcm1"
+#define SUFFIX ".pcm"
+#define TMP_SUFFIX SUFFIX ".tmp"
+
+#define STALE 3600 /* seconds before a temporary file is abandoned */
+
+#define SAMPLE (sizeof(signed short) * TRACK_CHANNELS) /* bytes per sample */
+#define DIV_UP(x, y) (((x) + (y) - 1) / (y))
+
+/*
+ * Each file is this header, then the pathname, the PPM and overview
+ * meters and finally the audio itself; all in native byte order
+ */
+
+struct header {
+    char magic[8];
+    uint64_t size; /* of the original file */
+    int64_t mtime, mtime_nsec;
+    uint32_t rate, length, pathlen;
+};
+
+static const char *dir = NULL;
+static size_t limit;
+
+/*
+ * An entry in the cache directory, for eviction
+ */
+
+struct entry {
+    char name[NAME_MAX + 1];
+    off_t size;
+    time_t mtime;
+};
+
+/*
+ * Use the given directory for the cache, up to the given size
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+int cache_init(const char *d, size_t bytes)
+{
+    if (mkdir(d, 0777) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
+
+    dir = d;
+    limit = bytes;
+
+    return 0;
+}
+
+/*
+ * Return: bytes occupied by the meters for a track of the given length
+ */
+
+static size_t ppm_bytes(unsigned int length)
+{
+    return DIV_UP(length, TRACK_PPM_RES);
+}
+
+static size_t overview_bytes(unsigned int length)
+{
+    return DIV_UP(length, TRACK_OVERVIEW_RES);
+}
+
+/*
+ * Build the filename in the cache for the given track, from a hash
+ * of its pathname; the full pathname is checked against the header
+ */
+
+static void filename(char *buf, size_t len, const char *path)
+{
+    uint64_t h;
+    const char *c;
+
+    h = 14695981039346656037ULL; /* FNV-1a */
+    for (c = path; *c != '\0'; c++) {
+        h ^= (unsigned char)*c;
+        h *= 1099511628211ULL;
+    }
+
+    snprintf(buf, len, "%s/%016llx" SUFFIX, dir, (unsigned long long)h);
+}
+
+/*
+ * Read exactly the given number of bytes
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int read_all(int fd, void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t z;
+
+        z = read(fd, buf, len);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (z == 0)
+            return -1;
+
+        buf += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Write exactly the given number of bytes
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t z;
+
+        z = write(fd, buf, len);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Check the header of a cache file against the original file
+ *
+ * Return: true if the cache file holds the complete audio of the
+ * original file, as it is now
+ */
+
+static bool valid(int fd, const struct header *h, const char *path)
+{
+    char *p;
+    bool r;
+    struct stat st, cst;
+
+    if (memcmp(h->magic, MAGIC, sizeof h->magic) != 0)
+        return false;
+
+    if (stat(path, &st) == -1)
+        return false;
+
+    if (h->size != st.st_size || h->mtime != st.st_mtim.tv_sec
+        || h->mtime_nsec != st.st_mtim.tv_nsec)
+    {
+        return false;
+    }
+
+    if (h->pathlen != strlen(path))
+        return false;
+
+    if (h->rate < TRACK_MIN_RATE || h->rate > TRACK_MAX_RATE)
+        return false;
+
+    /* A file cut short, eg. by a crash, is not used */
+
+    if (fstat(fd, &cst) == -1)
+        return false;
+
+    if (cst.st_size != sizeof *h + h->pathlen + ppm_bytes(h->length)
+        + overview_bytes(h->length) + (off_t)h->length * SAMPLE)
+    {
+        return false;
+    }
+
+    p = malloc(h->pathlen);
+    if (p == NULL)
+        return false;
+
+    r = (read_all(fd, p, h->pathlen) == 0
+         && memcmp(p, path, h->pathlen) == 0);
+
+    free(p);
+    return r;
+}
+
+/*
+ * Open the cached audio for a track, if there is any
+ *
+ * On success, the meters are read immediately and the caller reads
+ * the audio from the file descriptor, in the same way as from an
+ * importer. A header which can't be used is a miss.
+ *
+ * Pre: tr->path is set
+ * Pre: this is the import thread, without the rig lock
+ * Return: file descriptor positioned at the audio, or -1 if not cached
+ * Post: on success, tr->rate, tr->limit and the cached meters are set
+ */
+
+int cache_open(struct track *tr)
+{
+    int fd;
+    char name[PATH_MAX];
+    struct header h;
+
+    rt_not_allowed();
+
+    if (dir == NULL)
+        return -1;
+
+    filename(name, sizeof name, tr->path);
+
+    fd = open(name, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (read_all(fd, &h, sizeof h) == -1 || !valid(fd, &h, tr->path))
+        goto fail;
+
+    tr->cached_ppm = malloc(ppm_bytes(h.length));
+    tr->cached_overview = malloc(overview_bytes(h.length));
+    if (tr->cached_ppm == NULL || tr->cached_overview == NULL) {
+        perror("malloc");
+        goto fail_meters;
+    }
+
+    if (read_all(fd, tr->cached_ppm, ppm_bytes(h.length)) == -1)
+        goto fail_meters;
+    if (read_all(fd, tr->cached_overview, overview_bytes(h.length)) == -1)
+        goto fail_meters;
+
+    /* The modification time of the cache file is the time it was
+     * last used, for eviction */
+
+    if (futimens(fd, NULL) == -1)
+        perror("futimens");
+
+    tr->rate = h.rate;
+    tr->limit = (size_t)h.length * SAMPLE;
+
+    return fd;
+
+ fail_meters:
+    free(tr->cached_ppm);
+    free(tr->cached_overview);
+    tr->cached_ppm = NULL;
+    tr->cached_overview = NULL;
+ fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
+
+/*
+ * Order entries oldest first
+ */
+
+static int compare(const void *a, const void *b)
+{
+    const struct entry *x = a, *y = b;
+
+    if (x->mtime < y->mtime)
+        return -1;
+    if (x->mtime > y->mtime)
+        return 1;
+    return 0;
+}
+
+/*
+ * Return: true if the name ends with the given suffix
+ */
+
+static bool ends(const char *name, const char *suffix)
+{
+    size_t len, n;
+
+    len = strlen(name);
+    n = strlen(suffix);
+
+    return len >= n && strcmp(name + len - n, suffix) == 0;
+}
+
+/*
+ * Remove the least recently used files until the cache is within
+ * its size limit, and any temporary file left by a save which was
+ * interrupted
+ */
+
+static void trim(void)
+{
+    DIR *d;
+    struct dirent *de;
+    struct entry *e, *x;
+    size_t n, z;
+    off_t total;
+
+    d = opendir(dir);
+    if (d == NULL) {
+        perror("opendir");
+        return;
+    }
+
+    e = NULL;
+    n = 0;
+    z = 0;
+    total = 0;
+
+    while ((de = readdir(d)) != NULL) {
+        struct stat st;
+
+        if (ends(de->d_name, TMP_SUFFIX)) {
+
+            /* Another process may still be writing to it */
+
+            if (fstatat(dirfd(d), de->d_name, &st, 0) == 0
+                && st.st_mtime < time(NULL) - STALE)
+            {
+                debug("removing %s from cache", de->d_name);
+                if (unlinkat(dirfd(d), de->d_name, 0) == -1)
+                    perror("unlinkat");
+            }
+            continue;
+        }
+
+        if (!ends(de->d_name, SUFFIX))
+            continue;
+
+        if (fstatat(dirfd(d), de->d_name, &st, 0) == -1)
+            continue;
+
+        if (n == z) {
+            z = z ? z * 2 : 64;
+            x = realloc(e, sizeof *e * z);
+            if (x == NULL) {
+                perror("realloc");
+                goto done;
+            }
+            e = x;
+        }
+
+        strcpy(e[n].name, de->d_name);
+        e[n].size = st.st_size;
+        e[n].mtime = st.st_mtime;
+        total += st.st_size;
+        n++;
+    }
+
+    qsort(e, n, sizeof *e, compare);
+
+    for (x = e; x < e + n && total > limit; x++) {
+        debug("evicting %s from cache", x->name);
+        if (unlinkat(dirfd(d), x->name, 0) == -1) {
+            perror("unlinkat");
+            continue;
+        }
+        total -= x->size;
+    }
+
+ done:
+    free(e);
+    if (closedir(d) == -1)
+        abort();
+}
+
+/*
+ * Write the audio of a successfully imported track to the cache
+ *
+ * This is written to a temporary file first, so a partial file is
+ * never used.
+ *
+ * Pre: track has completed import
+ */
+
+void cache_store(struct track *tr)
+{
+    int fd;
+    unsigned int n, s;
+    char name[PATH_MAX], tmp[PATH_MAX + 8];
+    unsigned char *ppm, *overview;
+    struct header h;
+    struct stat st;
+
+    rt_not_allowed();
+
+    if (dir == NULL || tr->length == 0)
+        return;
+
+    if (stat(tr->path, &st) == -1)
+        return;
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MAGIC, sizeof h.magic);
+    h.size = st.st_size;
+    h.mtime = st.st_mtim.tv_sec;
+    h.mtime_nsec = st.st_mtim.tv_nsec;
+    h.rate = tr->rate;
+    h.length = tr->length;
+    h.pathlen = strlen(tr->path);
+
+    /* Gather the meters from across the blocks */
+
+    ppm = malloc(ppm_bytes(tr->length));
+    overview = malloc(overview_bytes(tr->length));
+    if (ppm == NULL || overview == NULL) {
+        perror("malloc");
+        goto out;
+    }
+
+    for (n = 0; n < ppm_bytes(tr->length); n++)
+        ppm[n] = track_get_ppm(tr, n * TRACK_PPM_RES);
+    for (n = 0; n < overview_bytes(tr->length); n++)
+        overview[n] = track_get_overview(tr, n * TRACK_OVERVIEW_RES);
+
+    filename(name, sizeof name, tr->path);
+    snprintf(tmp, sizeof tmp, "%s.tmp", name);
+
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd == -1) {
+        perror("open");
+        goto out;
+    }
+
+    if (write_all(fd, &h, sizeof h) == -1
+        || write_all(fd, tr->path, h.pathlen) == -1
+        || write_all(fd, ppm, ppm_bytes(tr->length)) == -1
+        || write_all(fd, overview, overview_bytes(tr->length)) == -1)
+    {
+        goto fail;
+    }
+
+    for (s = 0; s < tr->length; s += TRACK_BLOCK_SAMPLES) {
+        unsigned int len;
+
+        len = tr->length - s;
+        if (len > TRACK_BLOCK_SAMPLES)
+            len = TRACK_BLOCK_SAMPLES;
+
+        if (write_all(fd, track_get_sample(tr, s), len * SAMPLE) == -1)
+            goto fail;
+    }
+
+    if (close(fd) == -1) {
+        perror("close");
+        goto fail_close;
+    }
+
+    if (rename(tmp, name) == -1) {
+        perror("rename");
+        goto fail_close;
+    }
+
+    trim();
+    goto out;
+
+ fail:
+    perror("write");
+    if (close(fd) == -1)
+        abort();
+ fail_close:
+    if (unlink(tmp) == -1)
+        perror("unlink");
+ out:
+    free(ppm);
+    free(overview);
+}
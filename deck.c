@@ -42,6 +42,7 @@ static const struct record no_record = {
  * reflects the user's view on a deck in the system.
  *
  * Pre: deck->device, deck->timecoder, deck->importer are valid
+ * Pre: deck->resampler is a valid RESAMPLE_ mode
  */
 
 int deck_init(struct deck *deck, struct rt *rt, size_t ncontrol)
@@ -55,9 +56,11 @@ int deck_init(struct deck *deck, struct rt *rt, size_t ncontrol)
 
     deck->ncontrol = ncontrol;
     deck->record = &no_record;
+    deck->preview_at = 0.0;
     deck->punch = NO_PUNCH;
     rate = device_sample_rate(&deck->device);
     player_init(&deck->player, rate, track_get_empty(), &deck->timecoder);
+    player_set_resampler(&deck->player, deck->resampler);
     cues_reset(&deck->cues);
 
     /* The timecoder and player are driven by requests from
@@ -82,6 +85,31 @@ bool deck_is_locked(const struct deck *deck)
     return (deck->protect && player_is_active(&deck->player));
 }
 
+/*
+ * Play a short window of a record, further into it each time the
+ * same record is loaded again
+ */
+
+static void preview(struct deck *deck, struct record *record)
+{
+    struct track *t;
+
+    if (record == deck->record)
+        deck->preview_at += TRACK_PREVIEW;
+    else
+        deck->preview_at = 0.0;
+
+    t = track_get_preview(deck->importer, record->pathname,
+                          deck->preview_at);
+    if (t == NULL)
+        return;
+
+    deck->record = record;
+    player_set_track(&deck->player, t); /* passes reference */
+    player_seek_to(&deck->player, deck->preview_at);
+    player_set_pitch(&deck->player, 1.0);
+}
+
 /*
  * Load a record from the library to a deck
  */
@@ -90,6 +118,11 @@ void deck_load(struct deck *deck, struct record *record)
 {
     struct track *t;
 
+    if (deck->preview) {
+        preview(deck, record);
+        return;
+    }
+
     if (deck_is_locked(deck))
         return;
 
@@ -35,10 +35,13 @@ struct deck {
     struct device device;
     struct timecoder timecoder;
     const char *importer;
-    bool protect;
+    bool protect,
+        preview; /* plays a short window of each record loaded */
+    int resampler;
 
     struct player player;
     const struct record *record;
+    double preview_at; /* seconds into the record */
     struct cues cues;
 
     /* Punch */
@@ -130,3 +130,31 @@ void device_collect(struct device *dv, signed short *pcm, size_t n)
     assert(dv->player != NULL);
     player_collect(dv->player, pcm, n);
 }
+
+/*
+ * Equivalent to device_submit(), for floating point audio where full
+ * scale is 1.0
+ *
+ * Pre: channel c of sample s is at pcm[c][s * stride]
+ */
+
+void device_submit_float(struct device *dv, const float *pcm[],
+                         unsigned stride, size_t n)
+{
+    assert(dv->timecoder != NULL);
+    timecoder_submit_float(dv->timecoder, pcm, stride, n);
+}
+
+/*
+ * Equivalent to device_collect(), for floating point audio where full
+ * scale is 1.0
+ *
+ * Post: channel c of sample s is written to pcm[c][s * stride]
+ */
+
+void device_collect_float(struct device *dv, float *pcm[], unsigned stride,
+                          size_t n)
+{
+    assert(dv->player != NULL);
+    player_collect_float(dv->player, pcm, stride, n);
+}
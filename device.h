@@ -60,4 +60,9 @@ int device_handle(struct device *dv);
 void device_submit(struct device *dv, signed short *pcm, size_t npcm);
 void device_collect(struct device *dv, signed short *pcm, size_t npcm);
 
+void device_submit_float(struct device *dv, const float *pcm[],
+                         unsigned stride, size_t npcm);
+void device_collect_float(struct device *dv, float *pcm[], unsigned stride,
+                          size_t npcm);
+
 #endif
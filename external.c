@@ -25,6 +25,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 
 #include "debug.h"
@@ -32,14 +35,47 @@
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
+/* The C library has no wrapper for setting I/O priority */
+
+#define IOPRIO_CLASS_BE 2
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_LOWEST 7
+
+/*
+ * Set the nice value of the calling process, and lower its I/O
+ * priority to go with it
+ *
+ * A failure is not fatal; the process is just not lowered.
+ */
+
+static void lower_priority(int nice)
+{
+    if (setpriority(PRIO_PROCESS, 0, nice) == -1)
+        perror("setpriority");
+
+#ifdef SYS_ioprio_set
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT | IOPRIO_LOWEST) == -1)
+    {
+        perror("ioprio_set");
+    }
+#endif
+}
+
 /*
- * Fork a child process, attaching stdout to the given pipe
+ * Fork a child process, attaching stdout to the given pipe, and stdin
+ * too if it is duplex
+ *
+ * A non-zero nice value is given to the child, and anything it runs,
+ * along with the lowest I/O priority.
  *
  * Return: -1 on error, or pid on success
  * Post: on success, *fd is file handle for reading
  */
 
-static pid_t do_fork(int pp[2], const char *path, char *argv[])
+static pid_t do_fork(int pp[2], bool duplex, int nice, const char *path,
+                     char *argv[])
 {
     pid_t pid;
 
@@ -58,9 +94,17 @@ static pid_t do_fork(int pp[2], const char *path, char *argv[])
             _exit(EXIT_FAILURE); /* vfork() was used */
         }
 
+        if (duplex && dup2(pp[1], STDIN_FILENO) == -1) {
+            perror("dup2");
+            _exit(EXIT_FAILURE);
+        }
+
         if (close(pp[1]) != 0)
             abort();
 
+        if (nice != 0)
+            lower_priority(nice);
+
         if (execv(path, argv) == -1) {
             perror(path);
             _exit(EXIT_FAILURE); /* vfork() was used */
@@ -84,7 +128,8 @@ static pid_t do_fork(int pp[2], const char *path, char *argv[])
  * forked.
  */
 
-static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
+static pid_t vext(int pp[2], bool duplex, int nice, const char *path,
+                  char *arg, va_list ap)
 {
     char *args[16];
     size_t n;
@@ -105,7 +150,7 @@ static pid_t vext(int pp[2], const char *path, char *arg, va_list ap)
             break;
     }
 
-    return do_fork(pp, path, args);
+    return do_fork(pp, duplex, nice, path, args);
 }
 
 /*
@@ -128,7 +173,7 @@ pid_t fork_pipe(int *fd, const char *path, char *arg, ...)
     }
 
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vext(pp, false, 0, path, arg, va);
     va_end(va);
 
     if (r == -1) {
@@ -161,13 +206,13 @@ static int make_non_blocking(int fd)
 
 /*
  * Fork a child process with stdout connected to this process
- * via a non-blocking pipe
+ * via a non-blocking pipe, at the given nice value
  *
  * Return: PID on success, otherwise -1
  * Post: on success, *fd is non-blocking file descriptor for reading
  */
 
-pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...)
+pid_t fork_pipe_nb(int *fd, int nice, const char *path, char *arg, ...)
 {
     int pp[2];
     pid_t r;
@@ -182,7 +227,7 @@ pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...)
         goto fail;
 
     va_start(va, arg);
-    r = vext(pp, path, arg, va);
+    r = vext(pp, false, nice, path, arg, va);
     va_end(va);
 
     assert(r != 0);
@@ -201,6 +246,43 @@ fail:
     return -1;
 }
 
+/*
+ * Fork a child process with both stdin and stdout connected to this
+ * process via a socket, at the given nice value
+ *
+ * Return: PID on success, otherwise -1
+ * Post: on success, *fd is file descriptor for reading and writing
+ */
+
+pid_t fork_socket(int *fd, int nice, const char *path, char *arg, ...)
+{
+    int sv[2];
+    pid_t r;
+    va_list va;
+
+    /* Only the child's stdin and stdout, which are duplicates, are
+     * inherited by anything else we run */
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) == -1) {
+        perror("socketpair");
+        return -1;
+    }
+
+    va_start(va, arg);
+    r = vext(sv, true, nice, path, arg, va);
+    va_end(va);
+
+    if (r == -1) {
+        if (close(sv[0]) != 0)
+            abort();
+        if (close(sv[1]) != 0)
+            abort();
+    }
+
+    *fd = sv[0];
+    return r;
+}
+
 static bool is_delim(char c)
 {
     return (c == '\t' || c == '\n');
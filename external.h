@@ -29,7 +29,8 @@
 #include <unistd.h>
 
 pid_t fork_pipe(int *fd, const char *path, char *arg, ...);
-pid_t fork_pipe_nb(int *fd, const char *path, char *arg, ...);
+pid_t fork_pipe_nb(int *fd, int nice, const char *path, char *arg, ...);
+pid_t fork_socket(int *fd, int nice, const char *path, char *arg, ...);
 
 char* read_field(int fd, char *buf, size_t *fill, size_t len);
 
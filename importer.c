@@ -0,0 +1,633 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * An importer run with the single argument "--serve" can reply
+ * "ready", and then stay running as a helper. It takes each import
+ * as a request on its stdin and writes the audio to a named pipe,
+ * which saves launching the importer itself every time a track is
+ * loaded. Any other importer is run once for each import, as before.
+ *
+ * A request is an identifier, the named pipe, then the arguments
+ * usually given to the importer; one to a line. The helper replies
+ * "<id> status <n>" with the exit status of the import. The request
+ * "kill <id>" asks the helper to stop an import, as only the helper
+ * knows if the process is still there to be signalled.
+ *
+ * Nothing here waits on a helper, as it is done with the rig lock
+ * held; the replies are taken by importer_handle() as they arrive.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "debug.h"
+#include "external.h"
+#include "importer.h"
+#include "list.h"
+
+#define HELPERS IMPORTER_POLLFDS /* importers which can have a helper */
+
+#define SERVE "--serve"
+#define READY "ready"
+
+struct helper {
+    const char *importer;
+    pid_t pid; /* or 0 if the importer is run for each import */
+    bool ready; /* has replied, so is known to be a helper */
+    int fd;
+    struct pollfd *pe;
+    char buf[256];
+    size_t fill;
+};
+
+/*
+ * An import, which is running in a helper or was run by us
+ */
+
+struct import_job {
+    struct list jobs;
+    struct helper *helper; /* or NULL if the importer was run by us */
+    unsigned int id;
+    pid_t pid; /* of an importer run by us */
+    bool finished,
+        forgotten; /* to be freed once it has finished */
+    int status; /* as given by waitpid() */
+};
+
+static struct helper helpers[HELPERS];
+static size_t nhelpers = 0;
+
+static struct list jobs = LIST_INIT(jobs);
+static unsigned int next_id = 0;
+
+static char dir[] = "/tmp/xwax-XXXXXX"; /* for the named pipes */
+static bool have_dir = false;
+
+/*
+ * Finish with an import
+ */
+
+static void free_job(struct import_job *j)
+{
+    char fifo[PATH_MAX];
+
+    /* The name of the pipe is kept until now, in case the helper had
+     * not yet opened it */
+
+    if (j->helper != NULL) {
+        snprintf(fifo, sizeof fifo, "%s/%u", dir, j->id);
+        if (unlink(fifo) == -1 && errno != ENOENT)
+            perror("unlink");
+    }
+
+    list_del(&j->jobs);
+    free(j);
+}
+
+/*
+ * Stop using a helper, and finish any imports which were running
+ * in it
+ *
+ * Closing the socket asks the helper to exit.
+ */
+
+static void lose(struct helper *h)
+{
+    struct import_job *j, *x;
+
+    if (close(h->fd) == -1)
+        abort();
+
+    if (waitpid(h->pid, NULL, 0) == -1)
+        abort();
+
+    list_for_each_safe(j, x, &jobs, jobs) {
+        if (j->helper != h || j->finished)
+            continue;
+
+        if (j->forgotten) {
+            free_job(j);
+        } else {
+            j->finished = true;
+            j->status = W_EXITCODE(EXIT_FAILURE, 0);
+        }
+    }
+
+    h->pid = 0;
+}
+
+/*
+ * Stop using a helper which is not behaving as one
+ *
+ * It is our child, not yet waited for, so it can be signalled.
+ */
+
+static void reject(struct helper *h)
+{
+    if (kill(h->pid, SIGTERM) == -1)
+        abort();
+    lose(h);
+}
+
+/*
+ * Start the importer as a helper, if it is able to be one
+ *
+ * Whether it is a helper is known once it replies; until then the
+ * importer is run for each import.
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int launch(struct helper *h, int nice)
+{
+    if (!have_dir) {
+        if (mkdtemp(dir) == NULL) {
+            perror("mkdtemp");
+            return -1;
+        }
+        have_dir = true;
+    }
+
+    h->pid = fork_socket(&h->fd, nice, h->importer, "import", SERVE, NULL);
+    if (h->pid == -1) {
+        h->pid = 0;
+        return -1;
+    }
+
+    if (fcntl(h->fd, F_SETFL, O_NONBLOCK) == -1) {
+        perror("fcntl");
+        reject(h);
+        return -1;
+    }
+
+    h->ready = false;
+    h->pe = NULL;
+    h->fill = 0;
+
+    return 0;
+}
+
+/*
+ * Return: the helper for the given importer, or NULL if there is
+ * none ready
+ */
+
+static struct helper* get_helper(const char *importer, int nice)
+{
+    size_t n;
+    struct helper *h;
+
+    for (n = 0; n < nhelpers; n++) {
+        h = &helpers[n];
+        if (strcmp(h->importer, importer) == 0)
+            return (h->pid != 0 && h->ready) ? h : NULL;
+    }
+
+    if (nhelpers == HELPERS)
+        return NULL;
+
+    h = &helpers[nhelpers++];
+    h->importer = importer;
+    launch(h, nice);
+
+    return NULL; /* not until it replies */
+}
+
+/*
+ * Act on a reply from a helper
+ */
+
+static void reply(struct helper *h, const char *line)
+{
+    char word[16];
+    unsigned int id;
+    int value;
+    struct import_job *j;
+
+    if (sscanf(line, "%u %15s %d", &id, word, &value) != 3
+        || strcmp(word, "status") != 0)
+    {
+        fprintf(stderr, "Import helper gave a malformed reply.\n");
+        return;
+    }
+
+    list_for_each(j, &jobs, jobs) {
+        if (j->helper != h || j->id != id)
+            continue;
+
+        if (j->forgotten) {
+            free_job(j);
+        } else {
+            j->finished = true;
+            j->status = W_EXITCODE(value, 0);
+        }
+
+        break;
+    }
+}
+
+/*
+ * Take the replies which have arrived from a helper, without waiting
+ * for any more
+ */
+
+static void receive(struct helper *h)
+{
+    char *line;
+
+    for (;;) {
+        errno = 0; /* not set at end of file */
+        line = read_field(h->fd, h->buf, &h->fill, sizeof h->buf);
+
+        if (line == NULL) {
+            if (errno == EAGAIN || errno == EINTR)
+                return;
+
+            if (h->ready) {
+                fprintf(stderr, "Import helper %s has gone.\n",
+                        h->importer);
+                lose(h);
+            } else {
+                goto reject;
+            }
+            return;
+        }
+
+        if (!h->ready) {
+            if (strcmp(line, READY) != 0) {
+                free(line);
+                goto reject;
+            }
+
+            debug("importer %s is a helper, pid %d", h->importer, h->pid);
+            h->ready = true;
+
+        } else {
+            reply(h, line);
+        }
+
+        free(line);
+    }
+
+ reject:
+    /* An importer which can't be a helper will most likely fail on
+     * the argument it was given, or send something else */
+
+    fprintf(stderr, "Importer %s is not a helper; running it each time.\n",
+            h->importer);
+    reject(h);
+}
+
+/*
+ * Get entries for use by poll(); at most IMPORTER_POLLFDS
+ *
+ * Return: number of entries used
+ * Post: pe contains poll entries
+ */
+
+int importer_pollfd(struct pollfd *pe)
+{
+    size_t n;
+    int r;
+
+    r = 0;
+
+    for (n = 0; n < nhelpers; n++) {
+        struct helper *h = &helpers[n];
+
+        h->pe = NULL;
+        if (h->pid == 0)
+            continue;
+
+        pe->fd = h->fd;
+        pe->events = POLLIN;
+        h->pe = pe++;
+        r++;
+    }
+
+    return r;
+}
+
+/*
+ * Take any replies from helpers, following a poll()
+ */
+
+void importer_handle(void)
+{
+    size_t n;
+
+    for (n = 0; n < nhelpers; n++) {
+        struct helper *h = &helpers[n];
+
+        if (h->pid != 0 && h->pe != NULL && h->pe->revents != 0)
+            receive(h);
+    }
+}
+
+/*
+ * Write exactly the given number of bytes to a socket
+ *
+ * The requests are small, so a helper which can't take one straight
+ * away is not keeping up.
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int send_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t z;
+
+        z = send(fd, buf, len, MSG_NOSIGNAL);
+        if (z == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Send a request to a helper, rejecting it if this is not possible
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int send_request(struct helper *h, const char *req, size_t len)
+{
+    if (send_all(h->fd, req, len) == -1) {
+        perror("send");
+        reject(h);
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Ask a helper to run an import
+ *
+ * Return: the import on success, otherwise NULL
+ * Post: on success, *fd is non-blocking file descriptor for reading
+ */
+
+static struct import_job* request(struct helper *h, int *fd,
+                                  const char *path, const char *rate,
+                                  const char *seek)
+{
+    int rfd, len;
+    char fifo[PATH_MAX], req[PATH_MAX + 256];
+    struct import_job *j;
+
+    if (strchr(path, '\n') != NULL)
+        return NULL; /* not possible in a request */
+
+    j = malloc(sizeof *j);
+    if (j == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    j->helper = h;
+    j->id = next_id++;
+    j->pid = 0;
+    j->finished = false;
+    j->forgotten = false;
+
+    snprintf(fifo, sizeof fifo, "%s/%u", dir, j->id);
+
+    len = snprintf(req, sizeof req, "%u\n%s\n%s\n%s\n%s\n",
+                   j->id, fifo, path, rate, seek ? seek : "");
+    if (len >= (int)sizeof req)
+        goto fail;
+
+    if (mkfifo(fifo, 0600) == -1) {
+        perror("mkfifo");
+        goto fail;
+    }
+
+    /* Open our end first, so the helper does not block opening its
+     * end. Until it has done so there is no end of file, and nothing
+     * to poll() */
+
+    rfd = open(fifo, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (rfd == -1) {
+        perror("open");
+        goto fail_fifo;
+    }
+
+    if (send_request(h, req, len) == -1) {
+        if (close(rfd) == -1)
+            abort();
+        goto fail_fifo;
+    }
+
+    list_add(&j->jobs, &jobs);
+
+    *fd = rfd;
+    return j;
+
+ fail_fifo:
+    if (unlink(fifo) == -1)
+        perror("unlink");
+ fail:
+    free(j);
+    return NULL;
+}
+
+/*
+ * Run the importer for an import of our own
+ *
+ * Return: the import on success, otherwise NULL
+ * Post: on success, *fd is non-blocking file descriptor for reading
+ */
+
+static struct import_job* run(int *fd, int nice, const char *importer,
+                              const char *path, const char *rate,
+                              const char *seek)
+{
+    struct import_job *j;
+
+    j = malloc(sizeof *j);
+    if (j == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    j->pid = fork_pipe_nb(fd, nice, importer, "import", path, rate, seek,
+                          NULL);
+    if (j->pid == -1) {
+        free(j);
+        return NULL;
+    }
+
+    j->helper = NULL;
+    j->finished = false;
+    j->forgotten = false;
+    list_add(&j->jobs, &jobs);
+
+    return j;
+}
+
+/*
+ * Start an import of the given file, through a helper if the
+ * importer is able to be one, otherwise by running the importer
+ *
+ * Return: the import on success, otherwise NULL
+ * Post: on success, *fd is non-blocking file descriptor for reading
+ */
+
+struct import_job* importer_start(int *fd, int nice, const char *importer,
+                                  const char *path, const char *rate,
+                                  const char *seek)
+{
+    struct helper *h;
+    struct import_job *j;
+
+    h = get_helper(importer, nice);
+    if (h != NULL) {
+        j = request(h, fd, path, rate, seek);
+        if (j != NULL)
+            return j;
+    }
+
+    return run(fd, nice, importer, path, rate, seek);
+}
+
+/*
+ * Request that an import stops
+ */
+
+void importer_kill(struct import_job *j)
+{
+    int len;
+    char req[32];
+
+    if (j->finished)
+        return;
+
+    if (j->helper == NULL) {
+        if (kill(j->pid, SIGTERM) == -1)
+            abort();
+        return;
+    }
+
+    len = snprintf(req, sizeof req, "kill %u\n", j->id);
+    send_request(j->helper, req, len);
+}
+
+/*
+ * See if an import has exited, and finish with it if so
+ *
+ * An importer run by us is waited for, as it is expected to exit once
+ * its output has been closed.
+ *
+ * Return: true if the import has exited, otherwise false
+ * Post: if true is returned, *status is its exit status, as given by
+ * waitpid(), and the import must not be used again
+ */
+
+bool importer_exited(struct import_job *j, int *status)
+{
+    if (j->helper == NULL && !j->finished) {
+        if (waitpid(j->pid, &j->status, 0) == -1)
+            abort();
+        j->finished = true;
+    }
+
+    if (!j->finished)
+        return false;
+
+    *status = j->status;
+    free_job(j);
+
+    return true;
+}
+
+/*
+ * Stop an import which is no longer of any interest
+ *
+ * Post: the import must not be used again
+ */
+
+void importer_forget(struct import_job *j)
+{
+    int status;
+
+    importer_kill(j);
+
+    if (j->helper == NULL || j->finished) {
+        importer_exited(j, &status);
+        return;
+    }
+
+    j->forgotten = true; /* until the helper replies */
+}
+
+/*
+ * Stop all helpers
+ *
+ * Pre: no imports are running
+ */
+
+void importer_clear(void)
+{
+    size_t n;
+    struct import_job *j, *x;
+
+    for (n = 0; n < nhelpers; n++) {
+        struct helper *h = &helpers[n];
+
+        if (h->pid == 0)
+            continue;
+
+        if (h->ready)
+            lose(h);
+        else
+            reject(h);
+    }
+
+    nhelpers = 0;
+
+    /* Imports which were forgotten may never have had a reply */
+
+    list_for_each_safe(j, x, &jobs, jobs)
+        free_job(j);
+
+    if (have_dir && rmdir(dir) == -1)
+        perror("rmdir");
+}
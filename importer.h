@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Launching of importers, through a helper which stays running if
+ * the importer is able to be one
+ */
+
+#ifndef IMPORTER_H
+#define IMPORTER_H
+
+#include <stdbool.h>
+#include <sys/poll.h>
+#include <sys/types.h>
+
+#define IMPORTER_POLLFDS 4 /* most entries used by the helpers */
+
+struct import_job;
+
+struct import_job* importer_start(int *fd, int nice, const char *importer,
+                                  const char *path, const char *rate,
+                                  const char *seek);
+void importer_kill(struct import_job *j);
+bool importer_exited(struct import_job *j, int *status);
+void importer_forget(struct import_job *j);
+
+int importer_pollfd(struct pollfd *pe);
+void importer_handle(void);
+
+void importer_clear(void);
+
+#endif
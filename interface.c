@@ -34,10 +34,13 @@
 
 #include "interface.h"
 #include "player.h"
+#include "prefetch.h"
+#include "resample.h"
 #include "rig.h"
 #include "selector.h"
 #include "status.h"
 #include "timecoder.h"
+#include "track.h"
 #include "osc.h"
 #include "xwax.h"
 
@@ -94,6 +97,7 @@
 #define BPM_WIDTH 32
 #define SORT_WIDTH 22
 #define RESULTS_ARTIST_WIDTH 200
+#define MEMORY_WIDTH 160
 
 #define TOKEN_SPACE 2
 
@@ -106,6 +110,8 @@
 
 #define METER_WARNING_TIME 20 /* time in seconds for "red waveform" warning */
 
+#define PREFETCH_DELAY 500 /* ms the selection must rest before importing */
+
 /* Function key (F1-F12) definitions */
 
 #define FUNC_LOAD 0
@@ -160,6 +166,10 @@ static int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT,
     meter_scale = DEFAULT_METER_SCALE;
 static pthread_t ph;
 static struct selector selector;
+static size_t shown_memory = 0, shown_retained = 0;
+
+static bool prefetch_pending = false;
+static Uint32 prefetch_due;
 
 struct rect {
     signed short x, y, w, h;
@@ -713,6 +723,8 @@ static void draw_scope(SDL_Surface *surface, const struct rect *rect,
     int r, c, v, mid;
     Uint8 *p;
 
+    timecoder_monitor_update(tc);
+
     mid = tc->mon_size / 2;
 
     for (r = 0; r < tc->mon_size; r++) {
@@ -836,7 +848,7 @@ static void draw_deck_clocks(SDL_Surface *surface, const struct rect *rect,
 static void draw_overview(SDL_Surface *surface, const struct rect *rect,
                           struct track *tr, int position)
 {
-    int x, y, w, h, r, c, sp, fade, bytes_per_pixel, pitch, height,
+    int x, y, w, h, r, c, sp, ep, fade, bytes_per_pixel, pitch, height,
         current_position;
     Uint8 *pixels, *p;
     SDL_Color col;
@@ -860,11 +872,9 @@ static void draw_overview(SDL_Surface *surface, const struct rect *rect,
         /* Collect the correct meter value for this column */
 
         sp = (long long)tr->length * c / w;
+        ep = (long long)tr->length * (c + 1) / w;
 
-        if (sp < tr->length) /* account for rounding */
-            height = track_get_overview(tr, sp) * h / 256;
-        else
-            height = 0;
+        height = track_get_overview_peak(tr, sp, ep) * h / 256;
 
         /* Choose a base colour to display in */
 
@@ -944,10 +954,7 @@ static void draw_closeup(SDL_Surface *surface, const struct rect *rect,
         sp = position - (position % (1 << scale))
             + ((c - w / 2) << scale);
 
-        if (sp < tr->length && sp > 0)
-            height = track_get_ppm(tr, sp) * h / 256;
-        else
-            height = 0;
+        height = track_get_ppm_peak(tr, sp, sp + (1 << scale)) * h / 256;
 
         /* Select the appropriate colour */
 
@@ -1044,7 +1051,7 @@ static void draw_deck_status(SDL_Surface *surface,
                              const struct rect *rect,
                              const struct deck *deck)
 {
-    char buf[128], *c;
+    char buf[160], *c;
     int tc;
     const struct player *pl = &deck->player;
 
@@ -1055,15 +1062,24 @@ static void draw_deck_status(SDL_Surface *surface,
     tc = timecoder_get_position(pl->timecoder, NULL);
     if (pl->timecode_control && tc != -1) {
         c += sprintf(c, "%7d ", tc);
+    } else if (timecoder_lookup_failed(pl->timecoder->def)) {
+        c += sprintf(c, "%7s ", "no LUT");
+    } else if (!timecoder_has_lookup(pl->timecoder->def)) {
+        c += sprintf(c, "%7s ", "LUT...");
     } else {
         c += sprintf(c, "        ");
     }
 
-    sprintf(c, "pitch:%+0.2f (sync %0.2f %+.5fs = %+0.2f)  %s%s",
-            pl->pitch,
-            pl->sync_pitch,
-            pl->last_difference,
-            pl->pitch * pl->sync_pitch,
+    c += sprintf(c, "pitch:%+0.2f (sync %0.2f %+.5fs = %+0.2f)  ",
+                 pl->pitch,
+                 pl->sync_pitch,
+                 pl->last_difference,
+                 pl->pitch * pl->sync_pitch);
+
+    sprintf(c, "%s %.0fus %.1f%%  %s%s",
+            resample_name(pl->resampler),
+            pl->cost * 1e6,
+            pl->load * 100,
             pl->recalibrate ? "RCAL  " : "",
             deck_is_locked(deck) ? "LOCK  " : "");
 
@@ -1135,10 +1151,28 @@ static void draw_decks(SDL_Surface *surface, const struct rect *rect,
 
 static void draw_status(SDL_Surface *sf, const struct rect *rect)
 {
+    char buf[64];
+    struct rect left, right;
+
+    /* Memory used by tracks is given on the right, if there is room */
+
+    if (rect->w > MEMORY_WIDTH * 4) {
+        split_right(rect, &left, &right, MEMORY_WIDTH, SPACER);
+
+        shown_memory = track_memory();
+        shown_retained = track_retained();
+
+        snprintf(buf, sizeof buf, "%zuMb (%zuMb unused)",
+                 shown_memory >> 20, shown_retained >> 20);
+        draw_text(sf, &right, buf, detail_font, detail_col, background_col);
+    } else {
+        left = *rect;
+    }
+
     if (status_level() >= STATUS_ERROR)
-        draw_text(sf, rect, status(), detail_font, text_col, dim(warn_col, 2));
+        draw_text(sf, &left, status(), detail_font, text_col, dim(warn_col, 2));
     else
-        draw_text(sf, rect, status(), detail_font, detail_col, background_col);
+        draw_text(sf, &left, status(), detail_font, detail_col, background_col);
 }
 
 /*
@@ -1377,6 +1411,28 @@ static void draw_library(SDL_Surface *surface, const struct rect *rect,
     }
 }
 
+/*
+ * Import the selected record in advance, once the selection has
+ * stayed still for a while, and not while scrolling through
+ */
+
+static void prefetch_later(void)
+{
+    prefetch_pending = true;
+    prefetch_due = SDL_GetTicks() + PREFETCH_DELAY;
+}
+
+static void prefetch_if_due(void)
+{
+    if (!prefetch_pending || (Sint32)(SDL_GetTicks() - prefetch_due) < 0)
+        return;
+
+    if (ndeck > 0)
+        prefetch_selection(&selector, deck[0].importer);
+
+    prefetch_pending = false;
+}
+
 /*
  * Handle a single key event
  *
@@ -1600,6 +1656,7 @@ static int interface_main(void)
 
     timer = SDL_AddTimer(REFRESH, ticker, NULL);
 
+    prefetch_later();
     rig_lock();
 
     for (;;) {
@@ -1632,6 +1689,14 @@ static int interface_main(void)
             switch (event.user.code) {
             case EVENT_TICKER: /* request to poll the clocks */
                 decks_update = true;
+                player_reclaim(); /* tracks replaced from this thread */
+                prefetch_if_due();
+
+                if (track_memory() != shown_memory
+                    || track_retained() != shown_retained)
+                {
+                    status_update = true;
+                }
                 break;
 
             case EVENT_QUIT: /* internal request to finish this thread */
@@ -1658,6 +1723,7 @@ static int interface_main(void)
                     status_set(STATUS_VERBOSE, "No search results found");
                 }
 
+                prefetch_later();
                 library_update = true;
             }
 
@@ -1712,6 +1778,7 @@ static int interface_main(void)
     } /* main loop */
 
  finish:
+    prefetch_clear();
     rig_unlock();
 
     SDL_RemoveTimer(timer);
@@ -1824,7 +1891,6 @@ int interface_start(struct library *lib, const char *geo)
 
 void interface_stop(void)
 {
-    size_t n;
     SDL_Event quit;
 
     quit.type = SDL_USEREVENT;
@@ -1835,9 +1901,6 @@ void interface_stop(void)
     if (pthread_join(ph, NULL) != 0)
         abort();
 
-    for (n = 0; n < ndeck; n++)
-        timecoder_monitor_clear(&deck[n].timecoder);
-
     selector_clear(&selector);
 
     clear_fonts();
@@ -1845,3 +1908,17 @@ void interface_stop(void)
     TTF_Quit();
     SDL_Quit();
 }
+
+/*
+ * Free the scopes, which the realtime thread gives audio to
+ *
+ * Pre: interface is stopped, and so is the realtime thread
+ */
+
+void interface_clear(void)
+{
+    size_t n;
+
+    for (n = 0; n < ndeck; n++)
+        timecoder_monitor_clear(&deck[n].timecoder);
+}
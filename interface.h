@@ -25,5 +25,6 @@
 
 int interface_start(struct library *lib, const char *geo);
 void interface_stop();
+void interface_clear();
 
 #endif
@@ -26,9 +26,6 @@
 #include "device.h"
 #include "jack.h"
 
-#define MAX_BLOCK 512 /* samples */
-#define SCALE 32768
-
 
 struct jack {
     bool started;
@@ -43,46 +40,17 @@ static unsigned rate,
 static struct device *device[4];
 
 
-/* Interleave samples from a set of JACK buffers into a local buffer */
-
-static void interleave(signed short *buf, jack_default_audio_sample_t *jbuf[],
-                       jack_nframes_t nframes)
-{
-    int n;
-    while (nframes--) {
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *buf = (signed short)(*jbuf[n] * SCALE);
-            buf++;
-            jbuf[n]++;
-        }
-    }
-}
-
-
-/* Uninterleave samples from a local buffer into a set of JACK buffers */
-
-static void uninterleave(jack_default_audio_sample_t *jbuf[],
-                         signed short *buf, jack_nframes_t nframes)
-{
-    int n;
-    while (nframes--) {
-        for (n = 0; n < DEVICE_CHANNELS; n++) {
-            *jbuf[n] = (jack_default_audio_sample_t)*buf / SCALE;
-            buf++;
-            jbuf[n]++;
-        }
-    }
-}
-
-
 /* Process the given number of frames of audio on input and output
- * of the given JACK device */
+ * of the given JACK device
+ *
+ * JACK buffers are floating point, one per channel, which the
+ * timecoder and player can work on directly in a single pass. */
 
 static void process_deck(struct device *dv, jack_nframes_t nframes)
 {
     int n;
-    jack_default_audio_sample_t *in[DEVICE_CHANNELS], *out[DEVICE_CHANNELS];
-    jack_nframes_t remain;
+    const jack_default_audio_sample_t *in[DEVICE_CHANNELS];
+    jack_default_audio_sample_t *out[DEVICE_CHANNELS];
     struct jack *jack = (struct jack*)dv->local;
 
     assert(dv->timecoder != NULL);
@@ -95,31 +63,8 @@ static void process_deck(struct device *dv, jack_nframes_t nframes)
         assert(out[n] != NULL);
     }
 
-    /* For large values of nframes, communicate with the timecoder and
-     * player in smaller blocks */
-
-    remain = nframes;
-    while (remain > 0) {
-        signed short buf[MAX_BLOCK * DEVICE_CHANNELS];
-        jack_nframes_t block;
-
-        if (remain < MAX_BLOCK)
-            block = remain;
-        else
-            block = MAX_BLOCK;
-
-        /* Timecode input */
-
-        interleave(buf, in, block);
-        device_submit(dv, buf, block);
-
-        /* Audio output -- handle in the same loop for finer granularity */
-
-        device_collect(dv, buf, block);
-        uninterleave(out, buf, block);
-
-	remain -= block;
-    }
+    device_submit_float(dv, in, 1, nframes);
+    device_collect_float(dv, out, 1, nframes);
 }
 
 
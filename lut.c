@@ -17,8 +17,16 @@
  *
  */
 
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "lut.h"
 
@@ -30,11 +38,81 @@
 #define HASH(timecode) ((timecode) & ((1 << HASH_BITS) - 1))
 #define NO_SLOT ((unsigned)-1)
 
+/* A direct table is used in place of hashing where it takes no more
+ * than this many times the memory. It is a single access, not a walk
+ * along a chain of slots scattered in memory */
 
-/* Initialise an empty hash lookup table to store the given number
- * of timecode -> position lookups */
+#define DIRECT_COST 2
 
-int lut_init(struct lut *lut, int nslots)
+#define MAGIC "xwaxlut1"
+
+/*
+ * A saved table is this header, then the table and the slots (if
+ * any) exactly as they are in memory; in native byte order
+ */
+
+struct header {
+    char magic[8];
+    uint32_t nslots, bits;
+};
+
+/*
+ * Return: true if a table for the given timecodes is to be direct
+ */
+
+static bool is_direct(int nslots, int bits)
+{
+    size_t bytes;
+
+    bytes = sizeof(struct slot) * nslots
+        + sizeof(slot_no_t) * (1 << HASH_BITS);
+
+    return bits < 32 && sizeof(slot_no_t) << bits <= bytes * DIRECT_COST;
+}
+
+/*
+ * Return: the number of entries in the table itself
+ */
+
+static size_t entries(struct lut *lut)
+{
+    return lut->slot == NULL ? lut->codes : 1 << HASH_BITS;
+}
+
+
+/* Initialise an empty direct lookup table, with an entry for every
+ * possible timecode */
+
+static int init_direct(struct lut *lut, unsigned int codes)
+{
+    unsigned int n;
+
+    fprintf(stderr, "Lookup table has %u direct entries (%zuKb)\n",
+            codes, sizeof(slot_no_t) * codes / 1024);
+
+    lut->table = malloc(sizeof(slot_no_t) * codes);
+    if (lut->table == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (n = 0; n < codes; n++)
+        lut->table[n] = NO_SLOT;
+
+    lut->slot = NULL;
+    lut->codes = codes;
+    lut->avail = 0;
+    lut->map = NULL;
+
+    return 0;
+}
+
+
+/* Initialise an empty lookup table to store the given number of
+ * timecode -> position lookups, for timecodes of the given number
+ * of bits */
+
+int lut_init(struct lut *lut, int nslots, int bits)
 {
     int n, hashes;
     size_t bytes;
@@ -42,6 +120,11 @@ int lut_init(struct lut *lut, int nslots)
     hashes = 1 << HASH_BITS;
     bytes = sizeof(struct slot) * nslots + sizeof(slot_no_t) * hashes;
 
+    if (is_direct(nslots, bits)) {
+        lut->bits = bits;
+        return init_direct(lut, 1 << bits);
+    }
+
     fprintf(stderr, "Lookup table has %d hashes to %d slots"
             " (%d slots per hash, %zuKb)\n",
             hashes, nslots, nslots / hashes, bytes / 1024);
@@ -55,13 +138,123 @@ int lut_init(struct lut *lut, int nslots)
     lut->table = malloc(sizeof(slot_no_t) * hashes);
     if (lut->table == NULL) {
         perror("malloc");
+        free(lut->slot);
         return -1;
     }
 
     for (n = 0; n < hashes; n++)
         lut->table[n] = NO_SLOT;
 
+    lut->bits = bits;
     lut->avail = 0;
+    lut->map = NULL;
+
+    return 0;
+}
+
+
+/*
+ * Check that a table read from a file refers only to slots which
+ * exist, and that no chain of slots loops; a file which is corrupt
+ * must not lead a lookup astray
+ *
+ * Return: true if the table is safe to use
+ */
+
+static bool sane(const slot_no_t *table, size_t n,
+                 const struct slot *slot, unsigned int nslots)
+{
+    size_t i;
+
+    for (i = 0; i < n; i++) {
+        if (table[i] != NO_SLOT && table[i] >= nslots)
+            return false;
+    }
+
+    if (slot == NULL)
+        return true;
+
+    /* lut_push() links each slot only to one pushed before it */
+
+    for (i = 0; i < nslots; i++) {
+        if (slot[i].next != NO_SLOT && slot[i].next >= i)
+            return false;
+    }
+
+    return true;
+}
+
+
+/*
+ * Use a table previously written by lut_save(), by mapping the file
+ * read-only. The pages are shared with any other process using the
+ * same file
+ *
+ * Return: 0 on success, or -1 if there is no usable table in the file
+ */
+
+int lut_map(struct lut *lut, const char *pathname, int nslots, int bits)
+{
+    int fd;
+    size_t n, bytes;
+    bool direct;
+    slot_no_t *table;
+    struct header *h;
+    struct slot *slot;
+    struct stat st;
+
+    direct = is_direct(nslots, bits);
+
+    n = direct ? 1 << bits : 1 << HASH_BITS;
+    bytes = sizeof *h + sizeof(slot_no_t) * n;
+    if (!direct)
+        bytes += sizeof(struct slot) * nslots;
+
+    fd = open(pathname, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    /* A file cut short, eg. by a full disk, is not used */
+
+    if (fstat(fd, &st) == -1 || st.st_size != bytes) {
+        if (close(fd) == -1)
+            abort();
+        return -1;
+    }
+
+    h = mmap(NULL, bytes, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (close(fd) == -1)
+        abort();
+
+    if (h == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    table = (slot_no_t*)(h + 1);
+    slot = direct ? NULL : (struct slot*)(table + n);
+
+    if (memcmp(h->magic, MAGIC, sizeof h->magic) != 0
+        || h->nslots != nslots || h->bits != bits
+        || !sane(table, n, slot, nslots))
+    {
+        fprintf(stderr, "Lookup table in %s is not usable.\n", pathname);
+        if (munmap(h, bytes) == -1)
+            abort();
+        return -1;
+    }
+
+    fprintf(stderr, "Lookup table mapped from %s (%zuKb)\n",
+            pathname, bytes / 1024);
+
+    lut->table = table;
+    lut->slot = slot;
+    lut->codes = direct ? n : 0;
+    lut->bits = bits;
+    lut->avail = nslots;
+    lut->map = h;
+    lut->mapped = bytes;
 
     return 0;
 }
@@ -69,11 +262,85 @@ int lut_init(struct lut *lut, int nslots)
 
 void lut_clear(struct lut *lut)
 {
+    if (lut->map != NULL) {
+        if (munmap(lut->map, lut->mapped) == -1)
+            abort();
+        return;
+    }
+
     free(lut->table);
     free(lut->slot);
 }
 
 
+/*
+ * Write a complete table to the given file, for lut_map()
+ *
+ * The table is written to a temporary file first, so that it appears
+ * complete or not at all.
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+int lut_save(struct lut *lut, const char *pathname)
+{
+    int fd;
+    char tmp[PATH_MAX];
+    FILE *f;
+    struct header h;
+
+    if (snprintf(tmp, sizeof tmp, "%s.XXXXXX", pathname) >= sizeof tmp)
+        return -1;
+
+    fd = mkstemp(tmp);
+    if (fd == -1) {
+        perror("mkstemp");
+        return -1;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        perror("fdopen");
+        if (close(fd) == -1)
+            abort();
+        goto fail;
+    }
+
+    memset(&h, 0, sizeof h);
+    memcpy(h.magic, MAGIC, sizeof h.magic);
+    h.nslots = lut->avail;
+    h.bits = lut->bits;
+
+    fwrite(&h, sizeof h, 1, f);
+    fwrite(lut->table, sizeof(slot_no_t), entries(lut), f);
+    if (lut->slot != NULL)
+        fwrite(lut->slot, sizeof(struct slot), lut->avail, f);
+
+    if (ferror(f)) {
+        fprintf(stderr, "Failed to write lookup table to %s.\n", tmp);
+        fclose(f);
+        goto fail;
+    }
+
+    if (fclose(f) != 0) {
+        perror("fclose");
+        goto fail;
+    }
+
+    if (rename(tmp, pathname) == -1) {
+        perror("rename");
+        goto fail;
+    }
+
+    return 0;
+
+ fail:
+    if (unlink(tmp) == -1)
+        perror("unlink");
+    return -1;
+}
+
+
 void lut_push(struct lut *lut, unsigned int timecode)
 {
     unsigned int hash;
@@ -82,6 +349,11 @@ void lut_push(struct lut *lut, unsigned int timecode)
 
     slot_no = lut->avail++; /* take the next available slot */
 
+    if (lut->slot == NULL) {
+        lut->table[timecode] = slot_no;
+        return;
+    }
+
     slot = &lut->slot[slot_no];
     slot->timecode = timecode;
 
@@ -97,6 +369,12 @@ unsigned int lut_lookup(struct lut *lut, unsigned int timecode)
     slot_no_t slot_no;
     struct slot *slot;
 
+    if (lut->slot == NULL) {
+        if (timecode >= lut->codes)
+            return (unsigned)-1;
+        return lut->table[timecode];
+    }
+
     hash = HASH(timecode);
     slot_no = lut->table[hash];
 
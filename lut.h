@@ -20,6 +20,8 @@
 #ifndef LUT_H
 #define LUT_H
 
+#include <stddef.h>
+
 typedef unsigned int slot_no_t;
 
 struct slot {
@@ -27,15 +29,26 @@ struct slot {
     slot_no_t next; /* next slot with the same hash */
 };
 
+/* A table is either hashed, or direct with an entry for every possible
+ * timecode, whichever costs less memory; see lut_init() */
+
 struct lut {
-    struct slot *slot;
-    slot_no_t *table, /* hash -> slot lookup */
+    struct slot *slot; /* NULL if direct */
+    slot_no_t *table, /* hash (or timecode if direct) -> slot lookup */
         avail; /* next available slot */
+    unsigned int codes; /* number of possible timecodes, if direct */
+    int bits;
+
+    void *map; /* read-only mapping of a file, or NULL */
+    size_t mapped;
 };
 
-int lut_init(struct lut *lut, int nslots);
+int lut_init(struct lut *lut, int nslots, int bits);
+int lut_map(struct lut *lut, const char *pathname, int nslots, int bits);
 void lut_clear(struct lut *lut);
 
+int lut_save(struct lut *lut, const char *pathname);
+
 void lut_push(struct lut *lut, unsigned int timecode);
 unsigned int lut_lookup(struct lut *lut, unsigned int timecode);
 
@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "meter.h"
+#include "track.h"
+
+#define CHUNK TRACK_PPM_RES /* samples */
+
+void meter_init(struct meter *m)
+{
+    m->ppm = 0;
+    m->overview = 0;
+}
+
+/*
+ * Meter the audio one sample at a time
+ *
+ * This is the original implementation, which meter_block() is an
+ * approximation of.
+ *
+ * Post: meter values are written for the given samples of the block
+ */
+
+void meter_block_reference(struct meter *m, struct track_block *b,
+                           unsigned int fill, unsigned int samples)
+{
+    unsigned int n;
+    signed short *pcm;
+
+    pcm = b->pcm + TRACK_CHANNELS * (TRACK_GUARD + fill);
+
+    for (n = samples; n > 0; n--) {
+        unsigned short v;
+        unsigned int w;
+
+        v = abs(pcm[0]) + abs(pcm[1]);
+
+        /* PPM-style fast meter approximation */
+
+        if (v > m->ppm)
+            m->ppm += (v - m->ppm) >> 3;
+        else
+            m->ppm -= (m->ppm - v) >> 9;
+
+        b->ppm[fill / TRACK_PPM_RES] = m->ppm >> 8;
+
+        /* Update the slow-metering overview. Fixed point arithmetic
+         * going on here */
+
+        w = v << 16;
+
+        if (w > m->overview)
+            m->overview += (w - m->overview) >> 8;
+        else
+            m->overview -= (m->overview - w) >> 17;
+
+        b->overview[fill / TRACK_OVERVIEW_RES] = m->overview >> 24;
+
+        fill++;
+        pcm += TRACK_CHANNELS;
+    }
+}
+
+/*
+ * Return: absolute value, saturated as it is by SSE2
+ */
+
+static inline unsigned int magnitude(signed short x)
+{
+    return x == -32768 ? 32767 : abs(x);
+}
+
+/*
+ * Find the peak and sum of |left| + |right| over a run of samples
+ */
+
+static void reduce_scalar(const signed short *pcm, unsigned int samples,
+                          unsigned int *peak, unsigned int *sum)
+{
+    unsigned int n, p, s;
+
+    p = 0;
+    s = 0;
+
+    for (n = 0; n < samples; n++) {
+        unsigned int v;
+
+        v = magnitude(pcm[0]) + magnitude(pcm[1]);
+        if (v > p)
+            p = v;
+        s += v;
+
+        pcm += TRACK_CHANNELS;
+    }
+
+    *peak = p;
+    *sum = s;
+}
+
+#ifdef __SSE2__
+
+/*
+ * As reduce_scalar(), for a whole chunk at a time
+ *
+ * Each vector holds four stereo samples.
+ */
+
+static void reduce_sse2(const signed short *pcm,
+                        unsigned int *peak, unsigned int *sum)
+{
+    int n;
+    __m128i zero, ones, p, s;
+    uint32_t pv[4], sv[4];
+
+    zero = _mm_setzero_si128();
+    ones = _mm_set1_epi16(1);
+    p = zero;
+    s = zero;
+
+    for (n = 0; n < CHUNK * TRACK_CHANNELS; n += 8) {
+        __m128i x, a, v, gt;
+
+        x = _mm_loadu_si128((const __m128i*)(pcm + n));
+        a = _mm_max_epi16(x, _mm_subs_epi16(zero, x));
+
+        /* Sum left and right of each sample */
+
+        v = _mm_madd_epi16(a, ones);
+
+        gt = _mm_cmpgt_epi32(v, p);
+        p = _mm_or_si128(_mm_and_si128(gt, v), _mm_andnot_si128(gt, p));
+        s = _mm_add_epi32(s, v);
+    }
+
+    _mm_storeu_si128((__m128i*)pv, p);
+    _mm_storeu_si128((__m128i*)sv, s);
+
+    *peak = pv[0];
+    for (n = 1; n < 4; n++) {
+        if (pv[n] > *peak)
+            *peak = pv[n];
+    }
+
+    *sum = sv[0] + sv[1] + sv[2] + sv[3];
+}
+
+#endif
+
+/*
+ * Advance the meters over a chunk, given the peak and mean of
+ * |left| + |right| within it
+ *
+ * The coefficients are those of meter_block_reference() taken over
+ * the length of a chunk, and were tuned against it.
+ */
+
+static void filter(struct meter *m, unsigned int peak, unsigned int mean)
+{
+    uint64_t p, w;
+
+    if (peak > m->ppm)
+        m->ppm += (peak - m->ppm) * 25 >> 5;
+    if (m->ppm > mean)
+        m->ppm -= (m->ppm - mean) >> 3;
+
+    p = (uint64_t)peak << 16;
+    w = (uint64_t)mean << 16;
+
+    if (p > m->overview)
+        m->overview += (p - m->overview) >> 4;
+    else if (m->overview > w)
+        m->overview -= (m->overview - w) >> 11;
+}
+
+/*
+ * Meter the audio a chunk of TRACK_PPM_RES samples at a time
+ *
+ * The meters are only advanced over whole chunks. A final partial
+ * chunk is given a value, but the same chunk is metered again from
+ * its start when the rest of it arrives.
+ *
+ * Pre: fill is at the start of a chunk
+ * Post: meter values are written for the given samples of the block
+ */
+
+void meter_block(struct meter *m, struct track_block *b,
+                 unsigned int fill, unsigned int samples)
+{
+    const signed short *pcm;
+
+    assert(fill % CHUNK == 0);
+
+    pcm = b->pcm + TRACK_CHANNELS * (TRACK_GUARD + fill);
+
+    while (samples > 0) {
+        unsigned int len, peak, sum;
+        struct meter partial, *t;
+
+        if (samples >= CHUNK) {
+            len = CHUNK;
+            t = m;
+#ifdef __SSE2__
+            reduce_sse2(pcm, &peak, &sum);
+#else
+            reduce_scalar(pcm, CHUNK, &peak, &sum);
+#endif
+        } else {
+            len = samples;
+            partial = *m;
+            t = &partial;
+            reduce_scalar(pcm, len, &peak, &sum);
+        }
+
+        filter(t, peak, sum / len);
+
+        b->ppm[fill / TRACK_PPM_RES] = t->ppm >> 8;
+        b->overview[fill / TRACK_OVERVIEW_RES] = t->overview >> 24;
+
+        fill += len;
+        samples -= len;
+        pcm += len * TRACK_CHANNELS;
+    }
+}
@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Audio meters of a track, calculated as it is imported
+ */
+
+#ifndef METER_H
+#define METER_H
+
+struct track_block;
+
+/* State of the meters at the end of the audio metered so far */
+
+struct meter {
+    unsigned short ppm;
+    unsigned int overview;
+};
+
+void meter_init(struct meter *m);
+
+void meter_block(struct meter *m, struct track_block *b,
+                 unsigned int fill, unsigned int samples);
+void meter_block_reference(struct meter *m, struct track_block *b,
+                           unsigned int fill, unsigned int samples);
+
+#endif
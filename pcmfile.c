@@ -0,0 +1,388 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "debug.h"
+#include "pcmfile.h"
+#include "track.h"
+
+#define CHANNELS 2
+#define BITS 16
+#define FRAME (CHANNELS * BITS / 8) /* bytes */
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+#define HOST_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+
+static uint16_t le16(const unsigned char *p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint16_t be16(const unsigned char *p)
+{
+    return p[0] << 8 | p[1];
+}
+
+static uint32_t be32(const unsigned char *p)
+{
+    return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/*
+ * Return: value of an 80-bit IEEE 754 extended precision number, as
+ * used for the sample rate of an AIFF file
+ */
+
+static double extended(const unsigned char *p)
+{
+    int e;
+    uint64_t m;
+
+    e = be16(p) & 0x7fff;
+    m = (uint64_t)be32(p + 2) << 32 | be32(p + 6);
+
+    return ldexp(m, e - 16383 - 63);
+}
+
+/*
+ * Read exactly the given number of bytes at the given offset
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int get(int fd, off_t offset, void *buf, size_t len)
+{
+    ssize_t z;
+
+    z = pread(fd, buf, len, offset);
+    if (z != len)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Return: true if the audio at this sample rate can be used directly
+ */
+
+static bool usable(double rate)
+{
+    return rate >= TRACK_MIN_RATE && rate <= TRACK_MAX_RATE
+        && rate == floor(rate);
+}
+
+/*
+ * Check the format chunk of a RIFF WAVE file, of the given size; the
+ * first 16 bytes, or 40 if it is that large
+ *
+ * Return: 0 if the audio is 16-bit stereo, otherwise -1
+ * Post: on success, *rate is the sample rate
+ */
+
+static int wav_format(const unsigned char *h, uint32_t size, int *rate)
+{
+    unsigned int tag;
+
+    tag = le16(h);
+    if (tag == WAVE_FORMAT_EXTENSIBLE && size >= 40)
+        tag = le16(h + 24); /* sub-format */
+
+    if (tag != WAVE_FORMAT_PCM || le16(h + 2) != CHANNELS
+        || le16(h + 14) != BITS || le32(h + 4) > INT_MAX)
+    {
+        return -1;
+    }
+
+    *rate = le32(h + 4);
+    return 0;
+}
+
+/*
+ * Find the audio in a RIFF WAVE file
+ *
+ * Return: 0 if the audio can be used directly, otherwise -1
+ * Post: on success, *offset and *len give the position of the audio
+ * Post: on success, *rate is the sample rate
+ */
+
+static int wav(int fd, int *rate, off_t *offset, size_t *len)
+{
+    off_t pos;
+    bool format;
+    unsigned char h[40];
+
+    format = false;
+    pos = 12;
+
+    for (;;) {
+        uint32_t size;
+
+        if (get(fd, pos, h, 8) == -1)
+            return -1;
+
+        size = le32(h + 4);
+
+        if (!memcmp(h, "fmt ", 4)) {
+            if (size < 16 || get(fd, pos + 8, h, size < 40 ? 16 : 40) == -1)
+                return -1;
+
+            if (wav_format(h, size, rate) == -1 || !usable(*rate))
+                return -1;
+
+            format = true;
+
+        } else if (!memcmp(h, "data", 4)) {
+            if (!format)
+                return -1;
+
+            *offset = pos + 8;
+            *len = size;
+            return 0;
+        }
+
+        pos += 8 + size + (size & 1); /* chunks are padded */
+    }
+}
+
+/*
+ * Find the audio in an AIFF or uncompressed AIFF-C file
+ *
+ * Return: 0 if the audio can be used directly, otherwise -1
+ * Post: on success, *offset and *len give the position of the audio
+ * Post: on success, *rate is the sample rate
+ * Post: on success, *big is true if the audio is big-endian
+ */
+
+static int aiff(int fd, int *rate, bool aifc, off_t *offset, size_t *len,
+                bool *big)
+{
+    off_t pos;
+    bool format;
+    unsigned char h[22];
+
+    format = false;
+    *big = true;
+    pos = 12;
+
+    for (;;) {
+        uint32_t size;
+
+        if (get(fd, pos, h, 8) == -1)
+            return -1;
+
+        size = be32(h + 4);
+
+        if (!memcmp(h, "COMM", 4)) {
+            if (size < (aifc ? 22 : 18)
+                || get(fd, pos + 8, h, aifc ? 22 : 18) == -1)
+            {
+                return -1;
+            }
+
+            if (be16(h) != CHANNELS || be16(h + 6) != BITS
+                || !usable(extended(h + 8)))
+            {
+                return -1;
+            }
+
+            *rate = extended(h + 8);
+
+            if (aifc) {
+                if (!memcmp(h + 18, "sowt", 4))
+                    *big = false;
+                else if (memcmp(h + 18, "NONE", 4))
+                    return -1;
+            }
+
+            format = true;
+
+        } else if (!memcmp(h, "SSND", 4)) {
+            uint32_t skip;
+
+            if (!format || size < 8 || get(fd, pos + 8, h, 8) == -1)
+                return -1;
+
+            skip = be32(h);
+            if (skip > size - 8)
+                return -1;
+
+            *offset = pos + 16 + skip;
+            *len = size - 8 - skip;
+            return 0;
+        }
+
+        pos += 8 + size + (size & 1);
+    }
+}
+
+/*
+ * Find the audio in the start of a RIFF WAVE stream, such as that
+ * written by a decoder to a pipe
+ *
+ * The lengths in the stream are not known when they are written, so
+ * the audio is taken to run until the end of the stream.
+ *
+ * Return: offset of the audio, 0 if more of the stream is needed to
+ * tell, or -1 if the audio can't be used
+ * Post: on success, *rate is the sample rate
+ */
+
+ssize_t pcmfile_stream(const void *buf, size_t len, int *rate)
+{
+    const unsigned char *h = buf;
+    int r;
+    size_t pos;
+    bool format;
+
+    if (len < 12)
+        return 0;
+    if (memcmp(h, "RIFF", 4) || memcmp(h + 8, "WAVE", 4))
+        return -1;
+
+    format = false;
+    pos = 12;
+
+    for (;;) {
+        uint32_t size;
+
+        if (len - pos < 8)
+            return 0;
+
+        size = le32(h + pos + 4);
+
+        if (!memcmp(h + pos, "fmt ", 4)) {
+            if (size < 16)
+                return -1;
+            if (len - pos - 8 < (size < 40 ? 16 : 40))
+                return 0;
+            if (wav_format(h + pos + 8, size, &r) == -1)
+                return -1;
+
+            format = true;
+
+        } else if (!memcmp(h + pos, "data", 4)) {
+            if (!format)
+                return -1;
+
+            *rate = r;
+            return pos + 8;
+        }
+
+        if (size > len - pos - 8)
+            return 0;
+
+        pos += 8 + size + (size & 1);
+        if (pos > len)
+            return 0;
+    }
+}
+
+/*
+ * Open a file for reading its audio directly, if it is uncompressed
+ * 16-bit stereo
+ *
+ * Return: file descriptor positioned at the audio, or -1 if the
+ * file must be imported
+ * Post: on success, *rate is the sample rate of the audio
+ * Post: on success, *len is the number of bytes of audio
+ * Post: on success, *swap is true if the audio is of the opposite
+ * byte order to this machine
+ */
+
+int pcmfile_open(const char *path, int *rate, size_t *len, bool *swap)
+{
+    int fd, r;
+    bool big;
+    size_t l;
+    off_t offset;
+    unsigned char h[12];
+    struct stat st;
+
+    fd = open(path, O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (get(fd, 0, h, sizeof h) == -1)
+        goto fail;
+
+    /* Nothing is given back until the file is known to be usable */
+
+    if (!memcmp(h, "RIFF", 4) && !memcmp(h + 8, "WAVE", 4)) {
+        if (wav(fd, &r, &offset, &l) == -1)
+            goto fail;
+        big = false;
+    } else if (!memcmp(h, "FORM", 4) && !memcmp(h + 8, "AIFF", 4)) {
+        if (aiff(fd, &r, false, &offset, &l, &big) == -1)
+            goto fail;
+    } else if (!memcmp(h, "FORM", 4) && !memcmp(h + 8, "AIFC", 4)) {
+        if (aiff(fd, &r, true, &offset, &l, &big) == -1)
+            goto fail;
+    } else {
+        goto fail;
+    }
+
+    /* Some programs which write as they go leave the length of the
+     * audio unset, or too large */
+
+    if (fstat(fd, &st) == -1)
+        goto fail;
+
+    if (offset > st.st_size)
+        goto fail;
+    if (l > st.st_size - offset)
+        l = st.st_size - offset;
+
+    l -= l % FRAME;
+
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        goto fail;
+
+    /* Advise the kernel to read ahead, as the whole file is read */
+
+    posix_fadvise(fd, offset, l, POSIX_FADV_SEQUENTIAL);
+
+    *rate = r;
+    *len = l;
+    *swap = (big != HOST_BIG_ENDIAN);
+
+    debug("reading audio of '%s' directly, %zu bytes at %lld", path, l,
+          (long long)offset);
+
+    return fd;
+
+ fail:
+    if (close(fd) == -1)
+        abort();
+    return -1;
+}
@@ -61,6 +61,53 @@ static inline void pitch_dt_observation(struct pitch *p, double dx)
     p->x -= dx; /* relative to previous */
 }
 
+/* A run of observations of no movement, which together are a linear
+ * function of the state of the filter */
+
+struct pitch_run {
+    double xx, xv, vx, vv;
+};
+
+/* Prepare a run of n observations of no movement */
+
+static inline void pitch_run_init(struct pitch_run *r, const struct pitch *p,
+                                  unsigned int n)
+{
+    unsigned int i;
+    struct pitch x, v;
+
+    x = *p;
+    x.x = 1.0;
+    x.v = 0.0;
+
+    v = *p;
+    v.x = 0.0;
+    v.v = 1.0;
+
+    for (i = 0; i < n; i++) {
+        pitch_dt_observation(&x, 0.0);
+        pitch_dt_observation(&v, 0.0);
+    }
+
+    r->xx = x.x;
+    r->vx = x.v;
+    r->xv = v.x;
+    r->vv = v.v;
+}
+
+/* Input a run of observations of no movement, in a single step */
+
+static inline void pitch_dt_run(struct pitch *p, const struct pitch_run *r)
+{
+    double x, v;
+
+    x = p->x;
+    v = p->v;
+
+    p->x = r->xx * x + r->xv * v;
+    p->v = r->vx * x + r->vv * v;
+}
+
 /* Get the pitch after filtering */
 
 static inline double pitch_current(struct pitch *p)
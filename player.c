@@ -18,15 +18,18 @@
  */
 
 #include <assert.h>
-#include <limits.h>
 #include <math.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "device.h"
 #include "player.h"
+#include "realtime.h"
+#include "resample.h"
 #include "track.h"
 #include "timecoder.h"
 
@@ -48,128 +51,33 @@
 
 #define VOLUME (7.0/8)
 
-#define SQ(x) ((x)*(x))
-#define TARGET_UNKNOWN INFINITY
+/* Number of periods over which to average the measured cost of
+ * resampling */
 
-/*
- * Return: the cubic interpolation of the sample at position 2 + mu
- */
+#define COST_SMOOTH 32
 
-static inline double cubic_interpolate(double y[4], double mu)
-{
-    double a0, a1, a2, a3, mu2;
+/* Maximum number of replaced tracks waiting for the realtime thread
+ * to finish with them */
 
-    mu2 = SQ(mu);
-    a0 = y[3] - y[2] - y[0] + y[1];
-    a1 = y[0] - y[1] - a0;
-    a2 = y[2] - y[0];
-    a3 = y[1];
+#define RETIRE_MAX 16
 
-    return (a0 * mu * mu2) + (a1 * mu2) + (a2 * mu) + a3;
-}
+#define TARGET_UNKNOWN INFINITY
 
 /*
- * Return: Random dither, between -0.5 and 0.5
+ * A track which has been replaced on a player, but may still be in
+ * use by the realtime thread for the period it is rendering
  */
 
-double dither(void)
-{
-    short bit;
-    static short x = 0xbabe;
-
-    /* Use a 16-bit maximal-length LFSR as our random number.
-     * This is faster than rand() */
+struct retired {
+    struct track *track;
+    const struct player *pl;
+    unsigned long epoch; /* value of pl->epoch when replaced */
+};
 
-    bit = (x ^ (x >> 2) ^ (x >> 3) ^ (x >> 5)) & 1;
-    x = x >> 1 | (bit << 15);
+static struct retired retired[RETIRE_MAX];
+static size_t nretired = 0;
 
-    return (double)x / 65536 - 0.5; /* not quite whole range */
-}
-
-/*
- * Build a block of PCM audio, resampled from the track
- *
- * This is just a basic resampler which has a small amount of aliasing
- * where pitch > 1.0.
- *
- * Return: number of seconds advanced in the source audio track
- * Post: buffer at pcm is filled with the given number of samples
- */
-
-static double build_pcm(signed short *pcm, unsigned samples, double sample_dt,
-                        struct track *tr, double position, double pitch,
-                        double start_vol, double end_vol)
-{
-    int s;
-    double sample, step, vol, gradient;
-
-    sample = position * tr->rate;
-    step = sample_dt * pitch * tr->rate;
-
-    vol = start_vol;
-    gradient = (end_vol - start_vol) / samples;
-
-    for (s = 0; s < samples; s++) {
-        int c, sa, q;
-        double f, i[PLAYER_CHANNELS][4];
-
-        /* 4-sample window for interpolation */
-
-        sa = (int)sample;
-        if (sample < 0.0)
-            sa--;
-        f = sample - sa;
-        sa--;
-
-        for (q = 0; q < 4; q++, sa++) {
-            if (sa < 0 || sa >= tr->length) {
-                for (c = 0; c < PLAYER_CHANNELS; c++)
-                    i[c][q] = 0.0;
-            } else {
-                signed short *ts;
-                int c;
-
-                ts = track_get_sample(tr, sa);
-                for (c = 0; c < PLAYER_CHANNELS; c++)
-                    i[c][q] = (double)ts[c];
-            }
-        }
-
-        for (c = 0; c < PLAYER_CHANNELS; c++) {
-            double v;
-
-            v = vol * cubic_interpolate(i[c], f) + dither();
-
-            if (v > SHRT_MAX) {
-                *pcm++ = SHRT_MAX;
-            } else if (v < SHRT_MIN) {
-                *pcm++ = SHRT_MIN;
-            } else {
-                *pcm++ = (signed short)v;
-            }
-        }
-
-        sample += step;
-        vol += gradient;
-    }
-
-    return sample_dt * pitch * samples;
-}
-
-/*
- * Equivalent to build_pcm, but for use when the track is
- * not available
- *
- * Return: number of seconds advanced in the audio track
- * Post: buffer at pcm is filled with silence
- */
-
-static double build_silence(signed short *pcm, unsigned samples,
-                            double sample_dt, double pitch)
-{
-    memset(pcm, '\0', sizeof(*pcm) * PLAYER_CHANNELS * samples);
-    return sample_dt * pitch * samples;
-}
+static struct list players = LIST_INIT(players);
 
 /*
  * Change the timecoder used by this playback
@@ -193,10 +101,11 @@ void player_init(struct player *pl, unsigned int sample_rate,
     assert(track != NULL);
     assert(sample_rate != 0);
 
-    spin_init(&pl->lock);
+    list_add(&pl->players, &players);
 
     pl->sample_dt = 1.0 / sample_rate;
     pl->track = track;
+    pl->epoch = 0;
     player_set_timecoder(pl, tc);
 
     pl->position = 0.0;
@@ -207,6 +116,10 @@ void player_init(struct player *pl, unsigned int sample_rate,
     pl->pitch = 0.0;
     pl->sync_pitch = 1.0;
     pl->volume = 0.0;
+
+    pl->resampler = RESAMPLE_CUBIC;
+    pl->cost = 0.0;
+    pl->load = 0.0;
 }
 
 /*
@@ -216,8 +129,33 @@ void player_init(struct player *pl, unsigned int sample_rate,
 
 void player_clear(struct player *pl)
 {
-    spin_clear(&pl->lock);
+    size_t n;
+
+    /* The realtime thread is no longer using this player, so anything
+     * retired from it can be released */
+
+    n = 0;
+    while (n < nretired) {
+        if (retired[n].pl == pl) {
+            track_put(retired[n].track);
+            retired[n] = retired[--nretired];
+        } else {
+            n++;
+        }
+    }
+
     track_put(pl->track);
+    list_del(&pl->players);
+}
+
+/*
+ * Set the quality of resampling used for playback; one of
+ * RESAMPLE_CUBIC or RESAMPLE_SINC
+ */
+
+void player_set_resampler(struct player *pl, int resampler)
+{
+    pl->resampler = resampler;
 }
 
 /*
@@ -272,6 +210,53 @@ bool player_is_active(const struct player *pl)
     return (fabs(pl->pitch) > 0.01);
 }
 
+/*
+ * Return: how urgently the given track is needed by any of the
+ * players; one of PLAYER_NEED_
+ *
+ * Pre: calls are serialised with player_set_track() (eg. by the rig
+ * lock)
+ */
+
+int player_need(const struct track *tr)
+{
+    int r;
+    struct player *pl;
+
+    r = PLAYER_NEED_NONE;
+
+    list_for_each(pl, &players, players) {
+        if (pl->track != tr)
+            continue;
+
+        if (player_is_active(pl))
+            return PLAYER_NEED_AUDIBLE;
+
+        r = PLAYER_NEED_LOADED;
+    }
+
+    return r;
+}
+
+/*
+ * Tell the tracks being imported which audio each player is waiting
+ * for, so that it can be imported sooner
+ *
+ * Pre: rig lock is held, by the import thread
+ */
+
+void player_want_audio(void)
+{
+    struct player *pl;
+    struct track *tr;
+
+    list_for_each(pl, &players, players) {
+        tr = pl->track;
+        if (track_is_importing(tr))
+            track_want(tr, player_get_elapsed(pl) * tr->rate);
+    }
+}
+
 /*
  * Cue to the zero position of the track
  */
@@ -282,25 +267,98 @@ void player_recue(struct player *pl)
 }
 
 /*
- * Set the track used for the playback
+ * Return: true if the realtime thread could still be using a track
+ * replaced on the player at the given epoch
+ */
+
+static bool in_use(const struct player *pl, unsigned long epoch)
+{
+    return (epoch & 1) && __atomic_load_n(&pl->epoch, __ATOMIC_ACQUIRE) == epoch;
+}
+
+/*
+ * Release any replaced tracks which the realtime thread has finished
+ * with
+ *
+ * The realtime thread holds no reference on a track it is rendering,
+ * so a replaced track is only released once the player has moved on
+ * to its next period.
+ *
+ * Pre: not called from the realtime thread; calls are serialised
+ * with track_put() (eg. by the rig lock)
+ * Return: the number of tracks still waiting to be released
+ */
+
+size_t player_reclaim(void)
+{
+    size_t n;
+
+    n = 0;
+    while (n < nretired) {
+        if (in_use(retired[n].pl, retired[n].epoch)) {
+            n++;
+        } else {
+            track_put(retired[n].track);
+            retired[n] = retired[--nretired];
+        }
+    }
+
+    return nretired;
+}
+
+/*
+ * Publish a new track to the realtime thread, and dispose of the
+ * track it replaces once it is safe to do so
  *
  * Pre: caller holds reference on track
  * Post: caller does not hold reference on track
  */
 
-void player_set_track(struct player *pl, struct track *track)
+static void publish(struct player *pl, struct track *track)
 {
     struct track *x;
+    unsigned long epoch;
+
+    rt_not_allowed();
+
+    /* Sequentially consistent; the realtime thread either sees the
+     * new track, or its epoch is seen here as in progress */
+
+    x = __atomic_exchange_n(&pl->track, track, __ATOMIC_SEQ_CST);
+    epoch = __atomic_load_n(&pl->epoch, __ATOMIC_SEQ_CST);
 
+    if (!in_use(pl, epoch)) {
+        track_put(x);
+        return;
+    }
+
+    /* This only waits if tracks are replaced faster than the
+     * realtime thread renders its periods */
+
+    while (player_reclaim() == RETIRE_MAX)
+        sched_yield();
+
+    retired[nretired].track = x;
+    retired[nretired].pl = pl;
+    retired[nretired].epoch = epoch;
+    nretired++;
+}
+
+/*
+ * Set the track used for the playback
+ *
+ * This does not wait for, or interrupt, the realtime thread.
+ *
+ * Pre: caller holds reference on track
+ * Post: caller does not hold reference on track
+ */
+
+void player_set_track(struct player *pl, struct track *track)
+{
     assert(track != NULL);
     assert(track->refcount > 0);
 
-    spin_lock(&pl->lock); /* Synchronise with the playback thread */
-    x = pl->track;
-    pl->track = track;
-    spin_unlock(&pl->lock);
-
-    track_put(x); /* discard the old track */
+    publish(pl, track);
 }
 
 /*
@@ -311,7 +369,7 @@ void player_set_track(struct player *pl, struct track *track)
 void player_clone(struct player *pl, const struct player *from)
 {
     double elapsed;
-    struct track *x, *t;
+    struct track *t;
 
     elapsed = from->position - from->offset;
     pl->offset = pl->position - elapsed;
@@ -319,12 +377,7 @@ void player_clone(struct player *pl, const struct player *from)
     t = from->track;
     track_get(t);
 
-    spin_lock(&pl->lock);
-    x = pl->track;
-    pl->track = t;
-    spin_unlock(&pl->lock);
-
-    track_put(x);
+    publish(pl, t);
 }
 
 /*
@@ -416,18 +469,38 @@ void player_seek_to(struct player *pl, double seconds)
 }
 
 /*
- * Get a block of PCM audio data to send to the soundcard
+ * Account for the time taken to build one period of audio
+ */
+
+static void measure(struct player *pl, const struct timespec *start,
+                    const struct timespec *end, double dt)
+{
+    double t;
+
+    t = (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) / 1e9;
+
+    pl->cost += (t - pl->cost) / COST_SMOOTH;
+    pl->load = pl->cost / dt;
+}
+
+/*
+ * Get a block of audio to send to the soundcard, in whichever format
+ * is given
  *
  * This is the main function which retrieves audio for playback.  The
  * clock of playback is decoupled from the clock of the timecode
  * signal.
  *
- * Post: buffer at pcm is filled with the given number of samples
+ * Post: buffer at pcm, or at out if pcm is NULL, is filled with the
+ * given number of samples
  */
 
-void player_collect(struct player *pl, signed short *pcm, unsigned samples)
+static void collect(struct player *pl, signed short *pcm, float *out[],
+                    unsigned stride, unsigned samples)
 {
     double r, pitch, dt, target_volume;
+    struct track *tr;
+    struct timespec start, end;
 
     dt = pl->sample_dt * samples;
 
@@ -460,15 +533,52 @@ void player_collect(struct player *pl, signed short *pcm, unsigned samples)
 
     pitch = pl->pitch * pl->sync_pitch;
 
-    if (!spin_try_lock(&pl->lock)) {
-        r = build_silence(pcm, samples, pl->sample_dt, pitch);
+    /* Mark the start of an epoch, then take the track; it cannot be
+     * released until the epoch is over */
+
+    __atomic_add_fetch(&pl->epoch, 1, __ATOMIC_SEQ_CST);
+    tr = __atomic_load_n(&pl->track, __ATOMIC_SEQ_CST);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pcm != NULL) {
+        r = resample(pl->resampler, pcm, samples, pl->sample_dt, tr,
+                     pl->position - pl->offset, pitch,
+                     pl->volume, target_volume);
     } else {
-        r = build_pcm(pcm, samples, pl->sample_dt, pl->track,
-                      pl->position - pl->offset, pitch,
-                      pl->volume, target_volume);
-        spin_unlock(&pl->lock);
+        r = resample_float(pl->resampler, out, stride, samples,
+                           pl->sample_dt, tr, pl->position - pl->offset,
+                           pitch, pl->volume, target_volume);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    __atomic_add_fetch(&pl->epoch, 1, __ATOMIC_RELEASE);
+
+    measure(pl, &start, &end, dt);
 
     pl->position += r;
     pl->volume = target_volume;
 }
+
+/*
+ * Get a block of PCM audio data to send to the soundcard
+ *
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+void player_collect(struct player *pl, signed short *pcm, unsigned samples)
+{
+    collect(pl, pcm, NULL, 0, samples);
+}
+
+/*
+ * Get a block of floating point audio to send to the soundcard, where
+ * full scale is 1.0
+ *
+ * Post: channel c of sample s is written to out[c][s * stride]
+ */
+
+void player_collect_float(struct player *pl, float *out[], unsigned stride,
+                          unsigned samples)
+{
+    collect(pl, NULL, out, stride, samples);
+}
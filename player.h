@@ -21,17 +21,24 @@
 #define PLAYER_H
 
 #include <stdbool.h>
+#include <stddef.h>
 
-#include "spin.h"
 #include "track.h"
 
 #define PLAYER_CHANNELS 2
 
+/* How urgently a track is needed by the players */
+
+#define PLAYER_NEED_NONE 0
+#define PLAYER_NEED_LOADED 1 /* on a player */
+#define PLAYER_NEED_AUDIBLE 2 /* on a player which is playing */
+
 struct player {
+    struct list players;
     double sample_dt;
 
-    spin lock;
-    struct track *track;
+    struct track *track; /* published atomically */
+    unsigned long epoch; /* odd while the realtime thread renders */
 
     /* Current playback parameters */
 
@@ -48,6 +55,12 @@ struct player {
     struct timecoder *timecoder;
     bool timecode_control,
         recalibrate; /* re-sync offset at next opportunity */
+
+    /* Resampling, and its measured cost */
+
+    int resampler; /* RESAMPLE_CUBIC or RESAMPLE_SINC */
+    double cost, /* seconds spent per period, smoothed */
+        load; /* cost as a fraction of the period */
 };
 
 void player_init(struct player *pl, unsigned int sample_rate,
@@ -58,7 +71,10 @@ void player_set_timecoder(struct player *pl, struct timecoder *tc);
 void player_set_timecode_control(struct player *pl, bool on);
 bool player_toggle_timecode_control(struct player *pl);
 
+void player_set_resampler(struct player *pl, int resampler);
+
 void player_set_track(struct player *pl, struct track *track);
+size_t player_reclaim(void);
 void player_clone(struct player *pl, const struct player *from);
 
 void player_set_pitch(struct player *pl, const float pitch);
@@ -66,10 +82,14 @@ double player_get_position(struct player *pl);
 double player_get_elapsed(struct player *pl);
 double player_get_remain(struct player *pl);
 bool player_is_active(const struct player *pl);
+int player_need(const struct track *tr);
+void player_want_audio(void);
 
 void player_seek_to(struct player *pl, double seconds);
 void player_recue(struct player *pl);
 
 void player_collect(struct player *pl, signed short *pcm, unsigned samples);
+void player_collect_float(struct player *pl, float *out[], unsigned stride,
+                          unsigned samples);
 
 #endif
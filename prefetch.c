@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+
+#include "debug.h"
+#include "prefetch.h"
+#include "track.h"
+
+static unsigned int depth = 0;
+
+/* Tracks held in case they are loaded; a deck which loads one takes
+ * its own reference, so the import carries on */
+
+static struct track *held[PREFETCH_MAX];
+static size_t nheld = 0;
+
+/*
+ * Set the number of records to import in advance; zero for none
+ */
+
+void prefetch_set_depth(unsigned int n)
+{
+    assert(n <= PREFETCH_MAX);
+    depth = n;
+}
+
+/*
+ * Import in advance the selected record, and those which follow it
+ * when the records are in the order of a playlist
+ *
+ * Tracks no longer selected are let go. If their import has not yet
+ * started it is abandoned, otherwise the track is kept only within
+ * the memory available for retained tracks.
+ *
+ * Pre: rig lock is held
+ */
+
+void prefetch_selection(struct selector *sel, const char *importer)
+{
+    int i;
+    size_t n, m;
+    struct listing *l;
+    struct track *t[PREFETCH_MAX];
+
+    m = 0;
+    i = sel->records.selected;
+    l = sel->view_listing;
+
+    if (depth > 0 && sel->records.entries > 0) {
+        size_t want;
+
+        want = (sel->sort == SORT_PLAYLIST) ? depth : 1;
+
+        for (n = i; n < l->entries && m < want; n++) {
+            t[m] = track_get_spare(importer, l->record[n]->pathname);
+            if (t[m] == NULL)
+                break;
+            debug("prefetching '%s'", t[m]->path);
+            m++;
+        }
+    }
+
+    /* Let go of the previous tracks only now, so any which are still
+     * wanted are not abandoned */
+
+    for (n = 0; n < nheld; n++)
+        track_put_spare(held[n]);
+
+    for (n = 0; n < m; n++)
+        held[n] = t[n];
+    nheld = m;
+}
+
+/*
+ * Let go of all tracks imported in advance
+ *
+ * Pre: rig lock is held
+ */
+
+void prefetch_clear(void)
+{
+    size_t n;
+
+    for (n = 0; n < nheld; n++)
+        track_put_spare(held[n]);
+
+    nheld = 0;
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Import of records in advance, in case they are loaded next
+ */
+
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "selector.h"
+
+#define PREFETCH_MAX 8 /* records imported in advance */
+
+void prefetch_set_depth(unsigned int n);
+
+void prefetch_selection(struct selector *sel, const char *importer);
+void prefetch_clear(void);
+
+#endif
@@ -0,0 +1,1402 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <limits.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define WITH_X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "resample.h"
+#include "track.h"
+
+#define SQ(x) ((x)*(x))
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+/* Number of output frames processed per iteration by each of the
+ * vectorised kernels */
+
+#define SSE2_FRAMES 2
+#define AVX2_FRAMES 4
+
+/* Windowed-sinc filter: the number of zero crossings either side of
+ * the centre, and the resolution of the precomputed table between
+ * each crossing */
+
+#define SINC_ZEROS 8
+#define SINC_RES 512
+#define SINC_TABLE (SINC_ZEROS * SINC_RES + 2)
+
+#define SINC_BETA 8.0 /* Kaiser window */
+#define SINC_ROLLOFF 0.95 /* fraction of Nyquist to pass */
+
+/* Where the track is played faster than the output rate the filter is
+ * stretched to lower the cutoff. Beyond this the cost grows too high,
+ * and some aliasing is tolerated; eg. during fast scratching */
+
+#define SINC_MAX_STRETCH 4.0
+
+/* Full scale of floating point output */
+
+#define SCALE 32768.0
+
+/* The ways in which a period can be resampled */
+
+#define PATH_QUIET 0 /* the track contributes nothing */
+#define PATH_HOLD 1 /* stopped at a single position */
+#define PATH_RUN 2 /* contiguous run of samples inside the track */
+#define PATH_EDGE 3 /* reaches the ends of the track */
+
+struct kernel {
+    const char *name;
+    void (*cubic)(signed short *pcm, unsigned samples,
+                  const signed short *ts, int first,
+                  double sample, double step, double vol, double gradient);
+    void (*cubic_float)(float *out[], unsigned stride, unsigned samples,
+                        const signed short *ts, int first,
+                        double sample, double step,
+                        double vol, double gradient);
+    bool (*supported)(void);
+};
+
+static short dither_x = 0xbabe;
+
+/* Impulse response of the filter from its centre, and the difference
+ * to the next entry for linear interpolation */
+
+static float sinc_table[SINC_TABLE], sinc_delta[SINC_TABLE];
+
+/*
+ * Return: the cubic interpolation of the sample at position 2 + mu
+ */
+
+static inline double cubic_interpolate(double y[4], double mu)
+{
+    double a0, a1, a2, a3, mu2;
+
+    mu2 = SQ(mu);
+    a0 = y[3] - y[2] - y[0] + y[1];
+    a1 = y[0] - y[1] - a0;
+    a2 = y[2] - y[0];
+    a3 = y[1];
+
+    return (a0 * mu * mu2) + (a1 * mu2) + (a2 * mu) + a3;
+}
+
+/*
+ * Return: Random dither, between -0.5 and 0.5
+ */
+
+static inline double dither(void)
+{
+    short bit, x;
+
+    /* Use a 16-bit maximal-length LFSR as our random number.
+     * This is faster than rand() */
+
+    x = dither_x;
+    bit = (x ^ (x >> 2) ^ (x >> 3) ^ (x >> 5)) & 1;
+    x = x >> 1 | (bit << 15);
+    dither_x = x;
+
+    return (double)x / 65536 - 0.5; /* not quite whole range */
+}
+
+/*
+ * Return: sample value saturated and truncated to 16-bit
+ */
+
+static inline signed short quantise(double v)
+{
+    if (v > SHRT_MAX)
+        return SHRT_MAX;
+    if (v < SHRT_MIN)
+        return SHRT_MIN;
+    return (signed short)v;
+}
+
+/*
+ * Interpolate the track at a single position, where any of the
+ * samples either side may be beyond the ends of the track, or not
+ * yet imported
+ *
+ * Post: y contains one value per channel
+ */
+
+static inline void cubic_point(double y[TRACK_CHANNELS], struct track *tr,
+                               double sample)
+{
+    int c, sa, q;
+    double f, i[TRACK_CHANNELS][4];
+
+    /* 4-sample window for interpolation */
+
+    sa = (int)sample;
+    if (sample < 0.0)
+        sa--;
+    f = sample - sa;
+    sa--;
+
+    for (q = 0; q < 4; q++, sa++) {
+        if (!track_has_sample(tr, sa)) {
+            for (c = 0; c < TRACK_CHANNELS; c++)
+                i[c][q] = 0.0;
+        } else {
+            signed short *ts;
+            int c;
+
+            ts = track_get_sample(tr, sa);
+            for (c = 0; c < TRACK_CHANNELS; c++)
+                i[c][q] = (double)ts[c];
+        }
+    }
+
+    for (c = 0; c < TRACK_CHANNELS; c++)
+        y[c] = cubic_interpolate(i[c], f);
+}
+
+/*
+ * Resample a single stereo frame of audio from the track
+ *
+ * Post: two samples are written to pcm
+ */
+
+static inline void cubic_frame(signed short *pcm, struct track *tr,
+                               double sample, double vol)
+{
+    int c;
+    double y[TRACK_CHANNELS];
+
+    cubic_point(y, tr, sample);
+
+    for (c = 0; c < TRACK_CHANNELS; c++)
+        *pcm++ = quantise(vol * y[c] + dither());
+}
+
+/*
+ * Resample a single stereo frame from a contiguous run of samples
+ *
+ * Pre: all interpolation taps lie within the run at ts
+ * Post: two samples are written to pcm
+ */
+
+static inline void cubic_run_frame(signed short *pcm, const signed short *ts,
+                                   int first, double sample, double vol)
+{
+    int c, sa;
+    double f, i[4];
+
+    /* Positions are known to be positive, so truncation is floor() */
+
+    sa = (int)sample;
+    f = sample - sa;
+    ts += (sa - first - 1) * TRACK_CHANNELS;
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        i[0] = ts[c];
+        i[1] = ts[c + TRACK_CHANNELS];
+        i[2] = ts[c + TRACK_CHANNELS * 2];
+        i[3] = ts[c + TRACK_CHANNELS * 3];
+
+        *pcm++ = quantise(vol * cubic_interpolate(i, f) + dither());
+    }
+}
+
+/*
+ * Resample a period from a contiguous run of samples
+ *
+ * Pre: all interpolation taps of the period lie within the run at ts
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static void cubic_scalar(signed short *pcm, unsigned samples,
+                         const signed short *ts, int first,
+                         double sample, double step,
+                         double vol, double gradient)
+{
+    unsigned s;
+
+    for (s = 0; s < samples; s++) {
+        cubic_run_frame(pcm, ts, first, sample, vol);
+        pcm += TRACK_CHANNELS;
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+/*
+ * Equivalent to cubic_scalar(), giving floating point output
+ *
+ * There is no dither or saturation; the output keeps the full
+ * resolution of the interpolation.
+ *
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+static void cubic_scalar_float(float *out[], unsigned stride,
+                               unsigned samples, const signed short *ts,
+                               int first, double sample, double step,
+                               double vol, double gradient)
+{
+    unsigned s;
+    int c;
+
+    for (s = 0; s < samples; s++) {
+        int sa;
+        double f, i[4];
+        const signed short *p;
+
+        sa = (int)sample;
+        f = sample - sa;
+        p = ts + (sa - first - 1) * TRACK_CHANNELS;
+
+        for (c = 0; c < TRACK_CHANNELS; c++) {
+            i[0] = p[c];
+            i[1] = p[c + TRACK_CHANNELS];
+            i[2] = p[c + TRACK_CHANNELS * 2];
+            i[3] = p[c + TRACK_CHANNELS * 3];
+
+            out[c][s * stride] = vol * cubic_interpolate(i, f) / SCALE;
+        }
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+static bool always(void)
+{
+    return true;
+}
+
+#ifdef WITH_X86_KERNELS
+
+/*
+ * Return: the stereo frame at the given offset, packed as left in
+ * the low 16 bits and right in the high 16 bits
+ */
+
+static inline int32_t load_frame(const signed short *base, int n)
+{
+    int32_t x;
+
+    memcpy(&x, base + n * TRACK_CHANNELS, sizeof x);
+    return x;
+}
+
+/*
+ * Process SSE2_FRAMES consecutive output frames
+ *
+ * Pre: all interpolation taps lie within the run at base
+ * Post: SSE2_FRAMES stereo frames are written to pcm
+ */
+
+__attribute__((target("sse2")))
+static inline void sse2_frames(signed short *pcm, const signed short *base,
+                               int first, const double sp[],
+                               const double vl[])
+{
+    int q, c, ia, ib;
+    double d[TRACK_CHANNELS][SSE2_FRAMES];
+    __m128d pos, mu, mu2, vol, y[TRACK_CHANNELS][4], v[TRACK_CHANNELS];
+    __m128i l, r;
+
+    pos = _mm_loadu_pd(sp);
+    vol = _mm_loadu_pd(vl);
+
+    /* Positions are known to be positive, so truncation is floor() */
+
+    mu = _mm_sub_pd(pos, _mm_cvtepi32_pd(_mm_cvttpd_epi32(pos)));
+    mu2 = _mm_mul_pd(mu, mu);
+
+    ia = (int)sp[0] - first - 1;
+    ib = (int)sp[1] - first - 1;
+
+    for (q = 0; q < 4; q++) {
+        __m128i f;
+
+        f = _mm_set_epi32(0, 0, load_frame(base, ib + q),
+                          load_frame(base, ia + q));
+        l = _mm_srai_epi32(_mm_slli_epi32(f, 16), 16);
+        r = _mm_srai_epi32(f, 16);
+        y[0][q] = _mm_cvtepi32_pd(l);
+        y[1][q] = _mm_cvtepi32_pd(r);
+    }
+
+    /* Dither is drawn in the same sequence as the scalar code */
+
+    for (q = 0; q < SSE2_FRAMES; q++) {
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            d[c][q] = dither();
+    }
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        __m128d a0, a1, a2, a3, *w = y[c];
+
+        /* Same order of operations as cubic_interpolate() */
+
+        a0 = _mm_add_pd(_mm_sub_pd(_mm_sub_pd(w[3], w[2]), w[0]), w[1]);
+        a1 = _mm_sub_pd(_mm_sub_pd(w[0], w[1]), a0);
+        a2 = _mm_sub_pd(w[2], w[0]);
+        a3 = w[1];
+
+        v[c] = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(a0, mu), mu2),
+                          _mm_mul_pd(a1, mu2));
+        v[c] = _mm_add_pd(_mm_add_pd(v[c], _mm_mul_pd(a2, mu)), a3);
+
+        v[c] = _mm_add_pd(_mm_mul_pd(vol, v[c]), _mm_loadu_pd(d[c]));
+
+        /* Saturate; truncation of the result is then the same as
+         * the scalar code */
+
+        v[c] = _mm_min_pd(v[c], _mm_set1_pd(SHRT_MAX));
+        v[c] = _mm_max_pd(v[c], _mm_set1_pd(SHRT_MIN));
+    }
+
+    l = _mm_cvttpd_epi32(v[0]);
+    r = _mm_cvttpd_epi32(v[1]);
+    l = _mm_unpacklo_epi32(l, r);
+    _mm_storel_epi64((__m128i*)pcm, _mm_packs_epi32(l, l));
+}
+
+/*
+ * Equivalent to cubic_scalar(), using SSE2
+ */
+
+__attribute__((target("sse2")))
+static void cubic_sse2(signed short *pcm, unsigned samples,
+                       const signed short *ts, int first,
+                       double sample, double step,
+                       double vol, double gradient)
+{
+    unsigned s;
+
+    for (s = 0; s + SSE2_FRAMES <= samples; s += SSE2_FRAMES) {
+        int n;
+        double sp[SSE2_FRAMES], vl[SSE2_FRAMES];
+
+        /* Accumulate in the same way as the scalar code, so the
+         * results are identical */
+
+        for (n = 0; n < SSE2_FRAMES; n++) {
+            sp[n] = sample;
+            vl[n] = vol;
+            sample += step;
+            vol += gradient;
+        }
+
+        sse2_frames(pcm, ts, first, sp, vl);
+        pcm += SSE2_FRAMES * TRACK_CHANNELS;
+    }
+
+    for (; s < samples; s++) {
+        cubic_run_frame(pcm, ts, first, sample, vol);
+        pcm += TRACK_CHANNELS;
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+/*
+ * Interpolate AVX2_FRAMES consecutive output frames
+ *
+ * Pre: all interpolation taps lie within the run at base
+ * Post: v contains the interpolated values for each channel
+ */
+
+__attribute__((target("avx2")))
+static inline void avx2_interpolate(__m256d v[TRACK_CHANNELS],
+                                    const signed short *base, int first,
+                                    const double sp[])
+{
+    int q, c;
+    __m256d pos, mu, mu2, y[TRACK_CHANNELS][4];
+    __m128i ip, idx, l, r;
+
+    pos = _mm256_loadu_pd(sp);
+
+    /* Positions are known to be positive, so truncation is floor() */
+
+    ip = _mm256_cvttpd_epi32(pos);
+    mu = _mm256_sub_pd(pos, _mm256_cvtepi32_pd(ip));
+    mu2 = _mm256_mul_pd(mu, mu);
+
+    /* Gather whole stereo frames as 32-bit words */
+
+    idx = _mm_sub_epi32(ip, _mm_set1_epi32(first + 1));
+
+    for (q = 0; q < 4; q++) {
+        __m128i f;
+
+        f = _mm_i32gather_epi32((const int*)base,
+                                _mm_add_epi32(idx, _mm_set1_epi32(q)),
+                                sizeof(signed short) * TRACK_CHANNELS);
+        l = _mm_srai_epi32(_mm_slli_epi32(f, 16), 16);
+        r = _mm_srai_epi32(f, 16);
+        y[0][q] = _mm256_cvtepi32_pd(l);
+        y[1][q] = _mm256_cvtepi32_pd(r);
+    }
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        __m256d a0, a1, a2, a3, *w = y[c];
+
+        /* Same order of operations as cubic_interpolate() */
+
+        a0 = _mm256_add_pd(_mm256_sub_pd(_mm256_sub_pd(w[3], w[2]), w[0]),
+                           w[1]);
+        a1 = _mm256_sub_pd(_mm256_sub_pd(w[0], w[1]), a0);
+        a2 = _mm256_sub_pd(w[2], w[0]);
+        a3 = w[1];
+
+        v[c] = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(a0, mu), mu2),
+                             _mm256_mul_pd(a1, mu2));
+        v[c] = _mm256_add_pd(_mm256_add_pd(v[c], _mm256_mul_pd(a2, mu)), a3);
+    }
+}
+
+/*
+ * Process AVX2_FRAMES consecutive output frames
+ *
+ * Pre: all interpolation taps lie within the run at base
+ * Post: AVX2_FRAMES stereo frames are written to pcm
+ */
+
+__attribute__((target("avx2")))
+static inline void avx2_frames(signed short *pcm, const signed short *base,
+                               int first, const double sp[],
+                               const double vl[])
+{
+    int q, c;
+    double d[TRACK_CHANNELS][AVX2_FRAMES];
+    __m256d vol, v[TRACK_CHANNELS];
+    __m128i l, r;
+
+    avx2_interpolate(v, base, first, sp);
+    vol = _mm256_loadu_pd(vl);
+
+    /* Dither is drawn in the same sequence as the scalar code */
+
+    for (q = 0; q < AVX2_FRAMES; q++) {
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            d[c][q] = dither();
+    }
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        v[c] = _mm256_add_pd(_mm256_mul_pd(vol, v[c]),
+                             _mm256_loadu_pd(d[c]));
+
+        v[c] = _mm256_min_pd(v[c], _mm256_set1_pd(SHRT_MAX));
+        v[c] = _mm256_max_pd(v[c], _mm256_set1_pd(SHRT_MIN));
+    }
+
+    l = _mm256_cvttpd_epi32(v[0]);
+    r = _mm256_cvttpd_epi32(v[1]);
+    _mm_storeu_si128((__m128i*)pcm,
+                     _mm_packs_epi32(_mm_unpacklo_epi32(l, r),
+                                     _mm_unpackhi_epi32(l, r)));
+}
+
+/*
+ * Equivalent to cubic_scalar(), using AVX2
+ */
+
+__attribute__((target("avx2")))
+static void cubic_avx2(signed short *pcm, unsigned samples,
+                       const signed short *ts, int first,
+                       double sample, double step,
+                       double vol, double gradient)
+{
+    unsigned s;
+
+    for (s = 0; s + AVX2_FRAMES <= samples; s += AVX2_FRAMES) {
+        int n;
+        double sp[AVX2_FRAMES], vl[AVX2_FRAMES];
+
+        for (n = 0; n < AVX2_FRAMES; n++) {
+            sp[n] = sample;
+            vl[n] = vol;
+            sample += step;
+            vol += gradient;
+        }
+
+        avx2_frames(pcm, ts, first, sp, vl);
+        pcm += AVX2_FRAMES * TRACK_CHANNELS;
+    }
+
+    for (; s < samples; s++) {
+        cubic_run_frame(pcm, ts, first, sample, vol);
+        pcm += TRACK_CHANNELS;
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+/*
+ * Equivalent to cubic_scalar_float(), using AVX2
+ */
+
+__attribute__((target("avx2")))
+static void cubic_avx2_float(float *out[], unsigned stride,
+                             unsigned samples, const signed short *ts,
+                             int first, double sample, double step,
+                             double vol, double gradient)
+{
+    unsigned s;
+    int c;
+
+    for (s = 0; s + AVX2_FRAMES <= samples; s += AVX2_FRAMES) {
+        int n;
+        double sp[AVX2_FRAMES], vl[AVX2_FRAMES];
+        __m256d v[TRACK_CHANNELS], vol4;
+
+        for (n = 0; n < AVX2_FRAMES; n++) {
+            sp[n] = sample;
+            vl[n] = vol;
+            sample += step;
+            vol += gradient;
+        }
+
+        avx2_interpolate(v, ts, first, sp);
+        vol4 = _mm256_mul_pd(_mm256_loadu_pd(vl), _mm256_set1_pd(1 / SCALE));
+
+        for (c = 0; c < TRACK_CHANNELS; c++) {
+            __m128 f;
+
+            f = _mm256_cvtpd_ps(_mm256_mul_pd(vol4, v[c]));
+
+            if (stride == 1) {
+                _mm_storeu_ps(out[c] + s, f);
+            } else {
+                float x[AVX2_FRAMES];
+
+                _mm_storeu_ps(x, f);
+                for (n = 0; n < AVX2_FRAMES; n++)
+                    out[c][(s + n) * stride] = x[n];
+            }
+        }
+    }
+
+    if (s < samples) {
+        float *rest[TRACK_CHANNELS];
+
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            rest[c] = out[c] + s * stride;
+
+        cubic_scalar_float(rest, stride, samples - s, ts, first,
+                           sample, step, vol, gradient);
+    }
+}
+
+static bool has_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static bool has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+#endif
+
+/*
+ * Output a period where the track contributes nothing; at zero volume
+ * or beyond the ends of the track
+ *
+ * The dither is still drawn so that the sequence, and therefore the
+ * output, is the same as if each frame had been resampled.
+ *
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static void quiet(signed short *pcm, unsigned samples)
+{
+    unsigned s;
+
+    for (s = 0; s < samples * TRACK_CHANNELS; s++)
+        *pcm++ = (signed short)dither();
+}
+
+/*
+ * Apply the volume ramp to a value which is held for the whole period,
+ * eg. when the deck is stopped
+ *
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static void hold(signed short *pcm, unsigned samples,
+                 const double y[TRACK_CHANNELS], double vol, double gradient)
+{
+    unsigned s;
+    int c;
+
+    for (s = 0; s < samples; s++) {
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            *pcm++ = quantise(vol * y[c] + dither());
+        vol += gradient;
+    }
+}
+
+/*
+ * Equivalent to quiet() and hold(), giving floating point output
+ *
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+static void quiet_float(float *out[], unsigned stride, unsigned samples)
+{
+    unsigned s;
+    int c;
+
+    for (c = 0; c < TRACK_CHANNELS; c++) {
+        if (stride == 1) {
+            memset(out[c], 0, sizeof(float) * samples);
+        } else {
+            for (s = 0; s < samples; s++)
+                out[c][s * stride] = 0.0;
+        }
+    }
+}
+
+static void hold_float(float *out[], unsigned stride, unsigned samples,
+                       const double y[TRACK_CHANNELS],
+                       double vol, double gradient)
+{
+    unsigned s;
+    int c;
+
+    for (s = 0; s < samples; s++) {
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            out[c][s * stride] = vol * y[c] / SCALE;
+        vol += gradient;
+    }
+}
+
+/*
+ * Decide how to resample a whole period, given the source audio it
+ * needs; reaching the given number of samples either side of each
+ * output position
+ *
+ * Return: one of PATH_QUIET, PATH_HOLD, PATH_RUN or PATH_EDGE
+ * Post: for PATH_RUN, *ts is the contiguous run of samples for the
+ * whole period, starting at index *first
+ */
+
+static int classify(struct track *tr, double sample, double step,
+                    unsigned samples, double reach,
+                    double start_vol, double end_vol,
+                    const signed short **ts, int *first)
+{
+    int rs, re;
+    double lo, hi, end;
+    unsigned int length;
+
+    if (start_vol == 0.0 && end_vol == 0.0)
+        return PATH_QUIET;
+
+    length = track_get_length(tr);
+    track_get_region(tr, &rs, &re);
+    end = sample + step * samples;
+
+    if (step < 0.0) {
+        lo = end;
+        hi = sample;
+    } else {
+        lo = sample;
+        hi = end;
+    }
+
+    /* Leave a margin for the rounding of the accumulated position */
+
+    lo -= reach + 1.0;
+    hi += reach + 1.0;
+
+    /* Audio may also have been imported in a region beyond the
+     * length, following a seek */
+
+    if ((hi < 0.0 || lo >= length) && (hi < rs || lo >= re))
+        return PATH_QUIET;
+
+    if (step == 0.0)
+        return PATH_HOLD;
+
+    if ((lo < 0.0 || hi >= length) && (lo < rs || hi >= re))
+        return PATH_EDGE;
+
+    *first = (int)lo;
+    *ts = track_get_run(tr, *first, (int)hi);
+    if (*ts == NULL)
+        return PATH_EDGE;
+
+    return PATH_RUN;
+}
+
+/*
+ * Return: the zeroth order modified Bessel function of the first kind
+ */
+
+static double bessel_i0(double x)
+{
+    int n;
+    double sum, term;
+
+    sum = 1.0;
+    term = 1.0;
+
+    for (n = 1; n < 32; n++) {
+        term *= SQ(x / 2 / n);
+        sum += term;
+        if (term < sum * 1e-12)
+            break;
+    }
+
+    return sum;
+}
+
+/*
+ * Precompute the impulse response of the windowed-sinc filter, once
+ * for all decks
+ */
+
+static void build_sinc_table(void)
+{
+    int n;
+
+    for (n = 0; n < SINC_TABLE; n++) {
+        double t, x, w;
+
+        t = (double)n / SINC_RES; /* in zero crossings */
+
+        if (t >= SINC_ZEROS) {
+            sinc_table[n] = 0.0;
+            continue;
+        }
+
+        x = M_PI * t;
+        w = bessel_i0(SINC_BETA * sqrt(1.0 - SQ(t / SINC_ZEROS)))
+            / bessel_i0(SINC_BETA);
+
+        sinc_table[n] = (n == 0 ? 1.0 : sin(x) / x) * w;
+    }
+
+    for (n = 0; n < SINC_TABLE - 1; n++)
+        sinc_delta[n] = sinc_table[n + 1] - sinc_table[n];
+    sinc_delta[SINC_TABLE - 1] = 0.0;
+}
+
+/*
+ * Apply the windowed-sinc filter to a contiguous run of samples
+ *
+ * Post: acc contains one (unscaled) value per channel
+ */
+
+static inline void sinc_taps(double acc[TRACK_CHANNELS],
+                             const signed short *ts, int first, int last,
+                             double sample, double cutoff)
+{
+    int j;
+
+    acc[0] = 0.0;
+    acc[1] = 0.0;
+
+    for (j = first; j <= last; j++) {
+        double x, h;
+        int i;
+
+        x = fabs(sample - j) * cutoff * SINC_RES;
+        i = (int)x;
+        h = sinc_table[i] + (x - i) * sinc_delta[i];
+
+        acc[0] += h * ts[0];
+        acc[1] += h * ts[1];
+        ts += TRACK_CHANNELS;
+    }
+}
+
+/*
+ * Filter the track at a single position, where the filter may reach
+ * beyond the ends of the track
+ *
+ * The filter is scaled in time by 1 / cutoff, so that it removes
+ * content which would otherwise alias when the track is played
+ * faster than the output.
+ *
+ * Post: acc contains one (unscaled) value per channel
+ */
+
+static inline void sinc_point(double acc[TRACK_CHANNELS], struct track *tr,
+                              double sample, double cutoff)
+{
+    int first, last, start, end;
+    double width;
+
+    width = SINC_ZEROS / cutoff;
+    first = (int)ceil(sample - width);
+    last = (int)floor(sample + width);
+
+    /* Use the imported audio nearest the sample; from the start of
+     * the track, or in the region beyond it */
+
+    start = 0;
+    end = track_get_length(tr);
+
+    if (last >= end) {
+        int rs, re;
+
+        track_get_region(tr, &rs, &re);
+        if (last >= rs && first < re) {
+            start = rs;
+            end = re;
+        }
+    }
+
+    if (first < start)
+        first = start;
+    if (last >= end)
+        last = end - 1;
+
+    if (first > last) {
+        acc[0] = 0.0;
+        acc[1] = 0.0;
+        return;
+    }
+
+    /* The filter is always much shorter than the guard, so this
+     * run is contiguous */
+
+    sinc_taps(acc, track_get_run(tr, first, last), first, last,
+              sample, cutoff);
+}
+
+/*
+ * Resample a single stereo frame of audio from the track using the
+ * windowed-sinc filter
+ *
+ * Post: two samples are written to pcm
+ */
+
+static inline void sinc_frame(signed short *pcm, struct track *tr,
+                              double sample, double cutoff, double vol)
+{
+    int c;
+    double acc[TRACK_CHANNELS];
+
+    sinc_point(acc, tr, sample, cutoff);
+
+    for (c = 0; c < TRACK_CHANNELS; c++)
+        *pcm++ = quantise(vol * cutoff * acc[c] + dither());
+}
+
+/*
+ * Resample a period from a contiguous run of samples using the
+ * windowed-sinc filter
+ *
+ * Pre: the filter for every frame of the period lies within the run
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+static void sinc_run(signed short *pcm, unsigned samples,
+                     const signed short *ts, int first,
+                     double sample, double step, double cutoff,
+                     double vol, double gradient)
+{
+    unsigned s;
+    int c;
+    double width;
+
+    width = SINC_ZEROS / cutoff;
+
+    for (s = 0; s < samples; s++) {
+        int a, b;
+        double acc[TRACK_CHANNELS];
+
+        a = (int)ceil(sample - width);
+        b = (int)floor(sample + width);
+
+        sinc_taps(acc, ts + (a - first) * TRACK_CHANNELS, a, b,
+                  sample, cutoff);
+
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            *pcm++ = quantise(vol * cutoff * acc[c] + dither());
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+/*
+ * Equivalent to sinc_run(), giving floating point output, and
+ * bounded at the ends of the track if ts is NULL
+ *
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+static void sinc_run_float(float *out[], unsigned stride, unsigned samples,
+                           struct track *tr, const signed short *ts,
+                           int first, double sample, double step,
+                           double cutoff, double vol, double gradient)
+{
+    unsigned s;
+    int c;
+    double width;
+
+    width = SINC_ZEROS / cutoff;
+
+    for (s = 0; s < samples; s++) {
+        double acc[TRACK_CHANNELS];
+
+        if (ts == NULL) {
+            sinc_point(acc, tr, sample, cutoff);
+        } else {
+            int a, b;
+
+            a = (int)ceil(sample - width);
+            b = (int)floor(sample + width);
+            sinc_taps(acc, ts + (a - first) * TRACK_CHANNELS, a, b,
+                      sample, cutoff);
+        }
+
+        for (c = 0; c < TRACK_CHANNELS; c++)
+            out[c][s * stride] = vol * cutoff * acc[c] / SCALE;
+
+        sample += step;
+        vol += gradient;
+    }
+}
+
+/* Kernels in order of preference */
+
+static struct kernel kernels[] = {
+#ifdef WITH_X86_KERNELS
+    { "avx2", cubic_avx2, cubic_avx2_float, has_avx2 },
+    { "sse2", cubic_sse2, cubic_scalar_float, has_sse2 },
+#endif
+    { "scalar", cubic_scalar, cubic_scalar_float, always }
+};
+
+static struct kernel *kernel = &kernels[ARRAY_SIZE(kernels) - 1];
+
+/*
+ * Select the fastest resampling kernel supported by this CPU
+ */
+
+void resample_init(void)
+{
+    struct kernel *k;
+
+    for (k = kernels; k < kernels + ARRAY_SIZE(kernels); k++) {
+        if (k->supported())
+            break;
+    }
+
+    kernel = k;
+    fprintf(stderr, "Resampling using %s kernel\n", kernel->name);
+
+    build_sinc_table();
+}
+
+/*
+ * Return: name of the resampling kernel currently in use
+ */
+
+const char* resample_kernel(void)
+{
+    return kernel->name;
+}
+
+/*
+ * Force the use of a specific resampling kernel, eg. for testing
+ *
+ * Return: -1 if the kernel is not known or not supported, otherwise 0
+ */
+
+int resample_use_kernel(const char *name)
+{
+    struct kernel *k;
+
+    for (k = kernels; k < kernels + ARRAY_SIZE(kernels); k++) {
+        if (!strcmp(k->name, name)) {
+            if (!k->supported())
+                return -1;
+            kernel = k;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * Return the dither to its initial state, so that output can be
+ * reproduced exactly
+ */
+
+void resample_reset_dither(void)
+{
+    dither_x = 0xbabe;
+}
+
+/*
+ * Build a block of PCM audio, resampled from the track
+ *
+ * This is just a basic resampler which has a small amount of aliasing
+ * where pitch > 1.0.
+ *
+ * This is the reference implementation, which considers every frame
+ * individually; resample_cubic() must produce the same output.
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+double resample_cubic_reference(signed short *pcm, unsigned samples,
+                                double sample_dt, struct track *tr,
+                                double position, double pitch,
+                                double start_vol, double end_vol)
+{
+    int s;
+    double sample, step, vol, gradient;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    for (s = 0; s < samples; s++) {
+        cubic_frame(pcm, tr, sample, vol);
+        pcm += TRACK_CHANNELS;
+
+        sample += step;
+        vol += gradient;
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Build a block of PCM audio, resampled from the track
+ *
+ * The common cases are decided once for the whole period, so the
+ * inner loops do not need to check the ends of the track or the
+ * boundaries between blocks.
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+double resample_cubic(signed short *pcm, unsigned samples, double sample_dt,
+                      struct track *tr, double position, double pitch,
+                      double start_vol, double end_vol)
+{
+    int first;
+    double sample, step, vol, gradient, y[TRACK_CHANNELS];
+    const signed short *ts;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    /* Taps run from floor(sample) - 1 to floor(sample) + 2 */
+
+    switch (classify(tr, sample, step, samples, 2.0, start_vol, end_vol,
+                     &ts, &first))
+    {
+    case PATH_QUIET:
+        quiet(pcm, samples);
+        break;
+
+    case PATH_HOLD:
+        cubic_point(y, tr, sample);
+        hold(pcm, samples, y, vol, gradient);
+        break;
+
+    case PATH_RUN:
+        kernel->cubic(pcm, samples, ts, first, sample, step, vol, gradient);
+        break;
+
+    default:
+        resample_cubic_reference(pcm, samples, sample_dt, tr, position,
+                                 pitch, start_vol, end_vol);
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Equivalent to resample_cubic(), giving floating point output
+ *
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+static double cubic_float(float *out[], unsigned stride, unsigned samples,
+                          double sample_dt, struct track *tr,
+                          double position, double pitch,
+                          double start_vol, double end_vol)
+{
+    unsigned s;
+    int c, first;
+    double sample, step, vol, gradient, y[TRACK_CHANNELS];
+    const signed short *ts;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    switch (classify(tr, sample, step, samples, 2.0, start_vol, end_vol,
+                     &ts, &first))
+    {
+    case PATH_QUIET:
+        quiet_float(out, stride, samples);
+        break;
+
+    case PATH_HOLD:
+        cubic_point(y, tr, sample);
+        hold_float(out, stride, samples, y, vol, gradient);
+        break;
+
+    case PATH_RUN:
+        kernel->cubic_float(out, stride, samples, ts, first, sample, step,
+                            vol, gradient);
+        break;
+
+    default:
+        for (s = 0; s < samples; s++) {
+            cubic_point(y, tr, sample);
+            for (c = 0; c < TRACK_CHANNELS; c++)
+                out[c][s * stride] = vol * y[c] / SCALE;
+
+            sample += step;
+            vol += gradient;
+        }
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Return: cutoff of the windowed-sinc filter, as a fraction of the
+ * Nyquist frequency of the track, for the given step
+ */
+
+static double sinc_cutoff(double step)
+{
+    double stretch;
+
+    /* Stretch the filter to lower the cutoff below the Nyquist
+     * frequency of the output */
+
+    stretch = fabs(step);
+    if (stretch < 1.0)
+        stretch = 1.0;
+    if (stretch > SINC_MAX_STRETCH)
+        stretch = SINC_MAX_STRETCH;
+
+    return SINC_ROLLOFF / stretch;
+}
+
+/*
+ * Build a block of PCM audio using the band-limited resampler
+ *
+ * This costs more CPU than resample_cubic(), increasing with pitch,
+ * but does not alias when pitch > 1.0. It does not allocate memory so
+ * is safe for use in the realtime thread.
+ *
+ * Pre: resample_init() has been called
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+double resample_sinc(signed short *pcm, unsigned samples, double sample_dt,
+                     struct track *tr, double position, double pitch,
+                     double start_vol, double end_vol)
+{
+    unsigned s;
+    int c, first;
+    double sample, step, vol, gradient, cutoff, acc[TRACK_CHANNELS];
+    const signed short *ts;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    cutoff = sinc_cutoff(step);
+
+    switch (classify(tr, sample, step, samples, SINC_ZEROS / cutoff,
+                     start_vol, end_vol, &ts, &first))
+    {
+    case PATH_QUIET:
+        quiet(pcm, samples);
+        break;
+
+    case PATH_HOLD:
+        sinc_point(acc, tr, sample, cutoff);
+        for (s = 0; s < samples; s++) {
+            for (c = 0; c < TRACK_CHANNELS; c++)
+                *pcm++ = quantise(vol * cutoff * acc[c] + dither());
+            vol += gradient;
+        }
+        break;
+
+    case PATH_RUN:
+        sinc_run(pcm, samples, ts, first, sample, step, cutoff,
+                 vol, gradient);
+        break;
+
+    default:
+        for (s = 0; s < samples; s++) {
+            sinc_frame(pcm, tr, sample, cutoff, vol);
+            pcm += TRACK_CHANNELS;
+
+            sample += step;
+            vol += gradient;
+        }
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Equivalent to resample_sinc(), giving floating point output
+ *
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+static double sinc_float(float *out[], unsigned stride, unsigned samples,
+                         double sample_dt, struct track *tr,
+                         double position, double pitch,
+                         double start_vol, double end_vol)
+{
+    int first;
+    double sample, step, vol, gradient, cutoff, acc[TRACK_CHANNELS];
+    const signed short *ts;
+
+    sample = position * tr->rate;
+    step = sample_dt * pitch * tr->rate;
+
+    vol = start_vol;
+    gradient = (end_vol - start_vol) / samples;
+
+    cutoff = sinc_cutoff(step);
+
+    switch (classify(tr, sample, step, samples, SINC_ZEROS / cutoff,
+                     start_vol, end_vol, &ts, &first))
+    {
+    case PATH_QUIET:
+        quiet_float(out, stride, samples);
+        break;
+
+    case PATH_HOLD:
+        sinc_point(acc, tr, sample, cutoff);
+        acc[0] *= cutoff;
+        acc[1] *= cutoff;
+        hold_float(out, stride, samples, acc, vol, gradient);
+        break;
+
+    case PATH_RUN:
+        sinc_run_float(out, stride, samples, tr, ts, first, sample, step,
+                       cutoff, vol, gradient);
+        break;
+
+    default:
+        sinc_run_float(out, stride, samples, tr, NULL, 0, sample, step,
+                       cutoff, vol, gradient);
+    }
+
+    return sample_dt * pitch * samples;
+}
+
+/*
+ * Build a block of PCM audio with the given resampler
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: buffer at pcm is filled with the given number of samples
+ */
+
+double resample(int mode, signed short *pcm, unsigned samples,
+                double sample_dt, struct track *tr, double position,
+                double pitch, double start_vol, double end_vol)
+{
+    switch (mode) {
+    case RESAMPLE_SINC:
+        return resample_sinc(pcm, samples, sample_dt, tr, position, pitch,
+                             start_vol, end_vol);
+    default:
+        return resample_cubic(pcm, samples, sample_dt, tr, position, pitch,
+                              start_vol, end_vol);
+    }
+}
+
+/*
+ * Build a block of floating point audio with the given resampler,
+ * where full scale is 1.0
+ *
+ * The channels are given as separate pointers, with a stride between
+ * consecutive frames; so the output can be interleaved (stride 2) or
+ * into separate buffers per channel (stride 1).
+ *
+ * Return: number of seconds advanced in the source audio track
+ * Post: channel c of frame s is written to out[c][s * stride]
+ */
+
+double resample_float(int mode, float *out[], unsigned stride,
+                      unsigned samples, double sample_dt, struct track *tr,
+                      double position, double pitch,
+                      double start_vol, double end_vol)
+{
+    switch (mode) {
+    case RESAMPLE_SINC:
+        return sinc_float(out, stride, samples, sample_dt, tr, position,
+                          pitch, start_vol, end_vol);
+    default:
+        return cubic_float(out, stride, samples, sample_dt, tr, position,
+                           pitch, start_vol, end_vol);
+    }
+}
+
+/*
+ * Return: short name of the given resampler
+ */
+
+const char* resample_name(int mode)
+{
+    switch (mode) {
+    case RESAMPLE_SINC:
+        return "sinc";
+    default:
+        return "cubic";
+    }
+}
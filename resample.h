@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Resampling of track audio to the output device
+ */
+
+#ifndef RESAMPLE_H
+#define RESAMPLE_H
+
+#include "track.h"
+
+#define RESAMPLE_CUBIC 0
+#define RESAMPLE_SINC  1
+
+void resample_init(void);
+const char* resample_kernel(void);
+int resample_use_kernel(const char *name);
+void resample_reset_dither(void);
+
+double resample_cubic_reference(signed short *pcm, unsigned samples,
+                                double sample_dt, struct track *tr,
+                                double position, double pitch,
+                                double start_vol, double end_vol);
+double resample_cubic(signed short *pcm, unsigned samples, double sample_dt,
+                      struct track *tr, double position, double pitch,
+                      double start_vol, double end_vol);
+double resample_sinc(signed short *pcm, unsigned samples, double sample_dt,
+                     struct track *tr, double position, double pitch,
+                     double start_vol, double end_vol);
+
+double resample(int mode, signed short *pcm, unsigned samples,
+                double sample_dt, struct track *tr, double position,
+                double pitch, double start_vol, double end_vol);
+double resample_float(int mode, float *out[], unsigned stride,
+                      unsigned samples, double sample_dt, struct track *tr,
+                      double position, double pitch,
+                      double start_vol, double end_vol);
+const char* resample_name(int mode);
+
+#endif
@@ -20,45 +20,94 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <sys/poll.h>
 
+#include "importer.h"
 #include "list.h"
 #include "mutex.h"
+#include "player.h"
 #include "realtime.h"
 #include "rig.h"
 
 #define EVENT_WAKE 0
 #define EVENT_QUIT 1
 
+#define RECLAIM_INTERVAL 10 /* ms, while replaced tracks are waiting */
+#define SEEK_INTERVAL 50 /* ms, between checks on players while importing */
+
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
-static int event[2]; /* pipe to wake up service thread */
+static int event[2], /* pipe to wake up service thread */
+    import_event[2]; /* and the import thread */
+static pthread_t import_ph;
 static struct list tracks = LIST_INIT(tracks),
     clients = LIST_INIT(clients);
 mutex lock;
 
-int rig_init()
-{
-    /* Create a pipe which will be used to wake us from other threads */
+/*
+ * Create a pipe which will be used to wake a thread from other threads
+ *
+ * Return: 0 on success, otherwise -1
+ */
 
-    if (pipe(event) == -1) {
+static int event_pipe(int p[2])
+{
+    if (pipe(p) == -1) {
         perror("pipe");
         return -1;
     }
 
-    if (fcntl(event[0], F_SETFL, O_NONBLOCK) == -1) {
+    if (fcntl(p[0], F_SETFL, O_NONBLOCK) == -1) {
         perror("fcntl");
-        if (close(event[1]) == -1)
+        if (close(p[1]) == -1)
             abort();
-        if (close(event[0]) == -1)
+        if (close(p[0]) == -1)
             abort();
         return -1;
     }
 
+    return 0;
+}
+
+static void close_pipe(int p[2])
+{
+    if (close(p[0]) == -1)
+        abort();
+    if (close(p[1]) == -1)
+        abort();
+}
+
+/*
+ * Post a simple event into the event loop of a thread
+ */
+
+static int post_event(int fd, char e)
+{
+    rt_not_allowed();
+
+    if (write(fd, &e, 1) == -1) {
+        perror("write");
+        return -1;
+    }
+
+    return 0;
+}
+
+int rig_init()
+{
+    if (event_pipe(event) == -1)
+        return -1;
+
+    if (event_pipe(import_event) == -1) {
+        close_pipe(event);
+        return -1;
+    }
+
     mutex_init(&lock);
 
     return 0;
@@ -68,10 +117,138 @@ void rig_clear()
 {
     mutex_clear(&lock);
 
-    if (close(event[0]) == -1)
-        abort();
-    if (close(event[1]) == -1)
-        abort();
+    close_pipe(import_event);
+    close_pipe(event);
+}
+
+/*
+ * Read all events waiting on an event pipe
+ *
+ * Return: -1 on error, 1 if asked to quit, otherwise 0
+ */
+
+static int read_events(int fd)
+{
+    for (;;) {
+        char e;
+        ssize_t z;
+
+        z = read(fd, &e, 1);
+        if (z == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            } else {
+                perror("read");
+                return -1;
+            }
+        }
+
+        switch (e) {
+        case EVENT_WAKE:
+            break;
+
+        case EVENT_QUIT:
+            return 1;
+
+        default:
+            abort();
+        }
+    }
+}
+
+/*
+ * Thread which reads the audio of tracks being imported
+ *
+ * Reading from the importers, and metering the audio, is done without
+ * the rig lock so that it does not hold up the interface. It is taken
+ * only to see which tracks are importing and to complete an import.
+ *
+ * Only this thread removes a track from the list, and the list holds
+ * a reference, so the tracks can be used between taking the lock.
+ */
+
+static void* import_main(void *arg)
+{
+    struct pollfd pt[32];
+    const struct pollfd *px = pt + ARRAY_SIZE(pt);
+    struct track *t[ARRAY_SIZE(pt)];
+    bool done[ARRAY_SIZE(pt)];
+
+    /* Monitor event pipe from other threads */
+
+    pt[0].fd = import_event[0];
+    pt[0].revents = 0;
+    pt[0].events = POLLIN;
+
+    for (;;) { /* exit via EVENT_QUIT */
+        int r, timeout;
+        size_t n, m;
+        struct pollfd *pe;
+        struct track *track;
+
+        mutex_lock(&lock);
+
+        /* A player may have moved beyond the audio imported so far */
+
+        player_want_audio();
+
+        /* Replies from import helpers, then the tracks; do our best
+         * if we run out of poll entries */
+
+        pe = &pt[1];
+        pe += importer_pollfd(pe);
+        n = 0;
+
+        list_for_each(track, &tracks, rig) {
+            if (px - pe < TRACK_POLLFDS)
+                break;
+            pe += track_pollfd(track, pe);
+            t[n++] = track;
+        }
+
+        mutex_unlock(&lock);
+
+        timeout = (n > 0) ? SEEK_INTERVAL : -1;
+
+        r = poll(pt, pe - pt, timeout);
+        if (r == -1) {
+            if (errno == EINTR) {
+                continue;
+            } else {
+                perror("poll");
+                abort();
+            }
+        }
+
+        if (pt[0].revents != 0) {
+            r = read_events(import_event[0]);
+            if (r == -1)
+                abort();
+            if (r == 1)
+                break;
+        }
+
+        for (m = 0; m < n; m++)
+            done[m] = track_read(t[m]);
+
+        mutex_lock(&lock);
+
+        importer_handle();
+
+        for (m = 0; m < n; m++) {
+            if (done[m])
+                track_handle(t[m]);
+        }
+
+        mutex_unlock(&lock);
+
+        /* Tracks which completed are written to the cache, without
+         * holding up the interface */
+
+        track_save_completed();
+    }
+
+    return NULL;
 }
 
 /*
@@ -89,9 +266,17 @@ void rig_clear()
 
 int rig_main()
 {
+    int r;
     struct pollfd pt[32];
     const struct pollfd *px = pt + ARRAY_SIZE(pt);
 
+    r = pthread_create(&import_ph, NULL, import_main, NULL);
+    if (r != 0) {
+        errno = r;
+        perror("pthread_create");
+        return -1;
+    }
+
     /* Monitor event pipe from external threads */
 
     pt[0].fd = event[0];
@@ -105,22 +290,14 @@ int rig_main()
     mutex_lock(&lock);
 
     for (;;) { /* exit via EVENT_QUIT */
-        int r;
+        int timeout;
         struct pollfd *pe;
-        struct track *track, *xtrack;
         struct client *client, *xclient;
 
         pe = &pt[2];
 
         /* Do our best if we run out of poll entries */
 
-        list_for_each(track, &tracks, rig) {
-            if (pe == px)
-                break;
-            track_pollfd(track, pe);
-            pe++;
-        }
-
         list_for_each(client, &clients, rig) {
             if (pe == px)
                 break;
@@ -128,47 +305,34 @@ int rig_main()
             pe++;
         }
 
+        /* Tracks replaced on a deck are released here, once the
+         * realtime thread has finished with them */
+
+        if (player_reclaim() > 0)
+            timeout = RECLAIM_INTERVAL;
+        else
+            timeout = -1;
+
         mutex_unlock(&lock);
 
-        r = poll(pt, pe - pt, -1);
+        r = poll(pt, pe - pt, timeout);
         if (r == -1) {
             if (errno == EINTR) {
                 mutex_lock(&lock);
                 continue;
             } else {
                 perror("poll");
-                return -1;
+                r = -1;
+                goto finish;
             }
         }
 
         /* Process all events on the event pipe */
 
         if (pt[0].revents != 0) {
-            for (;;) {
-                char e;
-                size_t z;
-
-                z = read(event[0], &e, 1);
-                if (z == -1) {
-                    if (errno == EAGAIN) {
-                        break;
-                    } else {
-                        perror("read");
-                        return -1;
-                    }
-                }
-
-                switch (e) {
-                case EVENT_WAKE:
-                    break;
-
-                case EVENT_QUIT:
-                    goto finish;
-
-                default:
-                    abort();
-                }
-            }
+            r = read_events(event[0]);
+            if (r != 0)
+                goto finish;
         }
 
         mutex_lock(&lock);
@@ -176,31 +340,19 @@ int rig_main()
         if (pt[1].revents != 0)
             server_handle();
 
-        list_for_each_safe(track, xtrack, &tracks, rig)
-            track_handle(track);
-
         list_for_each_safe(client, xclient, &clients, rig)
             client_handle(client);
     }
  finish:
 
-    return 0;
-}
+    /* Stop the import thread, leaving any imports unfinished */
 
-/*
- * Post a simple event into the rig event loop
- */
-
-static int post_event(char e)
-{
-    rt_not_allowed();
-
-    if (write(event[1], &e, 1) == -1) {
-        perror("write");
-        return -1;
-    }
+    if (post_event(import_event[1], EVENT_QUIT) == -1)
+        abort();
+    if (pthread_join(import_ph, NULL) != 0)
+        abort();
 
-    return 0;
+    return r == -1 ? -1 : 0;
 }
 
 /*
@@ -209,7 +361,7 @@ static int post_event(char e)
 
 int rig_quit()
 {
-    return post_event(EVENT_QUIT);
+    return post_event(event[1], EVENT_QUIT);
 }
 
 void rig_lock(void)
@@ -230,7 +382,7 @@ void rig_post_track(struct track *t)
 {
     track_get(t);
     list_add(&t->rig, &tracks);
-    post_event(EVENT_WAKE);
+    post_event(import_event[1], EVENT_WAKE);
 }
 
 void rig_post_client(struct client *c)
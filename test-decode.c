@@ -0,0 +1,305 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "timecoder.h"
+
+#define STEREO 2
+#define RATE 96000
+#define SECONDS 20
+#define BLOCK 256 /* samples submitted at once */
+
+#define MONITOR 58 /* size of the scope in the interface */
+
+#define ONE 24000 /* amplitudes of the wave, for each bit value */
+#define ZERO 12000
+
+#define SEGMENT 0.5 /* seconds played at each needle drop */
+#define DROPS 100
+#define BURST 32 /* cycles of bits which are misread in a burst */
+#define STEP 48 /* samples submitted at once when timing a lock */
+#define NEAR 2 /* cycles from a position which count as being at it */
+
+/*
+ * Manual test of the timecode decoder; a signal for each timecode is
+ * made and decoded, as if the record is playing forwards, to measure
+ * the speed of the decoder and the time it takes to find the position
+ * after the needle is dropped
+ */
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Return: the timecode following the given one, as in timecoder.c
+ */
+
+static bits_t next(struct timecode_def *def, bits_t code)
+{
+    bits_t b;
+
+    b = __builtin_parity(code & (def->taps | 0x1));
+    return (code >> 1) | (b << (def->bits - 1));
+}
+
+/*
+ * Make the signal of the given timecode, from the given position
+ *
+ * The first cycles, up to burst, and otherwise the given fraction of
+ * cycles, carry a random bit in place of the timecode; as if misread.
+ *
+ * Return: the timecode at the position after the signal
+ */
+
+static bits_t make(struct timecode_def *def, bits_t code,
+                   signed short *pcm, size_t npcm,
+                   size_t burst, double errors)
+{
+    size_t s, cycle;
+    bits_t b;
+    double theta, amp, p, q;
+
+    cycle = (size_t)-1;
+    amp = 0.0;
+
+    for (s = 0; s < npcm; s++) {
+        theta = 2 * M_PI * def->resolution * s / RATE;
+
+        /* Each new wave cycle carries the next bit of the sequence */
+
+        if ((size_t)def->resolution * s / RATE != cycle) {
+            if (cycle != (size_t)-1)
+                code = next(def, code);
+            cycle = (size_t)def->resolution * s / RATE;
+
+            b = code >> (def->bits - 1);
+            if (cycle < burst || rand() < errors * RAND_MAX)
+                b = rand() & 0x1;
+            amp = b ? ONE : ZERO;
+        }
+
+        p = amp * sin(theta);
+        q = amp * cos(theta);
+        if (!(def->flags & SWITCH_PHASE))
+            q = -q;
+
+        if (def->flags & SWITCH_PRIMARY) {
+            pcm[s * STEREO] = p;
+            pcm[s * STEREO + 1] = q;
+        } else {
+            pcm[s * STEREO] = q;
+            pcm[s * STEREO + 1] = p;
+        }
+    }
+
+    return next(def, code);
+}
+
+/*
+ * Decode the signal, optionally with the x-y monitor; the monitor is
+ * plotted as the interface would, outside of the time measured
+ */
+
+static void run(struct timecode_def *def, signed short *pcm, size_t npcm,
+                bool monitor)
+{
+    size_t n;
+    double start, t;
+    struct timecoder tc;
+
+    timecoder_init(&tc, def, 1.0, RATE);
+    if (monitor && timecoder_monitor_init(&tc, MONITOR) == -1)
+        abort();
+
+    t = 0.0;
+
+    for (n = 0; n + BLOCK <= npcm; n += BLOCK) {
+        start = now();
+        timecoder_submit(&tc, pcm + n * STEREO, BLOCK);
+        t += now() - start;
+
+        if (monitor)
+            timecoder_monitor_update(&tc);
+    }
+
+    printf("%-14s %.2fns per sample%s, pitch %.4f, position %d (expect %d)\n",
+           def->name, t / n * 1e9, monitor ? " with monitor" : "",
+           timecoder_get_pitch(&tc), timecoder_get_position(&tc, NULL),
+           def->resolution * SECONDS - 1);
+
+    if (monitor)
+        timecoder_monitor_clear(&tc);
+    timecoder_clear(&tc);
+}
+
+/*
+ * Drop the needle at random positions, or have a burst of bits be
+ * misread as the record plays; time how long it takes to find the
+ * position once the bits are readable
+ *
+ * Also the time for which the position is stale (where the needle
+ * was before it was dropped), wrong (anywhere else), or lost after it
+ * was found.
+ */
+
+static void lock(struct timecode_def *def, bool tolerant, bool drop,
+                 double errors)
+{
+    unsigned int n, found, position, start, stale;
+    size_t s, npcm, from;
+    double sum, late, wrong, lost, step;
+    bits_t code;
+    signed short *pcm;
+    struct timecoder tc;
+
+    npcm = RATE * SEGMENT;
+    pcm = malloc(sizeof(signed short) * STEREO * npcm);
+    if (pcm == NULL)
+        abort();
+
+    timecoder_init(&tc, def, 1.0, RATE);
+    timecoder_set_tolerant(&tc, tolerant);
+
+    srand(0);
+    code = def->seed;
+    position = 0;
+    found = 0;
+    sum = 0.0;
+    late = 0.0;
+    wrong = 0.0;
+    lost = 0.0;
+    step = (double)STEP / RATE;
+
+    for (n = 0; n < DROPS; n++) {
+        bool ok;
+        int r, t;
+
+        stale = position;
+
+        if (drop) {
+            start = rand() % (def->length - def->resolution);
+            code = def->seed;
+            for (position = 0; position < start; position++)
+                code = next(def, code);
+        }
+
+        start = position;
+        code = make(def, code, pcm, npcm, drop ? 0 : BURST, errors);
+        position += def->resolution * SEGMENT;
+
+        ok = false;
+        from = drop ? 0 : (size_t)BURST * RATE / def->resolution;
+
+        for (s = 0; s + STEP <= npcm; s += STEP) {
+            timecoder_submit(&tc, pcm + s * STEREO, STEP);
+
+            r = timecoder_get_position(&tc, NULL);
+            t = def->resolution * s / RATE;
+
+            if (r == -1) {
+                if (ok)
+                    lost += step;
+            } else if (abs(r - (int)(start + t)) <= NEAR) {
+                if (!ok && s >= from) {
+                    ok = true;
+                    found++;
+                    sum += (double)(s - from) / RATE;
+                }
+            } else if (abs(r - (int)(stale + t)) <= NEAR) {
+                late += step;
+            } else {
+                wrong += step;
+            }
+        }
+    }
+
+    printf("%-14s %-8s %-5s %2.0f%% errors: found %3u/%u in %5.1fms,"
+           " stale %4.1fms, wrong %4.1fms, lost %4.1fms\n",
+           def->name, tolerant ? "tolerant" : "exact", drop ? "drop" : "burst",
+           errors * 100, found, DROPS, found ? sum / found * 1e3 : 0.0,
+           late / DROPS * 1e3, wrong / DROPS * 1e3, lost / DROPS * 1e3);
+
+    timecoder_clear(&tc);
+    free(pcm);
+}
+
+static void test(const char *name)
+{
+    size_t npcm;
+    signed short *pcm;
+    struct timecode_def *def;
+
+    def = timecoder_find_definition(name);
+    if (def == NULL)
+        abort();
+
+    while (!timecoder_has_lookup(def)) {
+        if (timecoder_lookup_failed(def))
+            abort();
+        usleep(10000);
+    }
+
+    npcm = (size_t)RATE * SECONDS;
+    pcm = malloc(sizeof(signed short) * STEREO * npcm);
+    if (pcm == NULL)
+        abort();
+
+    make(def, def->seed, pcm, npcm, 0, 0.0);
+    run(def, pcm, npcm, false);
+    run(def, pcm, npcm, true);
+
+    free(pcm);
+
+    lock(def, false, true, 0.0);
+    lock(def, true, true, 0.0);
+    lock(def, false, true, 0.02);
+    lock(def, true, true, 0.02);
+    lock(def, false, false, 0.0);
+    lock(def, true, false, 0.0);
+}
+
+int main(int argc, char *argv[])
+{
+    int n;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <timecode> [...]\n", argv[0]);
+        return 1;
+    }
+
+    for (n = 1; n < argc; n++)
+        test(argv[n]);
+
+    timecoder_free_lookup();
+
+    return 0;
+}
@@ -0,0 +1,181 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "lut.h"
+
+#define BITS 23
+#define SLOTS 2110000 /* as traktor_b */
+#define LOOKUPS 10000000
+
+#define SPREAD 2654435761u /* odd, so codes are distinct */
+
+#define SAVED_SLOTS 1000
+
+/*
+ * Manual test of the latency of a lookup in the timecode lookup
+ * table, in the hashed and direct forms
+ */
+
+static unsigned int code(unsigned int n)
+{
+    return (n * SPREAD) & ((1 << BITS) - 1);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+        abort();
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Time lookups of the timecodes in the given order; either in the
+ * sequence they were pushed, as when a record plays, or at random
+ */
+
+static void run(struct lut *lut, const char *name, bool random)
+{
+    unsigned int n, sum, *order;
+    double start, t;
+
+    order = malloc(sizeof(unsigned int) * SLOTS);
+    if (order == NULL)
+        abort();
+
+    srand(0);
+    for (n = 0; n < SLOTS; n++)
+        order[n] = code(random ? rand() % SLOTS : n);
+
+    sum = 0;
+    start = now();
+
+    for (n = 0; n < LOOKUPS; n++)
+        sum += lut_lookup(lut, order[n % SLOTS]);
+
+    t = now() - start;
+    printf("%s, %s: %.1fns per lookup (%u)\n",
+           name, random ? "random" : "sequential", t / LOOKUPS * 1e9, sum);
+
+    free(order);
+}
+
+static void test(const char *name, int bits)
+{
+    unsigned int n;
+    struct lut lut;
+
+    if (lut_init(&lut, SLOTS, bits) == -1)
+        abort();
+
+    for (n = 0; n < SLOTS; n++)
+        lut_push(&lut, code(n));
+
+    for (n = 0; n < SLOTS; n++)
+        assert(lut_lookup(&lut, code(n)) == n);
+
+    assert(lut_lookup(&lut, code(SLOTS)) == (unsigned)-1);
+
+    run(&lut, name, false);
+    run(&lut, name, true);
+
+    lut_clear(&lut);
+}
+
+/*
+ * Check a saved table is used as it was, but not once it has been
+ * corrupted so that a chain of slots loops
+ */
+
+static void saved(void)
+{
+    int fd;
+    unsigned int n;
+    char pathname[] = "/tmp/test-lut.XXXXXX";
+    struct lut lut;
+    struct slot bad;
+    struct stat st;
+
+    fd = mkstemp(pathname);
+    if (fd == -1)
+        abort();
+
+    if (lut_init(&lut, SAVED_SLOTS, 32) == -1)
+        abort();
+
+    for (n = 0; n < SAVED_SLOTS; n++)
+        lut_push(&lut, code(n));
+
+    if (lut_save(&lut, pathname) == -1)
+        abort();
+
+    lut_clear(&lut);
+
+    if (lut_map(&lut, pathname, SAVED_SLOTS, 32) == -1)
+        abort();
+
+    for (n = 0; n < SAVED_SLOTS; n++)
+        assert(lut_lookup(&lut, code(n)) == n);
+
+    lut_clear(&lut);
+
+    /* The last slot is at the end of the file; link it to itself */
+
+    if (close(fd) == -1)
+        abort();
+
+    fd = open(pathname, O_RDWR);
+    if (fd == -1 || fstat(fd, &st) == -1)
+        abort();
+
+    bad.timecode = code(SAVED_SLOTS - 1);
+    bad.next = SAVED_SLOTS - 1;
+
+    if (pwrite(fd, &bad, sizeof bad, st.st_size - sizeof bad) != sizeof bad)
+        abort();
+
+    assert(lut_map(&lut, pathname, SAVED_SLOTS, 32) == -1);
+
+    if (close(fd) == -1)
+        abort();
+    if (unlink(pathname) == -1)
+        abort();
+
+    printf("saved: corrupt table rejected\n");
+}
+
+int main(int argc, char *argv[])
+{
+    saved();
+    test("direct", BITS);
+    test("hashed", 32); /* too many codes to be direct */
+
+    return 0;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Compare the chunked meters against the original per-sample meters,
+ * and measure the throughput of each
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "meter.h"
+#include "track.h"
+
+#define RATE 44100
+#define PASSES 8
+
+/* Largest mean difference in a meter value, out of 255, which is
+ * considered to look the same */
+
+#define TOLERANCE 2.0
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double noise(void)
+{
+    return (double)rand() / RAND_MAX - 0.5;
+}
+
+/*
+ * Fill a block with something resembling music; a beat with a quieter
+ * breakdown, so the meters have transients and slower changes to
+ * follow
+ */
+
+static void fill(struct track_block *b)
+{
+    unsigned int n;
+    signed short *pcm;
+
+    srand(0);
+    pcm = b->pcm + TRACK_GUARD * TRACK_CHANNELS;
+
+    for (n = 0; n < TRACK_BLOCK_SAMPLES; n++) {
+        double t, level, beat, kick, hat, pad, x;
+
+        t = (double)n / RATE;
+        beat = fmod(t, 0.5);
+
+        level = 0.3 + 0.35 * (1.0 + sin(t * 0.2));
+        if ((int)(t / 20) % 3 == 1)
+            level *= 0.2;
+
+        kick = exp(-beat * 12) * sin(2 * M_PI * 55 * beat
+                                     * (1 + exp(-beat * 30)));
+        hat = fmod(t + 0.25, 0.5) < 0.03 ? noise() : 0.0;
+        pad = 0.2 * sin(2 * M_PI * 220 * t) * sin(2 * M_PI * 0.3 * t)
+            + 0.1 * noise();
+
+        x = level * (0.6 * kick + 0.5 * hat + pad);
+        if (x > 1.0)
+            x = 1.0;
+        if (x < -1.0)
+            x = -1.0;
+
+        pcm[n * 2] = x * 32767;
+        pcm[n * 2 + 1] = x * 30000 * (0.9 + 0.1 * sin(t));
+    }
+}
+
+/*
+ * Return: mean absolute difference between two sets of meter values
+ */
+
+static double difference(const unsigned char *a, const unsigned char *b,
+                         size_t n)
+{
+    size_t i;
+    double d;
+
+    d = 0.0;
+    for (i = 0; i < n; i++)
+        d += abs(a[i] - b[i]);
+
+    return d / n;
+}
+
+/*
+ * Meter the block in runs of awkward length, as audio arrives from
+ * an importer
+ */
+
+static void meter_pieces(struct meter *m, struct track_block *b)
+{
+    unsigned int fill, len;
+
+    srand(1);
+    fill = 0;
+
+    while (fill < TRACK_BLOCK_SAMPLES) {
+        len = rand() % 5000;
+        if (len > TRACK_BLOCK_SAMPLES - fill)
+            len = TRACK_BLOCK_SAMPLES - fill;
+
+        meter_block(m, b, fill - fill % TRACK_PPM_RES,
+                    len + fill % TRACK_PPM_RES);
+        fill += len;
+    }
+}
+
+/*
+ * Measure the throughput of a metering function
+ */
+
+static void benchmark(const char *name, struct track_block *b,
+                      void (*f)(struct meter*, struct track_block*,
+                                unsigned int, unsigned int))
+{
+    int n;
+    double start, elapsed;
+    struct meter m;
+
+    meter_init(&m);
+    start = now();
+
+    for (n = 0; n < PASSES; n++)
+        f(&m, b, 0, TRACK_BLOCK_SAMPLES);
+
+    elapsed = now() - start;
+
+    printf("%s: %.0f MB/s\n", name, (double)PASSES * TRACK_BLOCK_SAMPLES
+           * TRACK_CHANNELS * sizeof(signed short) / elapsed / 1e6);
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+    double dp, dov;
+    struct meter m;
+    struct track_block *b;
+    unsigned char ppm[TRACK_PPM_N], overview[TRACK_OVERVIEW_N];
+
+    b = malloc(sizeof *b);
+    if (b == NULL) {
+        perror("malloc");
+        return -1;
+    }
+
+    fill(b);
+    r = 0;
+
+    meter_init(&m);
+    meter_block_reference(&m, b, 0, TRACK_BLOCK_SAMPLES);
+    memcpy(ppm, b->ppm, sizeof ppm);
+    memcpy(overview, b->overview, sizeof overview);
+
+    meter_init(&m);
+    meter_block(&m, b, 0, TRACK_BLOCK_SAMPLES);
+
+    dp = difference(ppm, b->ppm, sizeof ppm);
+    dov = difference(overview, b->overview, sizeof overview);
+
+    printf("mean difference from reference: ppm %.2f, overview %.2f\n",
+           dp, dov);
+
+    if (dp > TOLERANCE || dov > TOLERANCE) {
+        printf("chunked meters differ from the reference\n");
+        r = -1;
+    }
+
+    /* The result must not depend on how the audio arrives */
+
+    memcpy(ppm, b->ppm, sizeof ppm);
+    memcpy(overview, b->overview, sizeof overview);
+
+    meter_init(&m);
+    meter_pieces(&m, b);
+
+    if (memcmp(ppm, b->ppm, sizeof ppm) != 0
+        || memcmp(overview, b->overview, sizeof overview) != 0)
+    {
+        printf("metering in pieces differs from a single pass\n");
+        r = -1;
+    }
+
+    benchmark("reference", b, meter_block_reference);
+    benchmark("chunked", b, meter_block);
+
+    free(b);
+
+    return r;
+}
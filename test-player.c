@@ -0,0 +1,263 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+/*
+ * Stress test of loading tracks to a deck which is playing
+ *
+ * One thread renders audio from two players, as the realtime thread
+ * would, whilst another repeatedly loads tracks and instant doubles
+ * between them. No period of audio is allowed to be silent.
+ */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "player.h"
+#include "resample.h"
+#include "thread.h"
+#include "timecoder.h"
+#include "track.h"
+
+#define RATE 44100
+#define DEVICE_RATE 48000
+#define PERIOD 256
+#define PERIODS 100000 /* per player */
+#define SCRATCH 2000 /* periods in each direction */
+#define TRACKS 4
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+static struct track tracks[TRACKS];
+static struct player player[2];
+static bool done = false;
+
+/*
+ * The test supplies its own reference counting, in place of track.c
+ * which would import audio
+ *
+ * A released track is poisoned, so that any further use by the
+ * player results in silence, which the test detects.
+ */
+
+void track_get(struct track *t)
+{
+    t->refcount++;
+}
+
+void track_put(struct track *t)
+{
+    t->refcount--;
+
+    if (t->refcount == 0) {
+        t->length = 0;
+        t->rate = 0;
+    }
+}
+
+void track_want(struct track *t, int s)
+{
+}
+
+/*
+ * Return: a track, as if newly imported, which the caller holds a
+ * reference on
+ */
+
+static struct track* get_track(void)
+{
+    static size_t n = 0;
+    struct track *t;
+
+    t = &tracks[n++ % TRACKS];
+
+    if (t->refcount == 0) {
+        t->length = TRACK_BLOCK_SAMPLES;
+        t->rate = RATE;
+    }
+
+    track_get(t);
+    return t;
+}
+
+/*
+ * Fill a track with a constant level, so it is never silent
+ */
+
+static void fill(struct track *t, signed short level)
+{
+    unsigned int s;
+    signed short *pcm;
+
+    t->refcount = 0;
+    t->rate = RATE;
+    t->length = TRACK_BLOCK_SAMPLES;
+    t->blocks = 1;
+    t->index = malloc(sizeof *t->index + sizeof *t->index->block);
+    if (t->index == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    t->index->prev = NULL;
+    t->index->size = 1;
+    t->index->block[0] = malloc(sizeof(struct track_block));
+    if (t->index->block[0] == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    pcm = t->index->block[0]->pcm;
+    for (s = 0; s < (TRACK_GUARD + TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS; s++)
+        pcm[s] = level;
+}
+
+/*
+ * Return: true if the period is silent
+ */
+
+static bool silent(const signed short *pcm)
+{
+    unsigned int s;
+
+    for (s = 0; s < PERIOD * PLAYER_CHANNELS; s++) {
+        if (abs(pcm[s]) > 64)
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Render audio from the players, in place of the realtime thread
+ */
+
+static void* render(void *p)
+{
+    int n, silence;
+    size_t d;
+    signed short pcm[PERIOD * PLAYER_CHANNELS];
+
+    silence = 0;
+
+    for (n = 0; n < PERIODS; n++) {
+        for (d = 0; d < ARRAY_SIZE(player); d++) {
+
+            /* Move back and forth to stay within the track */
+
+            player_set_pitch(&player[d], (n / SCRATCH) % 2 ? -1.0 : 1.0);
+            player_collect(&player[d], pcm, PERIOD);
+
+            /* The first period fades in from silence */
+
+            if (n > 0 && silent(pcm))
+                silence++;
+        }
+    }
+
+    __atomic_store_n(&done, true, __ATOMIC_RELEASE);
+
+    return (void*)(long)silence;
+}
+
+int main(int argc, char *argv[])
+{
+    int r;
+    long silence;
+    size_t n, loads;
+    pthread_t rt;
+    struct timecoder tc;
+
+    if (thread_global_init() == -1)
+        return -1;
+
+    resample_init();
+
+    for (n = 0; n < TRACKS; n++)
+        fill(&tracks[n], 4000 + 2000 * n);
+
+    /* Start away from the beginning of the track, so that an instant
+     * double from a player one period behind can never go before it */
+
+    for (n = 0; n < ARRAY_SIZE(player); n++) {
+        player_init(&player[n], DEVICE_RATE, get_track(), &tc);
+        player_seek_to(&player[n], 5.0);
+    }
+
+    if (pthread_create(&rt, NULL, render, NULL) != 0) {
+        perror("pthread_create");
+        return -1;
+    }
+
+    /* Hammer the players with loads and instant doubles */
+
+    loads = 0;
+
+    while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+        switch (loads++ % 4) {
+        case 0:
+            player_set_track(&player[0], get_track());
+            break;
+        case 1:
+            player_clone(&player[1], &player[0]);
+            break;
+        case 2:
+            player_set_track(&player[1], get_track());
+            break;
+        case 3:
+            player_clone(&player[0], &player[1]);
+            break;
+        }
+
+        player_reclaim();
+    }
+
+    if (pthread_join(rt, (void**)&silence) != 0) {
+        perror("pthread_join");
+        return -1;
+    }
+
+    printf("%zu loads, %ld silent periods\n", loads, silence);
+    r = (silence == 0) ? 0 : -1;
+
+    /* Once rendering has stopped, everything can be released */
+
+    if (player_reclaim() != 0) {
+        printf("replaced tracks were not released\n");
+        r = -1;
+    }
+
+    for (n = 0; n < ARRAY_SIZE(player); n++)
+        player_clear(&player[n]);
+
+    for (n = 0; n < TRACKS; n++) {
+        if (tracks[n].refcount != 0) {
+            printf("track %zu has %u references remaining\n",
+                   n, tracks[n].refcount);
+            r = -1;
+        }
+        free(tracks[n].index->block[0]);
+        free(tracks[n].index);
+    }
+
+    thread_global_clear();
+
+    return r;
+}
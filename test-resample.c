@@ -0,0 +1,447 @@
+/*
+ * Copyright (C) 2012 Mark Hills <mark@pogo.org.uk>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License version 2 for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * version 2 along with this program; if not, write to the Free
+ * Software Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston,
+ * MA 02110-1301, USA.
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "resample.h"
+#include "track.h"
+
+#define RATE 44100
+#define DEVICE_RATE 96000
+#define PERIOD 256
+#define BLOCKS 2
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
+
+static const char *kernels[] = { "scalar", "sse2", "avx2" };
+
+/* Positions (seconds) and pitches to compare, including the start and
+ * end of the track, wholly outside it, and a block boundary */
+
+static const double position[] = {
+    -1.0, -0.01, 0.0, 1.0, 20.0,
+    (double)TRACK_BLOCK_SAMPLES / RATE - 0.002,
+    (double)TRACK_BLOCK_SAMPLES / RATE + 0.0001,
+    (double)BLOCKS * TRACK_BLOCK_SAMPLES / RATE - 0.003,
+    (double)BLOCKS * TRACK_BLOCK_SAMPLES / RATE + 1.0
+};
+
+static const double pitch[] = {
+    0.0, 1.0, 0.5, -1.3, 1.7, 3.9, -8.0
+};
+
+/* Samples at which the audio from a seek is joined to the audio
+ * before it; in the guard of the next block, and at its start */
+
+static const unsigned int joined[] = {
+    TRACK_BLOCK_SAMPLES - TRACK_PPM_RES,
+    TRACK_BLOCK_SAMPLES
+};
+
+/* Volume ramps, including silence */
+
+static const double volume[][2] = {
+    { 0.2, 1.0 }, { 0.0, 0.0 }, { 1.0, 0.0 }
+};
+
+static double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Fill a track with noise, including values at full scale to
+ * exercise the saturation
+ */
+
+static void fill(struct track *tr)
+{
+    unsigned int n, s;
+    signed short *pcm;
+
+    tr->rate = RATE;
+    tr->length = BLOCKS * TRACK_BLOCK_SAMPLES;
+    tr->region = 0;
+    tr->blocks = BLOCKS;
+    tr->index = malloc(sizeof *tr->index + sizeof *tr->index->block * BLOCKS);
+    if (tr->index == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    tr->index->prev = NULL;
+    tr->index->size = BLOCKS;
+
+    srand(0);
+
+    for (n = 0; n < BLOCKS; n++) {
+        struct track_block *b;
+
+        b = malloc(sizeof(struct track_block));
+        if (b == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        tr->index->block[n] = b;
+
+        /* The guard is a copy of the end of the previous block */
+
+        if (n == 0) {
+            memset(b->pcm, 0, sizeof(signed short)
+                   * TRACK_GUARD * TRACK_CHANNELS);
+        } else {
+            memcpy(b->pcm,
+                   track_get_sample(tr, n * TRACK_BLOCK_SAMPLES - TRACK_GUARD),
+                   sizeof(signed short) * TRACK_GUARD * TRACK_CHANNELS);
+        }
+
+        pcm = track_get_sample(tr, n * TRACK_BLOCK_SAMPLES);
+
+        for (s = 0; s < TRACK_BLOCK_SAMPLES * TRACK_CHANNELS; s++) {
+            if (s % 97 == 0)
+                pcm[s] = (s % 2) ? 32767 : -32768;
+            else
+                pcm[s] = rand() % 65536 - 32768;
+        }
+    }
+}
+
+/*
+ * Place the audio of one track into another, from sample 'first' up
+ * to 'last', copying the guard of each block as an import would
+ */
+
+static void place(struct track *tr, struct track *src, unsigned int first,
+                  unsigned int last)
+{
+    unsigned int s;
+
+    for (s = first; s < last; s++) {
+        if (s % TRACK_BLOCK_SAMPLES == 0)
+            track_copy_guard(tr, s / TRACK_BLOCK_SAMPLES);
+
+        memcpy(track_get_sample(tr, s), track_get_sample(src, s),
+               sizeof(signed short) * TRACK_CHANNELS);
+    }
+}
+
+/*
+ * Make a copy of a track in the order that an import which seeks
+ * places the audio; from the seek to the end, then from the start
+ * until it is joined at the given sample
+ */
+
+static void fill_joined(struct track *tr, struct track *src,
+                        unsigned int join)
+{
+    unsigned int n;
+
+    *tr = *src;
+    tr->index = malloc(sizeof *tr->index + sizeof *tr->index->block * BLOCKS);
+    if (tr->index == NULL) {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+
+    tr->index->prev = NULL;
+    tr->index->size = BLOCKS;
+
+    for (n = 0; n < BLOCKS; n++) {
+        struct track_block *b;
+
+        b = malloc(sizeof(struct track_block));
+        if (b == NULL) {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+
+        memset(b->pcm, 0, sizeof(signed short)
+               * TRACK_GUARD * TRACK_CHANNELS);
+        tr->index->block[n] = b;
+    }
+
+    place(tr, src, join, tr->length);
+    place(tr, src, 0, join);
+    track_join_guards(tr, join);
+}
+
+/*
+ * Render using the given kernel, or the reference implementation
+ * if name is NULL, from a known dither state
+ */
+
+static void render(const char *name, signed short *pcm, struct track *tr,
+                   double position, double pitch, const double vol[2])
+{
+    resample_reset_dither();
+
+    if (name == NULL) {
+        resample_cubic_reference(pcm, PERIOD, 1.0 / DEVICE_RATE, tr,
+                                 position, pitch, vol[0], vol[1]);
+        return;
+    }
+
+    if (resample_use_kernel(name) == -1)
+        abort();
+
+    resample_cubic(pcm, PERIOD, 1.0 / DEVICE_RATE, tr, position, pitch,
+                   vol[0], vol[1]);
+}
+
+/*
+ * Check the floating point output against the 16-bit output, which
+ * differs only by the dither and truncation
+ *
+ * Return: 0 if the output agrees, otherwise -1
+ */
+
+static int check_float(int mode, struct track *tr, double position,
+                       double pitch)
+{
+    unsigned s;
+    int c;
+    signed short pcm[PERIOD * TRACK_CHANNELS];
+    float buf[PERIOD * TRACK_CHANNELS], sep[TRACK_CHANNELS][PERIOD],
+        *out[TRACK_CHANNELS];
+
+    /* Quiet enough to stay clear of saturation */
+
+    resample(mode, pcm, PERIOD, 1.0 / DEVICE_RATE, tr, position, pitch,
+             0.2, 0.4);
+
+    out[0] = buf;
+    out[1] = buf + 1;
+    resample_float(mode, out, TRACK_CHANNELS, PERIOD, 1.0 / DEVICE_RATE,
+                   tr, position, pitch, 0.2, 0.4);
+
+    out[0] = sep[0];
+    out[1] = sep[1];
+    resample_float(mode, out, 1, PERIOD, 1.0 / DEVICE_RATE,
+                   tr, position, pitch, 0.2, 0.4);
+
+    for (s = 0; s < PERIOD; s++) {
+        for (c = 0; c < TRACK_CHANNELS; c++) {
+            float f;
+
+            f = buf[s * TRACK_CHANNELS + c];
+
+            if (f != sep[c][s])
+                return -1;
+            if (fabs(f * 32768 - pcm[s * TRACK_CHANNELS + c]) > 2.0)
+                return -1;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Measure the throughput of the given kernel, or the reference
+ * implementation if name is NULL
+ */
+
+static void benchmark(const char *name, struct track *tr)
+{
+    int n;
+    double start, elapsed, p;
+    signed short pcm[PERIOD * TRACK_CHANNELS];
+
+    if (name != NULL && resample_use_kernel(name) == -1)
+        return;
+
+    p = 1.0;
+    start = now();
+
+    for (n = 0; n < 20000; n++) {
+        if (name == NULL) {
+            p += resample_cubic_reference(pcm, PERIOD, 1.0 / DEVICE_RATE,
+                                          tr, p, 1.07, 0.8, 0.8);
+        } else {
+            p += resample_cubic(pcm, PERIOD, 1.0 / DEVICE_RATE, tr, p, 1.07,
+                                0.8, 0.8);
+        }
+    }
+
+    elapsed = now() - start;
+
+    printf("%s: %.2f ns/frame\n", name ? name : "reference",
+           elapsed * 1e9 / (n * PERIOD));
+}
+
+/*
+ * Measure the cost of the band-limited resampler, which depends on
+ * the pitch
+ */
+
+static void benchmark_sinc(struct track *tr, double pitch)
+{
+    int n;
+    double start, elapsed, p;
+    signed short pcm[PERIOD * TRACK_CHANNELS];
+
+    p = 20.0;
+    start = now();
+
+    for (n = 0; n < 2000; n++)
+        p += resample_sinc(pcm, PERIOD, 1.0 / DEVICE_RATE, tr, p, pitch,
+                           0.8, 0.8);
+
+    elapsed = now() - start;
+
+    printf("sinc at pitch %+.1f: %.2f ns/frame, %.1fus per %d frame period\n",
+           pitch, elapsed * 1e9 / (n * PERIOD), elapsed * 1e6 / n, PERIOD);
+}
+
+/*
+ * Compare the resampling kernels, and the fast paths taken for a
+ * whole period, against the reference implementation
+ */
+
+int main(int argc, char *argv[])
+{
+    int r;
+    size_t k, p, q, v;
+    struct track tr;
+
+    resample_init();
+    fill(&tr);
+    r = 0;
+
+    for (k = 0; k < ARRAY_SIZE(kernels); k++) {
+        if (resample_use_kernel(kernels[k]) == -1) {
+            printf("%s: not supported on this CPU\n", kernels[k]);
+            continue;
+        }
+
+        for (p = 0; p < ARRAY_SIZE(position); p++) {
+            for (q = 0; q < ARRAY_SIZE(pitch); q++) {
+                for (v = 0; v < ARRAY_SIZE(volume); v++) {
+                    signed short a[PERIOD * TRACK_CHANNELS],
+                        b[PERIOD * TRACK_CHANNELS];
+
+                    render(NULL, a, &tr, position[p], pitch[q], volume[v]);
+                    render(kernels[k], b, &tr, position[p], pitch[q],
+                           volume[v]);
+
+                    if (memcmp(a, b, sizeof a) != 0) {
+                        printf("%s: mismatch at position %f, pitch %f, "
+                               "volume %f\n", kernels[k], position[p],
+                               pitch[q], volume[v][0]);
+                        r = -1;
+                    }
+                }
+            }
+        }
+
+        if (r == 0)
+            printf("%s: identical to reference\n", kernels[k]);
+    }
+
+    for (k = 0; k < ARRAY_SIZE(kernels); k++) {
+        if (resample_use_kernel(kernels[k]) == -1)
+            continue;
+
+        for (p = 0; p < ARRAY_SIZE(position); p++) {
+            for (q = 0; q < ARRAY_SIZE(pitch); q++) {
+                if (check_float(RESAMPLE_CUBIC, &tr, position[p], pitch[q])
+                    || check_float(RESAMPLE_SINC, &tr, position[p], pitch[q]))
+                {
+                    printf("%s: float output differs at position %f, "
+                           "pitch %f\n", kernels[k], position[p], pitch[q]);
+                    r = -1;
+                }
+            }
+        }
+    }
+
+    /* Runs which cross from a block into the next, around the point
+     * where a seek was joined, use the same audio as before */
+
+    for (p = 0; p < ARRAY_SIZE(joined); p++) {
+        struct track jt;
+        double at[] = {
+            (double)joined[p] / RATE - 0.002,
+            (double)TRACK_BLOCK_SAMPLES / RATE - 0.002,
+            (double)TRACK_BLOCK_SAMPLES / RATE + 0.0001
+        };
+
+        fill_joined(&jt, &tr, joined[p]);
+
+        for (k = 0; k < ARRAY_SIZE(at); k++) {
+            for (q = 0; q < ARRAY_SIZE(pitch); q++) {
+                signed short a[PERIOD * TRACK_CHANNELS],
+                    b[PERIOD * TRACK_CHANNELS];
+
+                resample_reset_dither();
+                resample(RESAMPLE_CUBIC, a, PERIOD, 1.0 / DEVICE_RATE, &tr,
+                         at[k], pitch[q], 0.2, 1.0);
+                resample_reset_dither();
+                resample(RESAMPLE_CUBIC, b, PERIOD, 1.0 / DEVICE_RATE, &jt,
+                         at[k], pitch[q], 0.2, 1.0);
+
+                if (memcmp(a, b, sizeof a) != 0) {
+                    printf("joined at %u: cubic differs at position %f, "
+                           "pitch %f\n", joined[p], at[k], pitch[q]);
+                    r = -1;
+                }
+
+                resample_reset_dither();
+                resample(RESAMPLE_SINC, a, PERIOD, 1.0 / DEVICE_RATE, &tr,
+                         at[k], pitch[q], 0.2, 1.0);
+                resample_reset_dither();
+                resample(RESAMPLE_SINC, b, PERIOD, 1.0 / DEVICE_RATE, &jt,
+                         at[k], pitch[q], 0.2, 1.0);
+
+                if (memcmp(a, b, sizeof a) != 0) {
+                    printf("joined at %u: sinc differs at position %f, "
+                           "pitch %f\n", joined[p], at[k], pitch[q]);
+                    r = -1;
+                }
+            }
+        }
+
+        for (k = 0; k < BLOCKS; k++)
+            free(jt.index->block[k]);
+        free(jt.index);
+    }
+
+    if (r == 0)
+        printf("joined: identical to contiguous\n");
+
+    benchmark(NULL, &tr);
+    for (k = 0; k < ARRAY_SIZE(kernels); k++)
+        benchmark(kernels[k], &tr);
+
+    for (q = 0; q < ARRAY_SIZE(pitch); q++)
+        benchmark_sinc(&tr, pitch[q]);
+
+    for (k = 0; k < BLOCKS; k++)
+        free(tr.index->block[k]);
+    free(tr.index);
+
+    return r;
+}
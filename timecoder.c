@@ -18,10 +18,15 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include "debug.h"
 #include "timecoder.h"
@@ -38,16 +43,36 @@
 
 #define VALID_BITS 24
 
+/* Tolerating errors, the position is searched for once a whole
+ * timecode has been read, allowing for errors in its bits. It must
+ * then be confirmed by the bits which follow, without error; fewer of
+ * them where it agrees with the position reckoned from the pitch */
+
+#define TOLERATE_BITS 2 /* errors in the bits of a timecode, at most 2 */
+#define CONFIRM_BITS 16
+#define CONFIRM_RECKONED_BITS 4
+#define RECKON_SLACK 64 /* in cycles */
+#define SEARCH_EVERY 8 /* in bits; a search costs many lookups */
+
 #define MONITOR_DECAY_EVERY 512 /* in samples */
+#define MONITOR_DECIMATE 2 /* samples per point given to the monitor */
+
+#define SCALE 32768 /* floating point input, relative to 16-bit */
+
+#define STOP_EVERY 65536 /* steps of the LFSR between checks to stop */
+
+/* The lanes of the zero filter, as vectors of the compiler */
+
+typedef float lanes_t
+    __attribute__((vector_size(sizeof(float) * TIMECODER_LANES)));
 
 #define SQ(x) ((x)*(x))
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(*x))
 
 /* Timecode definitions */
 
-#define SWITCH_PHASE 0x1 /* tone phase difference of 270 (not 90) degrees */
-#define SWITCH_PRIMARY 0x2 /* use left channel (not right) as primary */
-#define SWITCH_POLARITY 0x4 /* read bit values in negative (not positive) */
+static pthread_mutex_t builds = PTHREAD_MUTEX_INITIALIZER; /* of tables */
+static bool stopping = false; /* abandon builds of tables */
 
 static struct timecode_def timecodes[] = {
     {
@@ -137,22 +162,12 @@ static struct timecode_def timecodes[] = {
 };
 
 /*
- * Calculate LFSR bit
+ * Calculate LFSR bit; the parity of the tapped bits
  */
 
 static inline bits_t lfsr(bits_t code, bits_t taps)
 {
-    bits_t taken;
-    int xrs;
-
-    taken = code & taps;
-    xrs = 0;
-    while (taken != 0x0) {
-        xrs += taken & 0x1;
-        taken >>= 1;
-    }
-
-    return xrs & 0x1;
+    return __builtin_parity(code & taps);
 }
 
 /*
@@ -196,18 +211,22 @@ static int build_lookup(struct timecode_def *def)
     unsigned int n;
     bits_t current, last;
 
-    if (def->lookup)
-        return 0;
-
     fprintf(stderr, "Building LUT for %d bit %dHz timecode (%s)\n",
             def->bits, def->resolution, def->desc);
 
-    if (lut_init(&def->lut, def->length) == -1)
+    if (lut_init(&def->lut, def->length, def->bits) == -1)
 	return -1;
 
     current = def->seed;
 
     for (n = 0; n < def->length; n++) {
+        if (n % STOP_EVERY == 0
+            && __atomic_load_n(&stopping, __ATOMIC_RELAXED))
+        {
+            lut_clear(&def->lut);
+            return -1;
+        }
+
         /* timecode must not wrap */
         dassert(lut_lookup(&def->lut, current) == (unsigned)-1);
         lut_push(&def->lut, current);
@@ -216,14 +235,130 @@ static int build_lookup(struct timecode_def *def)
         dassert(rev(current, def) == last);
     }
 
-    def->lookup = true;
+    return 0;
+}
+
+/*
+ * Get the directory for saved lookup tables, creating it if asked
+ *
+ * Return: 0 on success, or -1 if there is no directory to use
+ */
+
+static int cache_dir(char *buf, size_t len, bool create)
+{
+    const char *d;
+
+    d = getenv("XDG_CACHE_HOME");
+    if (d != NULL && d[0] != '\0') {
+        snprintf(buf, len, "%s", d);
+    } else {
+        d = getenv("HOME");
+        if (d == NULL)
+            return -1;
+        snprintf(buf, len, "%s/.cache", d);
+    }
+
+    if (create && mkdir(buf, 0777) == -1 && errno != EEXIST)
+        return -1;
+
+    if (strlen(buf) + sizeof "/xwax" > len)
+        return -1;
+    strcat(buf, "/xwax");
+
+    if (create && mkdir(buf, 0777) == -1 && errno != EEXIST) {
+        perror("mkdir");
+        return -1;
+    }
 
     return 0;
 }
 
+/*
+ * Get the pathname of the saved lookup table for a timecode; any
+ * change to the sequence of timecodes gives a different file
+ *
+ * Return: 0 on success, otherwise -1
+ */
+
+static int lut_pathname(char *buf, size_t len, struct timecode_def *def,
+                        bool create)
+{
+    char dir[PATH_MAX];
+
+    if (cache_dir(dir, sizeof dir, create) == -1)
+        return -1;
+
+    if (snprintf(buf, len, "%s/lut-%d-%x-%x-%u", dir, def->bits,
+                 def->seed, def->taps, def->length) >= len)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Make the lookup table for a timecode available; from a saved copy
+ * if there is one, otherwise building (and saving) it
+ */
+
+static void* build(void *arg)
+{
+    char pathname[PATH_MAX];
+    struct timecode_def *def = arg;
+
+    if (lut_pathname(pathname, sizeof pathname, def, false) == 0
+        && lut_map(&def->lut, pathname, def->length, def->bits) == 0)
+    {
+        goto ready;
+    }
+
+    if (build_lookup(def) == -1) {
+        if (!__atomic_load_n(&stopping, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "Lookup table for %s could not be made; "
+                    "position is not available.\n", def->name);
+            __atomic_store_n(&def->failed, true, __ATOMIC_RELAXED);
+        }
+        return NULL;
+    }
+
+    if (lut_pathname(pathname, sizeof pathname, def, true) == 0)
+        (void)lut_save(&def->lut, pathname);
+
+ ready:
+    __atomic_store_n(&def->lookup, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Begin making the lookup table for a timecode available, in the
+ * background, if this has not been done already
+ *
+ * Each table has its own thread, so tables are built in parallel.
+ */
+
+static void start_build(struct timecode_def *def)
+{
+    pthread_mutex_lock(&builds);
+
+    if (!def->started && !def->failed) {
+        if (pthread_create(&def->ph, NULL, build, def) != 0) {
+            perror("pthread_create");
+            __atomic_store_n(&def->failed, true, __ATOMIC_RELAXED);
+        } else {
+            def->started = true;
+        }
+    }
+
+    pthread_mutex_unlock(&builds);
+}
+
 /*
  * Find a timecode definition by name
  *
+ * Its lookup table is made available in the background; until then
+ * it can be used for pitch but not position.
+ *
  * Return: pointer to timecode definition, or NULL if not found
  */
 
@@ -244,23 +379,27 @@ struct timecode_def* timecoder_find_definition(const char *name)
             return NULL;
     }
 
-    if (build_lookup(def) == -1)
-        return NULL;
+    start_build(def);
 
     return def;
 }
 
 /*
- * Free the timecoder lookup tables when they are no longer needed
+ * Free the timecoder lookup tables when they are no longer needed,
+ * abandoning any which are still being built
  */
 
 void timecoder_free_lookup(void) {
     struct timecode_def *def, *end;
 
+    __atomic_store_n(&stopping, true, __ATOMIC_RELAXED);
+
     def = &timecodes[0];
     end = def + ARRAY_SIZE(timecodes);
 
     while (def < end) {
+        if (def->started && pthread_join(def->ph, NULL) != 0)
+            abort();
         if (def->lookup)
             lut_clear(&def->lut);
         def++;
@@ -274,7 +413,50 @@ void timecoder_free_lookup(void) {
 static void init_channel(struct timecoder_channel *ch)
 {
     ch->positive = false;
-    ch->zero = 0;
+    ch->zero = 0.0;
+}
+
+/*
+ * Prepare the zero filter to run over a group of samples at once
+ */
+
+static void init_zero_filter(struct timecoder *tc)
+{
+    int i, j;
+    float a, c, k;
+
+    a = tc->zero_alpha;
+    c = 1.0 - a;
+
+    k = 1.0;
+    for (j = 0; j < TIMECODER_LANES; j++) {
+        tc->zero_decay[j] = k;
+        k *= c;
+    }
+
+    for (i = 0; i < TIMECODER_LANES - 1; i++) {
+        k = a;
+        for (j = 0; j < TIMECODER_LANES; j++) {
+            if (j <= i) {
+                tc->zero_kernel[i][j] = 0.0;
+            } else {
+                tc->zero_kernel[i][j] = k;
+                k *= c;
+            }
+        }
+    }
+}
+
+/*
+ * Forget any position found by the search
+ */
+
+static void reset_search(struct timecoder *tc)
+{
+    tc->locked = false;
+    tc->reckoning = false;
+    tc->filled = 0;
+    tc->ncandidates = 0;
 }
 
 /*
@@ -286,12 +468,13 @@ static void init_channel(struct timecoder_channel *ch)
 void timecoder_init(struct timecoder *tc, struct timecode_def *def,
                     double speed, unsigned int sample_rate)
 {
+    unsigned int n;
+
     assert(def != NULL);
 
     /* A definition contains a lookup table which can be shared
-     * across multiple timecoders */
+     * across multiple timecoders; it may not be ready yet */
 
-    assert(def->lookup);
     tc->def = def;
     tc->speed = speed;
 
@@ -303,13 +486,37 @@ void timecoder_init(struct timecoder *tc, struct timecode_def *def,
     init_channel(&tc->secondary);
     pitch_init(&tc->pitch, tc->dt);
 
+    init_zero_filter(tc);
+    for (n = 0; n <= TIMECODER_BLOCK; n++)
+        pitch_run_init(&tc->idle[n], &tc->pitch, n);
+
     tc->ref_level = 32768.0;
     tc->bitstream = 0;
     tc->timecode = 0;
     tc->valid_counter = 0;
     tc->timecode_ticker = 0;
 
+    tc->tolerant = false;
+    reset_search(tc);
+
     tc->mon = NULL;
+    tc->points = NULL;
+}
+
+/*
+ * Set whether the decoder tolerates errors in the bits of the
+ * timecode
+ *
+ * A tolerant decoder finds the position sooner after the needle is
+ * dropped or the record is spun back, and keeps it through bits which
+ * are misread, as on worn vinyl. For this, it searches the lookup
+ * table for timecodes a few bits different from those read.
+ */
+
+void timecoder_set_tolerant(struct timecoder *tc, bool tolerant)
+{
+    tc->tolerant = tolerant;
+    reset_search(tc);
 }
 
 /*
@@ -332,6 +539,8 @@ void timecoder_clear(struct timecoder *tc)
 
 int timecoder_monitor_init(struct timecoder *tc, int size)
 {
+    struct timecoder_point *points;
+
     assert(tc->mon == NULL);
     tc->mon_size = size;
     tc->mon = malloc(SQ(tc->mon_size));
@@ -341,74 +550,481 @@ int timecoder_monitor_init(struct timecoder *tc, int size)
     }
     memset(tc->mon, 0, SQ(tc->mon_size));
     tc->mon_counter = 0;
+
+    points = malloc(sizeof(*points) * TIMECODER_POINTS);
+    if (points == NULL) {
+        perror("malloc");
+        free(tc->mon);
+        tc->mon = NULL;
+        return -1;
+    }
+
+    /* The decoder may already be running */
+
+    tc->points_head = 0;
+    tc->points_tail = 0;
+    tc->points_phase = 0;
+    __atomic_store_n(&tc->points, points, __ATOMIC_RELEASE);
+
     return 0;
 }
 
 /*
  * Clear the monitor on the given timecoder
+ *
+ * Pre: the timecoder is not being given audio
  */
 
 void timecoder_monitor_clear(struct timecoder *tc)
 {
+    struct timecoder_point *points;
+
     assert(tc->mon != NULL);
+
+    points = tc->points;
+    __atomic_store_n(&tc->points, NULL, __ATOMIC_RELEASE);
+    free(points);
+
     free(tc->mon);
     tc->mon = NULL;
 }
 
 /*
- * Update channel information with axis-crossings
+ * Plot the points given by the decoder since the last update, and
+ * decay those already in the monitor
+ *
+ * This is the work of the monitor which touches the whole x-y array,
+ * so it is done here by the interface rather than in the decoder.
+ */
+
+void timecoder_monitor_update(struct timecoder *tc)
+{
+    unsigned int head, tail;
+    int size, px, py, p;
+    float half;
+    unsigned char *mon;
+    const struct timecoder_point *pt;
+
+    mon = tc->mon;
+    size = tc->mon_size;
+    half = size / 2;
+
+    head = __atomic_load_n(&tc->points_head, __ATOMIC_ACQUIRE);
+
+    for (tail = tc->points_tail; tail != head; tail++) {
+
+        /* Decay the pixels already in the monitor */
+
+        tc->mon_counter += MONITOR_DECIMATE;
+        if (tc->mon_counter >= MONITOR_DECAY_EVERY) {
+            tc->mon_counter -= MONITOR_DECAY_EVERY;
+            for (p = 0; p < SQ(size); p++)
+                mon[p] = mon[p] * 7 / 8;
+        }
+
+        pt = &tc->points[tail % TIMECODER_POINTS];
+        px = half + pt->x * half;
+        py = half + pt->y * half;
+
+        /* Set the pixel value to white */
+
+        if (px > 0 && px < size && py > 0 && py < size)
+            mon[py * size + px] = 0xff;
+    }
+
+    __atomic_store_n(&tc->points_tail, tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return: bitmask of the given flags, each of which is 0 or 1
+ *
+ * Pre: n is a multiple of eight
+ */
+
+static inline uint64_t pack_flags(const unsigned char *f, size_t n)
+{
+    size_t s;
+    uint64_t r, b;
+
+    r = 0;
+
+    for (s = 0; s < n; s += 8) {
+        memcpy(&b, &f[s], sizeof b);
+        r |= (b * 0x0102040810204080ULL) >> 56 << s; /* byte k to bit k */
+    }
+
+    return r;
+}
+
+/*
+ * Run the zero (rumble) filter over a block of samples of both
+ * channels
+ *
+ * The filter is linear, so its value before each sample of a group is
+ * a function of its value before the group and the samples of the
+ * group. This is computed for all lanes of the group together, and
+ * only a short calculation carries on from one group to the next.
+ *
+ * Pre: samples are padded to a whole number of groups
+ * Post: pz[s] and sz[s] are the values of the filter before sample s
+ * Post: pz and sz are padded to a whole number of bytes of flags
+ */
+
+static void filter_zero(struct timecoder *tc,
+                        const float *primary, const float *secondary,
+                        float *pz, float *sz, size_t n)
+{
+    const int last = TIMECODER_LANES - 1;
+    size_t g;
+    int i;
+    float alpha, c, cn, p, q;
+    lanes_t decay, kernel[TIMECODER_LANES - 1], kp, kq, v;
+
+    memcpy(&decay, tc->zero_decay, sizeof decay);
+    for (i = 0; i < last; i++)
+        memcpy(&kernel[i], tc->zero_kernel[i], sizeof kernel[i]);
+
+    alpha = tc->zero_alpha;
+    c = 1.0 - alpha;
+    cn = decay[last] * c; /* over a whole group */
+
+    p = tc->primary.zero;
+    q = tc->secondary.zero;
+
+    for (g = 0; g < n; g += TIMECODER_LANES) {
+        kp = kernel[0] * primary[g];
+        kq = kernel[0] * secondary[g];
+        for (i = 1; i < last; i++) {
+            kp += kernel[i] * primary[g + i];
+            kq += kernel[i] * secondary[g + i];
+        }
+
+        v = kp + decay * p;
+        memcpy(&pz[g], &v, sizeof v);
+        v = kq + decay * q;
+        memcpy(&sz[g], &v, sizeof v);
+
+        p = cn * p + (c * kp[last] + alpha * primary[g + last]);
+        q = cn * q + (c * kq[last] + alpha * secondary[g + last]);
+    }
+
+    /* The padding is compared as whole bytes of flags, so give it a
+     * value */
+
+    for (; g % 8 != 0; g++) {
+        pz[g] = 0.0;
+        sz[g] = 0.0;
+    }
+
+    tc->primary.zero = pz[n - 1] + alpha * (primary[n - 1] - pz[n - 1]);
+    tc->secondary.zero = sz[n - 1] + alpha * (secondary[n - 1] - sz[n - 1]);
+}
+
+/*
+ * Compare a block of samples against the thresholds either side of
+ * zero
+ *
+ * Pre: samples are padded to a whole number of bytes of flags
+ * Post: bit s of *above (or *below) is set if sample s is beyond the
+ * threshold above (or below) zero
+ */
+
+static void compare(const float *x, const float *zero, size_t n,
+                    uint64_t *above, uint64_t *below)
+{
+    size_t s, len;
+    unsigned char a[TIMECODER_BLOCK], b[TIMECODER_BLOCK];
+
+    len = (n + 7) / 8 * 8;
+
+    for (s = 0; s < len; s++) {
+        a[s] = x[s] > zero[s] + ZERO_THRESHOLD;
+        b[s] = x[s] < zero[s] - ZERO_THRESHOLD;
+    }
+
+    *above = pack_flags(a, len);
+    *below = pack_flags(b, len);
+
+    /* Not the samples padding the block */
+
+    if (n < 64) {
+        *above &= ((uint64_t)1 << n) - 1;
+        *below &= ((uint64_t)1 << n) - 1;
+    }
+}
+
+/*
+ * Find where a channel crosses zero in a block of samples
+ *
+ * The wave has crossed where it moves beyond the threshold on the
+ * opposite side of zero to where it was.
+ *
+ * Return: bitmask of the samples at which the channel crossed zero
+ * Post: ch->positive is the state after the block
+ */
+
+static uint64_t find_crossings(struct timecoder_channel *ch,
+                               uint64_t above, uint64_t below)
+{
+    unsigned int b;
+    uint64_t next, r;
+
+    r = 0;
+    next = ch->positive ? below : above;
+
+    while (next != 0) {
+        b = __builtin_ctzll(next);
+        r |= (uint64_t)1 << b;
+        ch->positive = !ch->positive;
+        next = (ch->positive ? below : above) & (~(uint64_t)0 << b << 1);
+    }
+
+    return r;
+}
+
+/*
+ * Give a block of sample values to the x-y monitor
+ *
+ * Every few samples becomes a point in the ring, to be plotted later
+ * by the interface. If the ring is full the point is lost.
  */
 
-static void detect_zero_crossing(struct timecoder_channel *ch,
-                                 signed int v, double alpha)
+static void update_monitor(struct timecoder *tc, const float *x,
+                           const float *y, size_t n)
 {
-    ch->crossing_ticker++;
+    size_t s;
+    unsigned int head, tail;
+    float scale;
+    struct timecoder_point *points, *pt;
+
+    points = __atomic_load_n(&tc->points, __ATOMIC_ACQUIRE);
+    if (points == NULL)
+        return;
+
+    head = tc->points_head;
+    tail = __atomic_load_n(&tc->points_tail, __ATOMIC_ACQUIRE);
+    scale = 1.0 / tc->ref_level / 2;
+
+    for (s = tc->points_phase; s < n; s += MONITOR_DECIMATE) {
+        if (head - tail == TIMECODER_POINTS)
+            continue;
 
-    ch->swapped = false;
-    if (v > ch->zero + ZERO_THRESHOLD && !ch->positive) {
-        ch->swapped = true;
-        ch->positive = true;
-        ch->crossing_ticker = 0;
-    } else if (v < ch->zero - ZERO_THRESHOLD && ch->positive) {
-        ch->swapped = true;
-        ch->positive = false;
-        ch->crossing_ticker = 0;
+        pt = &points[head % TIMECODER_POINTS];
+        pt->x = x[s] * scale;
+        pt->y = y[s] * scale;
+        head++;
     }
 
-    ch->zero += alpha * (v - ch->zero);
+    tc->points_phase = s - n;
+    __atomic_store_n(&tc->points_head, head, __ATOMIC_RELEASE);
 }
 
 /*
- * Plot the given sample value in the x-y monitor
+ * Return: true if the given position is near to the one reckoned from
+ * the pitch, otherwise false
  */
 
-static void update_monitor(struct timecoder *tc, signed int x, signed int y)
+static bool is_reckoned(struct timecoder *tc, int position)
 {
-    int px, py, p;
-    double v, w;
+    return tc->reckoning && fabs(position - tc->reckon) <= RECKON_SLACK;
+}
+
+/*
+ * Consider the position of the given code as a candidate, if it is a
+ * timecode at all
+ *
+ * Codes which are two bits from the bitstream are so many that most
+ * are timecodes, so those are only considered near to the position
+ * reckoned from the pitch.
+ */
 
-    if (!tc->mon)
+static void add_candidate(struct timecoder *tc, bits_t code,
+                          unsigned int errors)
+{
+    unsigned int r;
+    struct timecoder_candidate *c;
+
+    if (tc->ncandidates == TIMECODER_CANDIDATES)
+        return;
+
+    r = lut_lookup(&tc->def->lut, code);
+    if (r == (unsigned int)-1)
+        return;
+
+    if (errors > 1 && !is_reckoned(tc, r))
         return;
 
-    /* Decay the pixels already in the montior */
+    c = &tc->candidate[tc->ncandidates++];
+    c->timecode = code;
+    c->position = r;
+    c->errors = errors;
+    c->agreed = 0;
+}
 
-    if (++tc->mon_counter % MONITOR_DECAY_EVERY == 0) {
-        for (p = 0; p < SQ(tc->mon_size); p++) {
-            if (tc->mon[p])
-                tc->mon[p] = tc->mon[p] * 7 / 8;
+/*
+ * Search the lookup table for the timecodes within a few bits of the
+ * bitstream, the closest first
+ *
+ * Pre: the lookup table is ready
+ */
+
+static void search(struct timecoder *tc)
+{
+    int i, j;
+    bits_t x;
+
+    x = tc->bitstream;
+    tc->ncandidates = 0;
+
+    add_candidate(tc, x, 0);
+
+    for (i = 0; i < tc->def->bits && TOLERATE_BITS >= 1; i++)
+        add_candidate(tc, x ^ (1 << i), 1);
+
+    if (!tc->reckoning)
+        return;
+
+    for (i = 0; i < tc->def->bits && TOLERATE_BITS >= 2; i++) {
+        for (j = i + 1; j < tc->def->bits; j++)
+            add_candidate(tc, x ^ (1 << i) ^ (1 << j), 2);
+    }
+}
+
+/*
+ * Move each candidate on by the bit just read, and remove those which
+ * did not expect it
+ */
+
+static void follow_candidates(struct timecoder *tc, bits_t b)
+{
+    unsigned int n;
+    bits_t e;
+    struct timecoder_candidate *c;
+
+    n = 0;
+
+    while (n < tc->ncandidates) {
+        c = &tc->candidate[n];
+
+        if (tc->forwards) {
+            c->timecode = fwd(c->timecode, tc->def);
+            c->position++;
+            e = c->timecode >> (tc->def->bits - 1);
+        } else {
+            c->timecode = rev(c->timecode, tc->def);
+            c->position--;
+            e = c->timecode & 0x1;
         }
+
+        if (e == b) {
+            c->agreed++;
+            n++;
+        } else {
+            *c = tc->candidate[--tc->ncandidates];
+        }
+    }
+}
+
+/*
+ * Take a candidate as the position if it is the only one left, or the
+ * only one near to the position reckoned from the pitch
+ */
+
+static void confirm_candidates(struct timecoder *tc)
+{
+    unsigned int n, near;
+    struct timecoder_candidate *c, *found;
+
+    found = NULL;
+
+    /* Codes a bit apart can give the same bits for a while, so where
+     * there were errors the candidate must outlast them */
+
+    if (tc->ncandidates == 1) {
+        c = &tc->candidate[0];
+        if (c->errors == 0 && c->agreed >= CONFIRM_BITS)
+            found = c;
+        if (c->errors > 0 && c->agreed >= tc->def->bits)
+            found = c;
+    }
+
+    /* Near to the reckoned position, a candidate two bits from what
+     * was read is still too likely to be there by chance to be taken
+     * sooner */
+
+    near = 0;
+    for (n = 0; n < tc->ncandidates; n++) {
+        c = &tc->candidate[n];
+        if (!is_reckoned(tc, c->position))
+            continue;
+
+        near++;
+        if (c->errors > 1 && c->agreed >= CONFIRM_BITS)
+            found = c;
+        if (c->errors <= 1 && c->agreed >= CONFIRM_RECKONED_BITS)
+            found = c;
+    }
+
+    if (near > 1)
+        found = NULL;
+
+    if (found == NULL)
+        return;
+
+    tc->timecode = found->timecode;
+    tc->locked = true;
+    tc->reckoning = false;
+    tc->ncandidates = 0;
+}
+
+/*
+ * Track the position, tolerating errors in the bits read
+ *
+ * Once found, the position is kept as long as the bitstream is within
+ * a few bits of the expected timecode. Otherwise, the search begins
+ * again once a whole timecode has been read.
+ */
+
+static void tolerate(struct timecoder *tc, bits_t b)
+{
+    int bits;
+    bits_t diff;
+
+    bits = tc->def->bits;
+
+    if (tc->locked) {
+        diff = tc->timecode ^ tc->bitstream;
+        if (__builtin_popcount(diff) <= TOLERATE_BITS)
+            return;
+
+        /* The needle has been moved, or too many bits are misread;
+         * the bits since the oldest error are no longer the timecode
+         * expected, so count them towards the next search */
+
+        tc->locked = false;
+        tc->reckon = lut_lookup(&tc->def->lut, tc->timecode);
+        tc->reckoning = true;
+
+        if (tc->forwards)
+            tc->filled = bits - __builtin_ctz(diff);
+        else
+            tc->filled = sizeof(diff) * CHAR_BIT - __builtin_clz(diff);
+        return;
     }
 
-    v = (double)x / tc->ref_level / 2;
-    w = (double)y / tc->ref_level / 2;
+    follow_candidates(tc, b);
 
-    px = tc->mon_size / 2 + (v * tc->mon_size / 2);
-    py = tc->mon_size / 2 + (w * tc->mon_size / 2);
+    if (tc->filled < bits)
+        tc->filled++;
 
-    /* Set the pixel value to white */
+    if (tc->ncandidates == 0 && tc->filled == bits
+        && timecoder_has_lookup(tc->def))
+    {
+        search(tc);
+        tc->filled = bits - SEARCH_EVERY;
+    }
 
-    if (px > 0 && px < tc->mon_size && py > 0 && py < tc->mon_size)
-        tc->mon[py * tc->mon_size + px] = 0xff;
+    confirm_candidates(tc);
 }
 
 /*
@@ -440,7 +1056,9 @@ static void process_bitstream(struct timecoder *tc, signed int m)
 	tc->bitstream = ((tc->bitstream << 1) & mask) + b;
     }
 
-    if (tc->timecode == tc->bitstream)
+    if (tc->tolerant)
+        tolerate(tc, b);
+    else if (tc->timecode == tc->bitstream)
 	tc->valid_counter++;
     else {
 	tc->timecode = tc->bitstream;
@@ -456,75 +1074,116 @@ static void process_bitstream(struct timecoder *tc, signed int m)
     tc->ref_level = (tc->ref_level * (REF_PEAKS_AVG - 1) + m) / REF_PEAKS_AVG;
 
     debug("%+6d zero, %+6d (ref %+6d)\t= %d%c (%5d)",
-          tc->primary.zero,
+          (int)tc->primary.zero,
           m, tc->ref_level,
 	  b, tc->valid_counter == 0 ? 'x' : ' ',
 	  tc->valid_counter);
 }
 
 /*
- * Process a single sample from the incoming audio
+ * Process a block of samples from the incoming audio
+ *
+ * The filters and the detection of zero crossings run over the whole
+ * block; the rest of the decoder runs only at the samples where a
+ * channel crosses zero, a few times in each cycle of the wave.
+ *
+ * The flags are those of the timecode definition, given separately
+ * so that they are a constant wherever this is inlined.
+ *
+ * Pre: n <= TIMECODER_BLOCK, and the samples are padded to a whole
+ * number of groups for the zero filter
  */
 
-static void process_sample(struct timecoder *tc,
-			   signed int primary, signed int secondary)
+static inline void process_block(struct timecoder *tc, const float *primary,
+                                 const float *secondary, size_t n,
+                                 const int flags)
 {
-    signed int m; /* pcm sample, sum of two shorts */
+    int s, last, last_bit;
+    bool pp, sp;
+    uint64_t pa, pb, sa, sb, pc, sc, events, b;
+    float pz[TIMECODER_BLOCK], sz[TIMECODER_BLOCK];
+
+    filter_zero(tc, primary, secondary, pz, sz, n);
+    compare(primary, pz, n, &pa, &pb);
+    compare(secondary, sz, n, &sa, &sb);
 
-    detect_zero_crossing(&tc->primary, primary, tc->zero_alpha);
-    detect_zero_crossing(&tc->secondary, secondary, tc->zero_alpha);
+    pp = tc->primary.positive;
+    sp = tc->secondary.positive;
 
-    m = abs(primary - tc->primary.zero);
+    pc = find_crossings(&tc->primary, pa, pb);
+    sc = find_crossings(&tc->secondary, sa, sb);
 
-    /* If an axis has been crossed, use the direction of the crossing
-     * to work out the direction of the vinyl */
+    last = -1; /* sample of the last movement given to the pitch filter */
+    last_bit = -1;
 
-    if (tc->primary.swapped || tc->secondary.swapped) {
+    for (events = pc | sc; events != 0; events &= events - 1) {
         bool forwards;
+        double dx;
+
+        s = __builtin_ctzll(events);
+        b = (uint64_t)1 << s;
+
+        if (pc & b)
+            pp = !pp;
+        if (sc & b)
+            sp = !sp;
+
+        /* Use the direction of the crossing to work out the direction
+         * of the vinyl */
 
-        if (tc->primary.swapped) {
-            forwards = (tc->primary.positive != tc->secondary.positive);
+        if (pc & b) {
+            forwards = (pp != sp);
         } else {
-            forwards = (tc->primary.positive == tc->secondary.positive);
+            forwards = (pp == sp);
         }
 
-        if (tc->def->flags & SWITCH_PHASE)
+        if (flags & SWITCH_PHASE)
 	    forwards = !forwards;
 
         if (forwards != tc->forwards) { /* direction has changed */
             tc->forwards = forwards;
             tc->valid_counter = 0;
         }
-    }
 
-    /* If any axis has been crossed, register movement using the pitch
-     * counters */
+        /* Register movement using the pitch counters, after the
+         * samples since the last crossing, which had none */
 
-    if (!tc->primary.swapped && !tc->secondary.swapped)
-	pitch_dt_observation(&tc->pitch, 0.0);
-    else {
-	double dx;
+        pitch_dt_run(&tc->pitch, &tc->idle[s - last - 1]);
 
 	dx = 1.0 / tc->def->resolution / 4;
 	if (!tc->forwards)
 	    dx = -dx;
 	pitch_dt_observation(&tc->pitch, dx);
+
+        last = s;
+
+        /* If we have crossed the primary channel in the right
+         * polarity, it's time to read off a timecode 0 or 1 value */
+
+        if ((sc & b) && pp == ((flags & SWITCH_POLARITY) == 0)) {
+            float z;
+
+            z = pz[s] + tc->zero_alpha * (primary[s] - pz[s]);
+            process_bitstream(tc, abs((int)(primary[s] - z)));
+            last_bit = s;
+        }
     }
 
-    /* If we have crossed the primary channel in the right polarity,
-     * it's time to read off a timecode 0 or 1 value */
+    pitch_dt_run(&tc->pitch, &tc->idle[n - last - 1]);
 
-    if (tc->secondary.swapped &&
-       tc->primary.positive == ((tc->def->flags & SWITCH_POLARITY) == 0))
-    {
-	process_bitstream(tc, m);
+    if (tc->reckoning) {
+        tc->reckon += pitch_current(&tc->pitch)
+            * tc->def->resolution * tc->dt * n;
     }
 
-    tc->timecode_ticker++;
+    if (last_bit == -1)
+        tc->timecode_ticker += n;
+    else
+        tc->timecode_ticker = n - last_bit;
 }
 
 /*
- * Cycle to the next timecode definition which has a valid lookup
+ * Cycle to the next timecode definition
  *
  * Return: pointer to timecode definition
  */
@@ -533,52 +1192,172 @@ static struct timecode_def* next_definition(struct timecode_def *def)
 {
     assert(def != NULL);
 
-    do {
-        def++;
+    def++;
 
-        if (def > timecodes + ARRAY_SIZE(timecodes))
-            def = timecodes;
-
-    } while (!def->lookup);
+    if (def == timecodes + ARRAY_SIZE(timecodes))
+        def = timecodes;
 
     return def;
 }
 
 /*
- * Change the timecode definition to the next available
+ * Change the timecode definition to the next available, beginning
+ * to build its lookup table if need be
  */
 
 void timecoder_cycle_definition(struct timecoder *tc)
 {
     tc->def = next_definition(tc->def);
+    start_build(tc->def);
     tc->valid_counter = 0;
     tc->timecode_ticker = 0;
+    reset_search(tc);
 }
 
 /*
- * Submit and decode a block of PCM audio data to the timecode decoder
+ * Decode a block of stereo samples, given as separate channels
+ *
+ * Pre: n <= TIMECODER_BLOCK
  */
 
-void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
+static inline void decode(struct timecoder *tc, float *l, float *r, size_t n,
+                          const int flags)
 {
-    while (npcm--) {
-	signed int primary, secondary;
+    size_t s;
 
-        if (tc->def->flags & SWITCH_PRIMARY) {
-            primary = pcm[0];
-            secondary = pcm[1];
-        } else {
-            primary = pcm[1];
-            secondary = pcm[0];
+    /* Pad to whole groups of lanes, and bytes of flags */
+
+    for (s = n; s % TIMECODER_LANES != 0 || s % 8 != 0; s++) {
+        l[s] = 0.0;
+        r[s] = 0.0;
+    }
+
+    if (flags & SWITCH_PRIMARY)
+        process_block(tc, l, r, n, flags);
+    else
+        process_block(tc, r, l, n, flags);
+
+    update_monitor(tc, l, r, n);
+}
+
+static inline void submit(struct timecoder *tc, signed short *pcm,
+                          size_t npcm, const int flags)
+{
+    size_t n, s;
+    float l[TIMECODER_BLOCK], r[TIMECODER_BLOCK];
+
+    while (npcm > 0) {
+        n = npcm < TIMECODER_BLOCK ? npcm : TIMECODER_BLOCK;
+
+        for (s = 0; s < n; s++) {
+            l[s] = pcm[s * TIMECODER_CHANNELS];
+            r[s] = pcm[s * TIMECODER_CHANNELS + 1];
         }
 
-	process_sample(tc, primary, secondary);
+        decode(tc, l, r, n, flags);
 
-        update_monitor(tc, pcm[0], pcm[1]);
-        pcm += TIMECODER_CHANNELS;
+        pcm += n * TIMECODER_CHANNELS;
+        npcm -= n;
     }
 }
 
+static inline void submit_float(struct timecoder *tc, const float *in[],
+                                unsigned stride, size_t npcm,
+                                const int flags)
+{
+    size_t done, n, s;
+    float l[TIMECODER_BLOCK], r[TIMECODER_BLOCK];
+
+    for (done = 0; done < npcm; done += n) {
+        n = npcm - done < TIMECODER_BLOCK ? npcm - done : TIMECODER_BLOCK;
+
+        for (s = 0; s < n; s++) {
+            l[s] = in[0][(done + s) * stride] * SCALE;
+            r[s] = in[1][(done + s) * stride] * SCALE;
+        }
+
+        decode(tc, l, r, n, flags);
+    }
+}
+
+/*
+ * Decoders for each combination of flags, so that the flags are not
+ * tested on every sample
+ */
+
+#define DECODERS(f) \
+    static void submit_##f(struct timecoder *tc, \
+                           signed short *pcm, size_t npcm) \
+    { \
+        submit(tc, pcm, npcm, f); \
+    } \
+    \
+    static void submit_float_##f(struct timecoder *tc, const float *in[], \
+                                 unsigned stride, size_t npcm) \
+    { \
+        submit_float(tc, in, stride, npcm, f); \
+    }
+
+DECODERS(0)
+DECODERS(1)
+DECODERS(2)
+DECODERS(3)
+DECODERS(4)
+DECODERS(5)
+DECODERS(6)
+DECODERS(7)
+
+static void (*const decoders[])(struct timecoder*, signed short*, size_t) = {
+    submit_0, submit_1, submit_2, submit_3,
+    submit_4, submit_5, submit_6, submit_7
+};
+
+static void (*const float_decoders[])(struct timecoder*, const float*[],
+                                      unsigned, size_t) = {
+    submit_float_0, submit_float_1, submit_float_2, submit_float_3,
+    submit_float_4, submit_float_5, submit_float_6, submit_float_7
+};
+
+/*
+ * Submit and decode a block of PCM audio data to the timecode decoder
+ */
+
+void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm)
+{
+    dassert(tc->def->flags < ARRAY_SIZE(decoders));
+    decoders[tc->def->flags](tc, pcm, npcm);
+}
+
+/*
+ * Submit and decode a block of floating point audio, where full scale
+ * is 1.0, to the timecode decoder
+ *
+ * The decoder works at the same scale as 16-bit audio, but values are
+ * not truncated to that range; so there is no need to saturate.
+ *
+ * Pre: channel c of sample s is at in[c][s * stride]
+ */
+
+void timecoder_submit_float(struct timecoder *tc, const float *in[],
+                            unsigned stride, size_t npcm)
+{
+    dassert(tc->def->flags < ARRAY_SIZE(float_decoders));
+    float_decoders[tc->def->flags](tc, in, stride, npcm);
+}
+
+/*
+ * Return: true if the timecode is known to be the position of the
+ * needle, otherwise false
+ */
+
+static bool is_locked(struct timecoder *tc)
+{
+    if (tc->tolerant)
+        return tc->locked;
+    else
+        return tc->valid_counter > VALID_BITS;
+}
+
 /*
  * Get the last-known position of the timecode
  *
@@ -595,8 +1374,8 @@ signed int timecoder_get_position(struct timecoder *tc, double *when)
 {
     signed int r;
 
-    if (tc->valid_counter > VALID_BITS) {
-        r = lut_lookup(&tc->def->lut, tc->bitstream);
+    if (is_locked(tc) && timecoder_has_lookup(tc->def)) {
+        r = lut_lookup(&tc->def->lut, tc->timecode);
 
         if (r >= 0) {
             if (when)
@@ -20,6 +20,7 @@
 #ifndef TIMECODER_H
 #define TIMECODER_H
 
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "lut.h"
@@ -27,8 +28,30 @@
 
 #define TIMECODER_CHANNELS 2
 
+/* Audio is decoded in blocks of up to this many samples, the zero
+ * filter in groups of this many lanes */
+
+#define TIMECODER_BLOCK 64
+#define TIMECODER_LANES 4
+
+/* Points of the x-y monitor which can be waiting to be plotted; a
+ * power of two */
+
+#define TIMECODER_POINTS 4096
+
+/* Positions which can be considered at once, when searching the
+ * timecode tolerating errors in its bits */
+
+#define TIMECODER_CANDIDATES 256
+
 typedef unsigned int bits_t;
 
+/* Flags of a timecode definition */
+
+#define SWITCH_PHASE 0x1 /* tone phase difference of 270 (not 90) degrees */
+#define SWITCH_PRIMARY 0x2 /* use left channel (not right) as primary */
+#define SWITCH_POLARITY 0x4 /* read bit values in negative (not positive) */
+
 struct timecode_def {
     char *name, *desc;
     int bits, /* number of bits in string */
@@ -38,15 +61,33 @@ struct timecode_def {
         taps; /* central LFSR taps, excluding end taps */
     unsigned int length, /* in cycles */
         safe; /* last 'safe' timecode number (for auto disconnect) */
-    bool lookup; /* true if lut has been generated */
+    bool lookup, /* true once lut is ready; published atomically */
+        failed; /* lut could not be made; published atomically */
     struct lut lut;
+
+    bool started; /* lut is being loaded or built by the thread */
+    pthread_t ph;
 };
 
 struct timecoder_channel {
-    bool positive, /* wave is in positive part of cycle */
-	swapped; /* wave recently swapped polarity */
-    signed int zero;
-    unsigned int crossing_ticker; /* samples since we last crossed zero */
+    bool positive; /* wave is in positive part of cycle */
+    float zero;
+};
+
+/* A position the needle could be at, following the bits read since
+ * it was found in the lookup table */
+
+struct timecoder_candidate {
+    bits_t timecode; /* expected bitstream */
+    int position;
+    unsigned int errors, /* bits not as expected when it was found */
+        agreed; /* bits as expected since */
+};
+
+/* A point of the x-y monitor, relative to the reference level */
+
+struct timecoder_point {
+    float x, y;
 };
 
 struct timecoder {
@@ -57,6 +98,14 @@ struct timecoder {
 
     double dt, zero_alpha;
 
+    /* The zero filter over a group of samples, from its value before
+     * the group and each sample but the last, and a run of samples
+     * where the pitch filter sees no movement */
+
+    float zero_decay[TIMECODER_LANES],
+        zero_kernel[TIMECODER_LANES - 1][TIMECODER_LANES];
+    struct pitch_run idle[TIMECODER_BLOCK + 1];
+
     /* Pitch information */
 
     bool forwards;
@@ -71,10 +120,27 @@ struct timecoder {
     unsigned int valid_counter, /* number of successful error checks */
         timecode_ticker; /* samples since valid timecode was read */
 
-    /* Feedback */
+    /* Search of the timecode tolerating errors in its bits, in place
+     * of the error checks; see timecoder_set_tolerant() */
+
+    bool tolerant,
+        locked, /* timecode is the position of the needle */
+        reckoning; /* reckon is valid */
+    unsigned int filled; /* bits read towards a search */
+    double reckon; /* position from the pitch since the lock was lost */
+    unsigned int ncandidates;
+    struct timecoder_candidate candidate[TIMECODER_CANDIDATES];
+
+    /* Feedback; points are passed from the decoder to the interface
+     * through a ring, and plotted in the x-y array by the interface */
 
     unsigned char *mon; /* x-y array */
     int mon_size, mon_counter;
+
+    struct timecoder_point *points; /* published atomically */
+    unsigned int points_head, /* written by the decoder */
+        points_tail, /* written by the interface */
+        points_phase; /* samples to the next point */
 };
 
 struct timecode_def* timecoder_find_definition(const char *name);
@@ -86,9 +152,13 @@ void timecoder_clear(struct timecoder *tc);
 
 int timecoder_monitor_init(struct timecoder *tc, int size);
 void timecoder_monitor_clear(struct timecoder *tc);
+void timecoder_monitor_update(struct timecoder *tc);
 
+void timecoder_set_tolerant(struct timecoder *tc, bool tolerant);
 void timecoder_cycle_definition(struct timecoder *tc);
 void timecoder_submit(struct timecoder *tc, signed short *pcm, size_t npcm);
+void timecoder_submit_float(struct timecoder *tc, const float *in[],
+                            unsigned stride, size_t npcm);
 signed int timecoder_get_position(struct timecoder *tc, double *when);
 
 /*
@@ -100,6 +170,26 @@ static inline struct timecode_def* timecoder_get_definition(struct timecoder *tc
     return tc->def;
 }
 
+/*
+ * Return true if positions can be looked up for this timecode,
+ * otherwise false while its lookup table is not yet available
+ */
+
+static inline bool timecoder_has_lookup(struct timecode_def *def)
+{
+    return __atomic_load_n(&def->lookup, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Return true if the lookup table for this timecode could not be
+ * made, so positions will never be available
+ */
+
+static inline bool timecoder_lookup_failed(struct timecode_def *def)
+{
+    return __atomic_load_n(&def->failed, __ATOMIC_RELAXED);
+}
+
 /*
  * Return the pitch relative to reference playback speed
  */
@@ -18,28 +18,53 @@
  */
 
 #define _BSD_SOURCE /* vfork() */
+#define _GNU_SOURCE /* F_SETPIPE_SZ */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/wait.h>
-#include <sys/mman.h> /* mlock() */
+#include <sys/mman.h>
 
+#include "cache.h"
 #include "debug.h"
-#include "external.h"
+#include "importer.h"
 #include "list.h"
+#include "meter.h"
 #include "realtime.h"
 #include "rig.h"
 #include "status.h"
 #include "osc.h"
+#include "pcmfile.h"
+#include "player.h"
 #include "track.h"
 
-#define RATE 44100
+#define RATE 44100 /* unless the audio gives its own */
+#define HEADER "rate="
+#define WAVE_HEADER "RIFF"
 
 #define SAMPLE (sizeof(signed short) * TRACK_CHANNELS) /* bytes per sample */
 #define TRACK_BLOCK_PCM_BYTES (TRACK_BLOCK_SAMPLES * SAMPLE)
+#define DIV_UP(x, y) (((x) + (y) - 1) / (y))
+
+#define PAGE 4096 /* smallest page size we expect */
+#define HUGE_PAGE (2 * 1024 * 1024)
+#define BLOCK_MAP (DIV_UP(sizeof(struct track_block), HUGE_PAGE) * HUGE_PAGE)
+#define POOL_SIZE 4 /* blocks kept for re-use */
+#define INDEX_SIZE 16 /* initial number of blocks in the index */
+#define PIPE_SIZE (1024 * 1024) /* the most allowed without privileges */
+
+#define SEEK_AHEAD 10 /* seconds beyond the imported audio, before seeking */
+#define SEEK_LEAD 2 /* seconds imported before the sample wanted */
+
+#define METER_PPM 0
+#define METER_OVERVIEW 1
 
 #define _STR(tok) #tok
 #define STR(tok) _STR(tok)
@@ -47,6 +72,31 @@
 static struct list tracks = LIST_INIT(tracks);
 static bool use_mlock = false;
 
+/* Tracks no longer in use, least recently used first, which are kept
+ * in memory within the budget in case they are loaded again */
+
+static struct list retained = LIST_INIT(retained);
+static size_t budget = 0, allocated = 0, held = 0; /* bytes */
+
+/* Blocks freed by tracks, ready to be used again without the cost of
+ * mapping and faulting in new memory */
+
+static struct track_block *pool[POOL_SIZE];
+static size_t npool = 0;
+static bool use_hugetlb = true;
+
+/* Tracks waiting for an importer, oldest first, so that decoding does
+ * not compete with itself or the realtime thread for the CPU */
+
+static struct list queue = LIST_INIT(queue);
+static unsigned int importers = 0, max_importers = TRACK_IMPORTS;
+static int importer_nice = TRACK_NICE;
+
+/* Tracks which have completed import, waiting for the import thread
+ * to write them to the cache once it has released the rig lock */
+
+static struct list unsaved = LIST_INIT(unsaved);
+
 /*
  * An empty track is used rarely, and is easier than
  * continuous checks for NULL throughout the code
@@ -56,11 +106,12 @@ static struct track empty = {
     .refcount = 1,
 
     .rate = RATE,
-    .bytes = 0,
     .length = 0,
     .blocks = 0,
+    .index = NULL,
+    .region = 0,
 
-    .pid = 0
+    .import.job = NULL
 };
 
 /*
@@ -74,416 +125,1762 @@ void track_use_mlock(void)
 }
 
 /*
- * Allocate more memory
+ * Set the memory to use for all tracks, within which tracks no longer
+ * in use are kept in case they are loaded again
  *
- * Return: -1 if memory could not be allocated, otherwize 0
+ * Tracks in use are never removed from memory, so this is exceeded
+ * if necessary. A budget of zero frees tracks as soon as they are
+ * no longer used.
  */
 
-static int more_space(struct track *tr)
+void track_set_budget(size_t bytes)
 {
-    struct track_block *block;
-
-    rt_not_allowed();
-
-    if (tr->blocks >= TRACK_MAX_BLOCKS) {
-        fprintf(stderr, "Maximum track length reached.\n");
-        return -1;
-    }
-
-    block = malloc(sizeof(struct track_block));
-    if (block == NULL) {
-        perror("malloc");
-        return -1;
-    }
-
-    if (use_mlock && mlock(block, sizeof(struct track_block)) == -1) {
-        perror("mlock");
-        free(block);
-        return -1;
-    }
+    budget = bytes;
+}
 
-    /* No memory barrier is needed here, because nobody else tries to
-     * access these blocks until tr->length is actually incremented */
+/*
+ * Set the number of importers which can run at once; further tracks
+ * wait their turn
+ *
+ * Pre: n > 0
+ */
 
-    tr->block[tr->blocks++] = block;
+void track_limit_imports(unsigned int n)
+{
+    assert(n > 0);
+    max_importers = n;
+}
 
-    debug("allocated new track block (%d blocks, %zu bytes)",
-          tr->blocks, tr->blocks * TRACK_BLOCK_SAMPLES * SAMPLE);
+/*
+ * Set the nice value given to importers
+ */
 
-    return 0;
+void track_set_nice(int n)
+{
+    importer_nice = n;
 }
 
 /*
- * Get access to the PCM buffer for incoming audio
- *
- * Return: pointer to buffer
- * Post: len contains the length of the buffer, in bytes
+ * Return: memory used by the audio of all tracks, in bytes
  */
 
-static void* access_pcm(struct track *tr, size_t *len)
+size_t track_memory(void)
 {
-    unsigned int block;
-    size_t fill;
-
-    block = tr->bytes / TRACK_BLOCK_PCM_BYTES;
-    if (block == tr->blocks) {
-        if (more_space(tr) == -1)
-            return NULL;
-    }
+    return allocated;
+}
 
-    fill = tr->bytes % TRACK_BLOCK_PCM_BYTES;
-    *len = TRACK_BLOCK_PCM_BYTES - fill;
+/*
+ * Return: memory used by tracks which are not in use, in bytes
+ */
 
-    return (void*)tr->block[block]->pcm + fill;
+size_t track_retained(void)
+{
+    return held;
 }
 
+static void track_clear(struct track *tr);
+
 /*
- * Notify that audio has been placed in the buffer
+ * Map the memory for a new block
  *
- * The parameter is the number of stereo samples which have been
- * placed in the buffer.
+ * Huge pages are used where available, to reduce TLB misses from the
+ * realtime thread. The memory is faulted in here, so that the
+ * realtime thread is never the first to touch it.
+ *
+ * Return: pointer to block, or NULL on error
  */
 
-static void commit_pcm_samples(struct track *tr, unsigned int samples)
+static struct track_block* map_block(void)
 {
-    unsigned int fill, n;
-    signed short *pcm;
-    struct track_block *block;
-
-    block = tr->block[tr->length / TRACK_BLOCK_SAMPLES];
-    fill = tr->length % TRACK_BLOCK_SAMPLES;
-    pcm = block->pcm + TRACK_CHANNELS * fill;
-
-    assert(samples <= TRACK_BLOCK_SAMPLES - fill);
+    void *p;
+    size_t n;
 
-    /* Meter the new audio */
+#ifdef MAP_HUGETLB
+    if (use_hugetlb) {
+        p = mmap(NULL, BLOCK_MAP, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE,
+                 -1, 0);
+        if (p != MAP_FAILED)
+            goto done;
 
-    for (n = samples; n > 0; n--) {
-        unsigned short v;
-        unsigned int w;
+        /* Usually no huge pages are reserved; don't keep trying */
 
-        v = abs(pcm[0]) + abs(pcm[1]);
+        debug("no huge pages, using normal pages for tracks");
+        use_hugetlb = false;
+    }
+#endif
 
-        /* PPM-style fast meter approximation */
+    p = mmap(NULL, BLOCK_MAP, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
 
-        if (v > tr->ppm)
-            tr->ppm += (v - tr->ppm) >> 3;
-        else
-            tr->ppm -= (tr->ppm - v) >> 9;
+#ifdef MADV_HUGEPAGE
+    madvise(p, BLOCK_MAP, MADV_HUGEPAGE); /* not an error to be refused */
+#endif
 
-        block->ppm[fill / TRACK_PPM_RES] = tr->ppm >> 8;
+    /* Touch each page, rather than MAP_POPULATE, so that the advice
+     * is taken before the memory is faulted in */
 
-        /* Update the slow-metering overview. Fixed point arithmetic
-         * going on here */
+    for (n = 0; n < sizeof(struct track_block); n += PAGE)
+        ((volatile char*)p)[n] = 0;
 
-        w = v << 16;
+ done:
+    if (use_mlock && mlock(p, sizeof(struct track_block)) == -1) {
+        perror("mlock");
+        if (munmap(p, BLOCK_MAP) == -1)
+            abort();
+        return NULL;
+    }
 
-        if (w > tr->overview)
-            tr->overview += (w - tr->overview) >> 8;
-        else
-            tr->overview -= (tr->overview - w) >> 17;
+    return p;
+}
 
-        block->overview[fill / TRACK_OVERVIEW_RES] = tr->overview >> 24;
+/*
+ * Return a block to the pool, or to the system if the pool is full
+ */
 
-        fill++;
-        pcm += TRACK_CHANNELS;
+static void put_block(struct track_block *block)
+{
+    if (npool < POOL_SIZE) {
+        pool[npool++] = block;
+        return;
     }
 
-    /* Increment the track length. A memory barrier ensures the
-     * realtime or UI thread does not access garbage audio */
-
-    __sync_fetch_and_add(&tr->length, samples);
+    if (munmap(block, BLOCK_MAP) == -1)
+        abort();
 }
 
 /*
- * Notify that data has been placed in the buffer
- *
- * This function passes any whole samples to commit_pcm_samples()
- * and leaves the residual in the buffer ready for next time.
+ * Free tracks which are no longer in use, oldest first, until the
+ * given number of bytes can be allocated within the budget
  */
 
-static void commit(struct track *tr, size_t len)
+static void evict(size_t bytes)
 {
-    tr->bytes += len;
-    commit_pcm_samples(tr, tr->bytes / SAMPLE - tr->length);
+    struct track *t;
+
+    while (allocated + bytes > budget && !list_empty(&retained)) {
+        t = list_entry(retained.next, struct track, retained);
+        debug("evicting '%s' from memory", t->path);
+
+        list_del(&t->retained);
+        held -= t->blocks * sizeof(struct track_block);
+
+        track_clear(t);
+        free(t);
+    }
 }
 
 /*
- * Initialise object which will hold PCM audio data, and start
- * importing the data
+ * Replace the index of blocks with a larger one, which holds at least
+ * the given block
  *
- * Post: track is initialised
- * Post: track is importing
+ * Return: -1 if memory could not be allocated, otherwise 0
  */
 
-static int track_init(struct track *t, const char *importer, const char *path)
+static int grow_index(struct track *tr, unsigned int n)
 {
-    pid_t pid;
+    size_t bytes;
+    unsigned int size;
+    struct track_index *old, *new;
+
+    old = tr->index;
 
-    fprintf(stderr, "Importing '%s'...\n", path);
+    size = (old == NULL ? INDEX_SIZE : old->size * 2);
+    while (size <= n)
+        size *= 2;
 
-    pid = fork_pipe_nb(&t->fd, importer, "import", path, STR(RATE), NULL);
-    if (pid == -1)
+    bytes = sizeof *new + sizeof(struct track_block*) * size;
+
+    new = malloc(bytes);
+    if (new == NULL) {
+        perror("malloc");
         return -1;
+    }
 
-    t->pid = pid;
-    t->pe = NULL;
-    t->terminated = false;
+    if (use_mlock && mlock(new, bytes) == -1) {
+        perror("mlock");
+        free(new);
+        return -1;
+    }
 
-    t->refcount = 0;
+    new->prev = old;
+    new->size = size;
+    memset(new->block, 0, sizeof *new->block * size);
 
-    t->blocks = 0;
-    t->rate = RATE;
+    if (old != NULL)
+        memcpy(new->block, old->block, sizeof *old->block * old->size);
 
-    t->bytes = 0;
-    t->length = 0;
-    t->ppm = 0;
-    t->overview = 0;
+    /* The old index can't be freed; the realtime thread may be using
+     * it, but it still holds the same blocks */
 
-    t->importer = importer;
-    t->path = path;
+    __atomic_store_n(&tr->index, new, __ATOMIC_RELEASE);
 
-    list_add(&t->tracks, &tracks);
-    rig_post_track(t);
+    debug("grown block index to %u blocks", new->size);
 
     return 0;
 }
 
 /*
- * Destroy this track from memory
+ * Allocate memory for the given block
  *
- * Terminates any import processes and frees any memory allocated by
- * this object.
- *
- * Pre: track is not importing
- * Pre: track is initialised
+ * Return: -1 if memory could not be allocated, otherwize 0
  */
 
-static void track_clear(struct track *tr)
+static int more_space(struct track *tr, unsigned int n)
 {
-    int n;
+    struct track_block *block;
 
-    assert(tr->pid == 0);
+    rt_not_allowed();
 
-    for (n = 0; n < tr->blocks; n++)
-        free(tr->block[n]);
+    if (tr->index == NULL || n >= tr->index->size) {
+        if (grow_index(tr, n) == -1)
+            return -1;
+    }
 
-    list_del(&tr->tracks);
-}
+    /* The import thread does not hold the rig lock, so it is taken
+     * to account for the memory; but a new block is mapped and
+     * faulted in without it */
 
-/*
- * Get a pointer to a track object already in memory
- *
- * Return: pointer, or NULL if no such track exists
- */
+    rig_lock();
 
-static struct track* track_get_again(const char *importer, const char *path)
-{
-    struct track *t;
+    if (budget > 0) {
+        evict(sizeof *block);
 
-    list_for_each(t, &tracks, tracks) {
-        if (t->importer == importer && t->path == path) {
-            track_get(t);
-            return t;
+        /* Don't exceed the budget for a track nobody is waiting for,
+         * other than in case it is loaded */
+
+        if (allocated + sizeof *block > budget
+            && tr->refcount - tr->spare == 1)
+        {
+            debug("abandoning import of '%s'; out of memory", tr->path);
+            tr->terminated = true;
+            rig_unlock();
+            return -1;
         }
     }
 
-    return NULL;
-}
+    block = npool > 0 ? pool[--npool] : NULL;
+    allocated += sizeof *block;
 
-/*
- * Get a pointer to a track object for the given importer and path
- *
- * Return: pointer, or NULL if not enough resources
- */
+    rig_unlock();
 
-struct track* track_get_by_import(const char *importer, const char *path)
-{
-    struct track *t;
+    if (block == NULL) {
+        block = map_block();
+        if (block == NULL) {
+            rig_lock();
+            allocated -= sizeof *block;
+            rig_unlock();
+            return -1;
+        }
+    }
 
-    t = track_get_again(importer, path);
-    if (t != NULL)
-        return t;
+    /* A block from the pool has the meters of its previous track, and
+     * the peaks are built from whole pairs of meter values */
 
-    t = malloc(sizeof *t);
-    if (t == NULL) {
-        perror("malloc");
-        return NULL;
-    }
+    memset(block->ppm, 0, sizeof block->ppm);
+    memset(block->overview, 0, sizeof block->overview);
+    memset(block->ppm_peak, 0, sizeof block->ppm_peak);
+    memset(block->overview_peak, 0, sizeof block->overview_peak);
 
-    if (track_init(t, importer, path) == -1) {
-        free(t);
-        return NULL;
-    }
+    /* The guard is filled as an import moves into this block from
+     * the previous one */
 
-    track_get(t);
+    memset(block->pcm, 0, TRACK_GUARD * SAMPLE);
 
-    return t;
+    /* No memory barrier is needed here, because nobody else tries to
+     * access these blocks until tr->length is actually incremented */
+
+    tr->index->block[n] = block;
+    tr->blocks++;
+
+    debug("allocated new track block (%d blocks, %zu bytes)",
+          tr->blocks, tr->blocks * TRACK_BLOCK_SAMPLES * SAMPLE);
+
+    return 0;
 }
 
 /*
- * Get a pointer to a static track containing no audio
+ * Get access to the PCM buffer for incoming audio from an import
  *
- * Return: pointer, not NULL
+ * Return: pointer to buffer
+ * Post: len contains the length of the buffer, in bytes
  */
 
-struct track* track_get_empty(void)
+static void* access_pcm(struct track *tr, struct track_import *im,
+                        size_t *len)
 {
-    empty.refcount++;
-    return &empty;
-}
+    unsigned int n;
+    size_t pos, fill;
+    struct track_block *block;
 
-void track_get(struct track *t)
-{
-    t->refcount++;
-}
+    pos = (size_t)im->start * SAMPLE + im->bytes;
+    n = pos / TRACK_BLOCK_PCM_BYTES;
+    fill = pos % TRACK_BLOCK_PCM_BYTES;
 
-/*
- * Request premature termination of an import operation
- */
+    if (tr->index == NULL || n >= tr->index->size
+        || tr->index->block[n] == NULL)
+    {
+        if (more_space(tr, n) == -1)
+            return NULL;
+    }
 
-static void terminate(struct track *t)
-{
-    assert(t->pid != 0);
+    block = tr->index->block[n];
 
-    if (kill(t->pid, SIGTERM) == -1)
-        abort();
+    /* The final samples of the previous block are copied into the
+     * guard as an import moves into this one. An import from a seek
+     * may be the first to reach the previous block, in which case
+     * the guard is copied again by join() */
 
-    t->terminated = true;
+    if (fill == 0)
+        track_copy_guard(tr, n);
+
+    *len = TRACK_BLOCK_PCM_BYTES - fill;
+
+    return (void*)block->pcm + TRACK_GUARD * SAMPLE + fill;
 }
 
 /*
- * Finish use of a track object
+ * Take the meters for new audio in the given block from those
+ * stored in the cache, rather than calculate them again
  */
 
-void track_put(struct track *t)
+static void copy_meters(struct track *tr, struct track_block *block,
+                        unsigned int fill, unsigned int samples)
 {
-    t->refcount--;
+    unsigned int n, start;
 
-    /* When importing, a reference is held. If it's the
-     * only one remaining terminate it to save resources */
+    start = tr->length - fill; /* of this block */
 
-    if (t->refcount == 1 && t->pid != 0) {
-        terminate(t);
-        return;
+    for (n = fill / TRACK_PPM_RES;
+         n < DIV_UP(fill + samples, TRACK_PPM_RES); n++)
+    {
+        block->ppm[n] = tr->cached_ppm[start / TRACK_PPM_RES + n];
     }
 
-    if (t->refcount == 0) {
-        assert(t != &empty);
-        track_clear(t);
-        free(t);
+    for (n = fill / TRACK_OVERVIEW_RES;
+         n < DIV_UP(fill + samples, TRACK_OVERVIEW_RES); n++)
+    {
+        block->overview[n] =
+            tr->cached_overview[start / TRACK_OVERVIEW_RES + n];
     }
 }
 
 /*
- * Get entry for use by poll()
+ * Return: pointer to the given level of a meter's peaks, where level
+ * zero is the meter itself
+ */
+
+static unsigned char* peak_level(unsigned char *meter, unsigned char *peak,
+                                 unsigned int n, unsigned int level)
+{
+    if (level == 0)
+        return meter;
+
+    return peak + n - (n >> (level - 1));
+}
+
+/*
+ * Update the peaks of a meter for a range of meter values which have
+ * changed, from first up to but not including last
  *
- * Pre: track is importing
- * Post: *pe contains poll entry
+ * Each level up halves the range, so this is O(last - first).
  */
 
-void track_pollfd(struct track *t, struct pollfd *pe)
+static void build_peaks(unsigned char *meter, unsigned char *peak,
+                        unsigned int n, unsigned int first, unsigned int last)
 {
-    assert(t->pid != 0);
+    unsigned int level, i;
+    unsigned char *child, *parent;
 
-    pe->fd = t->fd;
-    pe->events = POLLIN;
+    child = meter;
 
-    t->pe = pe;
+    for (level = 1; (n >> level) > 0; level++) {
+        parent = peak_level(meter, peak, n, level);
+        first /= 2;
+        last = DIV_UP(last, 2);
+
+        for (i = first; i < last; i++) {
+            unsigned char a, b;
+
+            a = child[i * 2];
+            b = child[i * 2 + 1];
+            parent[i] = a > b ? a : b;
+        }
+
+        child = parent;
+    }
 }
 
 /*
- * Read the next block of data from the file handle into the track's
- * PCM data
+ * Return: the peak of a meter over the given range of its values in
+ * a single block, from first up to but not including last
  *
- * Return: -1 on completion, otherwise zero
+ * The range is covered using at most two values from each level.
  */
 
-static int read_from_pipe(struct track *tr)
+static unsigned char span_peak(unsigned char *meter, unsigned char *peak,
+                               unsigned int n, unsigned int first,
+                               unsigned int last)
 {
-    for (;;) {
-        void *pcm;
-        size_t len;
-        ssize_t z;
+    unsigned int level;
+    unsigned char *v, r;
 
-        pcm = access_pcm(tr, &len);
-        if (pcm == NULL)
-            return -1;
+    r = 0;
 
-        z = read(tr->fd, pcm, len);
-        if (z == -1) {
-            if (errno == EAGAIN) {
-                return 0;
-            } else {
-                perror("read");
-                return -1;
-            }
+    for (level = 0; first < last; level++) {
+        v = peak_level(meter, peak, n, level);
+
+        if (first & 1) {
+            if (v[first] > r)
+                r = v[first];
+            first++;
         }
 
-        if (z == 0) /* EOF */
-            break;
+        if (last & 1) {
+            last--;
+            if (v[last] > r)
+                r = v[last];
+        }
 
-        commit(tr, z);
+        first /= 2;
+        last /= 2;
     }
 
-    return -1; /* completion without error */
+    return r;
 }
 
 /*
- * Synchronise with the import process and complete it
- *
- * Pre: track is importing
- * Post: track is not importing
+ * Return: the peak of a meter between the given samples of a track,
+ * within the audio which has been imported around the start
  */
 
-static void stop_import(struct track *t)
+static unsigned char track_peak(struct track *tr, int meter,
+                                int start, int end)
 {
-    int status;
+    int rs, re;
+    unsigned int res, n, first, last;
+    unsigned char r;
 
-    assert(t->pid != 0);
+    if (start < 0)
+        start = 0;
 
-    if (close(t->fd) == -1)
-        abort();
+    if (start < tr->length) {
+        if (end > tr->length)
+            end = tr->length;
+    } else {
+        track_get_region(tr, &rs, &re);
+        if (start < rs || start >= re)
+            return 0;
+        if (end > re)
+            end = re;
+    }
 
-    if (waitpid(t->pid, &status, 0) == -1)
-        abort();
+    if (start >= end)
+        return 0;
 
-    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) {
-        fprintf(stderr, "Track import completed\n");
-        osc_send_ppm_block(t);
-        fprintf(stderr, "Sent ppm to OSC\n");
+    if (meter == METER_PPM) {
+        res = TRACK_PPM_RES;
+        n = TRACK_PPM_N;
     } else {
-        fprintf(stderr, "Track import completed with status %d\n", status);
-        if (!t->terminated)
-            status_printf(STATUS_ERROR, "Error importing %s", t->path);
+        res = TRACK_OVERVIEW_RES;
+        n = TRACK_OVERVIEW_N;
+    }
+
+    first = start / res;
+    last = DIV_UP(end, res);
+    r = 0;
+
+    while (first < last) {
+        unsigned int b, to;
+        unsigned char v;
+        struct track_block *block;
+
+        b = first / n;
+        block = track_get_block(tr, b * TRACK_BLOCK_SAMPLES);
+
+        to = last - b * n;
+        if (to > n)
+            to = n;
+
+        if (meter == METER_PPM) {
+            v = span_peak(block->ppm, block->ppm_peak, n,
+                          first - b * n, to);
+        } else {
+            v = span_peak(block->overview, block->overview_peak, n,
+                          first - b * n, to);
+        }
+
+        if (v > r)
+            r = v;
+
+        first = (b + 1) * n;
     }
 
-    t->pid = 0;
+    return r;
 }
 
 /*
- * Handle any file descriptor activity on this track
- *
- * Return: true if import has completed, otherwise false
+ * Return: the peak of the PPM meter between the given samples
  */
 
-void track_handle(struct track *tr)
+unsigned char track_get_ppm_peak(struct track *tr, int start, int end)
 {
-    assert(tr->pid != 0);
+    return track_peak(tr, METER_PPM, start, end);
+}
 
-    /* A track may be added while poll() was waiting,
-     * in which case it has no return data from poll */
+/*
+ * Return: the peak of the overview meter between the given samples
+ */
 
-    if (tr->pe == NULL)
-        return;
+unsigned char track_get_overview_peak(struct track *tr, int start, int end)
+{
+    return track_peak(tr, METER_OVERVIEW, start, end);
+}
 
-    if (tr->pe->revents == 0)
-        return;
+/*
+ * Reverse the byte order of the given number of 16-bit values
+ */
+
+static void swap_bytes(signed short *pcm, unsigned int n)
+{
+    unsigned short *x;
+
+    for (x = (unsigned short*)pcm; n > 0; n--, x++)
+        *x = *x << 8 | *x >> 8;
+}
+
+/*
+ * Make the region of audio beyond the length of the track visible to
+ * other threads
+ */
+
+static void set_region(struct track *tr, unsigned int start, unsigned int end)
+{
+    __atomic_store_n(&tr->region, (unsigned long long)start << 32 | end,
+                     __ATOMIC_RELEASE);
+}
+
+/*
+ * Notify that audio has been placed in the buffer by an import
+ *
+ * The parameter is the number of stereo samples which have been
+ * placed in the buffer.
+ */
+
+static void commit_pcm_samples(struct track *tr, struct track_import *im,
+                               unsigned int samples)
+{
+    unsigned int fill;
+    struct track_block *block;
+
+    block = tr->index->block[im->end / TRACK_BLOCK_SAMPLES];
+    fill = im->end % TRACK_BLOCK_SAMPLES;
+
+    assert(samples <= TRACK_BLOCK_SAMPLES - fill);
+
+    if (tr->swap)
+        swap_bytes(block->pcm + TRACK_CHANNELS * (TRACK_GUARD + fill),
+                   samples * TRACK_CHANNELS);
+
+    /* Audio is metered in whole chunks, so the chunk which was
+     * incomplete last time is metered again from its start */
+
+    if (tr->cached_ppm != NULL) {
+        copy_meters(tr, block, fill, samples);
+    } else {
+        meter_block(&im->meter, block, fill - fill % TRACK_PPM_RES,
+                    samples + fill % TRACK_PPM_RES);
+    }
+
+    build_peaks(block->ppm, block->ppm_peak, TRACK_PPM_N,
+                fill / TRACK_PPM_RES,
+                DIV_UP(fill + samples, TRACK_PPM_RES));
+    build_peaks(block->overview, block->overview_peak, TRACK_OVERVIEW_N,
+                fill / TRACK_OVERVIEW_RES,
+                DIV_UP(fill + samples, TRACK_OVERVIEW_RES));
+
+    im->end += samples;
+
+    /* Increment the track length, or extend the region; where all
+     * the audio of a preview goes. A memory
+     * barrier ensures the realtime or UI thread does not access
+     * garbage audio */
+
+    if (im == &tr->import && !tr->preview)
+        __sync_fetch_and_add(&tr->length, samples);
+    else
+        set_region(tr, im->start, im->end);
+}
+
+/*
+ * Notify that data has been placed in the buffer
+ *
+ * This function passes any whole samples to commit_pcm_samples()
+ * and leaves the residual in the buffer ready for next time.
+ */
+
+static void commit(struct track *tr, struct track_import *im, size_t len)
+{
+    im->bytes += len;
+    commit_pcm_samples(tr, im, im->start + im->bytes / SAMPLE - im->end);
+}
+
+/*
+ * Prepare an import to place audio from the given sample
+ */
+
+static void import_init(struct track_import *im, unsigned int start)
+{
+    im->start = start;
+    im->end = start;
+    im->bytes = 0;
+    im->job = NULL;
+    im->pe = NULL;
+    im->finished = false;
+    im->header = false;
+    im->nhead = 0;
+    meter_init(&im->meter);
+}
+
+/*
+ * Enlarge the pipe from an importer, for fewer and larger reads
+ */
+
+static void enlarge_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+    if (fcntl(fd, F_SETPIPE_SZ, PIPE_SIZE) == -1) {
+        debug("pipe size of %d refused", PIPE_SIZE); /* not an error */
+    }
+#endif
+}
+
+/*
+ * Start the importer process for a track
+ *
+ * Return: -1 on error, otherwise 0
+ */
+
+static int fork_import(struct track *t)
+{
+    struct import_job *job;
+
+    fprintf(stderr, "Importing '%s'...\n", t->path);
+
+    job = importer_start(&t->import.fd, importer_nice, t->importer,
+                         t->path, STR(RATE), NULL);
+    if (job == NULL)
+        return -1;
+
+    t->import.job = job;
+    t->import.header = true;
+    importers++;
+    enlarge_pipe(t->import.fd);
+
+    return 0;
+}
+
+/*
+ * Start the importer for a track which has waited its turn
+ *
+ * Pre: track is queued
+ * Post: track is not queued
+ */
+
+static void start_queued(struct track *t)
+{
+    assert(t->queued);
+
+    list_del(&t->queue);
+    t->queued = false;
+
+    if (fork_import(t) == -1) {
+        status_printf(STATUS_ERROR, "Error importing %s", t->path);
+    } else {
+        rig_post_track(t);
+    }
+
+    track_put(t); /* the reference held by the queue; may delete it */
+}
+
+/*
+ * Start importers for queued tracks, while there are free places
+ *
+ * Tracks which are playing come first, then those on a deck, then
+ * those nobody is waiting for; oldest first within each.
+ */
+
+static void schedule(void)
+{
+    while (importers < max_importers && !list_empty(&queue)) {
+        int need, best_need;
+        struct track *t, *best;
+
+        best = NULL;
+        best_need = -1;
+
+        list_for_each(t, &queue, queue) {
+            need = player_need(t);
+            if (need > best_need) {
+                best = t;
+                best_need = need;
+            }
+        }
+
+        start_queued(best);
+    }
+}
+
+/*
+ * Initialise object which will hold PCM audio data, with none yet
+ */
+
+static void init(struct track *t, const char *importer, const char *path)
+{
+    t->importer = importer;
+    t->path = path;
+
+    import_init(&t->import, 0);
+    import_init(&t->seek, 0);
+    t->probing = false;
+    t->queued = false;
+    t->terminated = false;
+    t->direct = false;
+    t->swap = false;
+    t->seeking = false;
+    t->caught_up = false;
+    t->unseekable = false;
+    t->cached_ppm = NULL;
+    t->cached_overview = NULL;
+    t->complete = false;
+    list_init(&t->retained); /* so track_get() can remove it */
+
+    t->refcount = 0;
+    t->spare = 0;
+
+    t->blocks = 0;
+    t->index = NULL;
+    t->rate = RATE;
+
+    t->length = 0;
+    t->region = 0;
+    t->preview = false;
+}
+
+/*
+ * Initialise object which will hold PCM audio data, and begin
+ * importing the data
+ *
+ * Whether the file can be read directly, or was decoded before, is
+ * found by the import thread; see probe().
+ *
+ * Post: track is initialised
+ * Post: track is importing
+ */
+
+static void track_init(struct track *t, const char *importer,
+                       const char *path)
+{
+    init(t, importer, path);
+    t->probing = true;
+
+    list_add(&t->tracks, &tracks);
+    rig_post_track(t);
+}
+
+/*
+ * Destroy this track from memory
+ *
+ * Terminates any import processes and frees any memory allocated by
+ * this object.
+ *
+ * Pre: track is not importing
+ * Pre: track is initialised
+ */
+
+static void track_clear(struct track *tr)
+{
+    int n;
+    struct track_index *i;
+
+    assert(!track_is_importing(tr));
+
+    for (n = 0; tr->index != NULL && n < tr->index->size; n++) {
+        if (tr->index->block[n] != NULL)
+            put_block(tr->index->block[n]);
+    }
+
+    while (tr->index != NULL) {
+        i = tr->index;
+        tr->index = i->prev;
+        free(i);
+    }
+
+    allocated -= tr->blocks * sizeof(struct track_block);
+
+    list_del(&tr->tracks);
+}
+
+/*
+ * Get a pointer to a track object already in memory
+ *
+ * Return: pointer, or NULL if no such track exists
+ */
+
+static struct track* track_get_again(const char *importer, const char *path)
+{
+    struct track *t;
+
+    /* A track abandoned part way through, but still held in case it
+     * is loaded, is not used again */
+
+    list_for_each(t, &tracks, tracks) {
+        if (t->importer == importer && t->path == path && !t->preview
+            && !t->terminated)
+        {
+            track_get(t);
+            return t;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Get a pointer to a track object for the given importer and path
+ *
+ * Return: pointer, or NULL if not enough resources
+ */
+
+struct track* track_get_by_import(const char *importer, const char *path)
+{
+    struct track *t;
+
+    t = track_get_again(importer, path);
+    if (t != NULL)
+        return t;
+
+    t = malloc(sizeof *t);
+    if (t == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    track_init(t, importer, path);
+    track_get(t);
+
+    return t;
+}
+
+/*
+ * Get a pointer to a track object holding a short window of the audio
+ * of the given file, from the given number of seconds in
+ *
+ * This is for listening to a record without importing all of it. The
+ * track is not shared with any other of the same file, and is not
+ * retained once it is no longer used.
+ *
+ * Return: pointer, or NULL if not enough resources
+ */
+
+struct track* track_get_preview(const char *importer, const char *path,
+                                double seconds)
+{
+    char rate[16], offset[32];
+    struct track *t;
+    struct import_job *job;
+
+    t = malloc(sizeof *t);
+    if (t == NULL) {
+        perror("malloc");
+        return NULL;
+    }
+
+    init(t, importer, path);
+    t->preview = true;
+    t->unseekable = true; /* the window is all there is */
+    t->at = seconds;
+
+    /* Where the window goes in the track depends on the sample rate,
+     * which is given by the importer; see read_header() */
+
+    snprintf(rate, sizeof rate, "%d", t->rate);
+    snprintf(offset, sizeof offset, "%.6f", seconds);
+
+    fprintf(stderr, "Previewing '%s' from %ss...\n", path, offset);
+
+    /* A preview is small, and wanted now, so it does not wait its
+     * turn with other imports */
+
+    job = importer_start(&t->import.fd, importer_nice, importer,
+                         path, rate, offset);
+    if (job == NULL) {
+        free(t);
+        return NULL;
+    }
+
+    t->import.job = job;
+    t->import.header = true;
+    importers++;
+    enlarge_pipe(t->import.fd);
+
+    list_add(&t->tracks, &tracks);
+    rig_post_track(t);
+    track_get(t);
+
+    return t;
+}
+
+/*
+ * Get a pointer to a static track containing no audio
+ *
+ * Return: pointer, not NULL
+ */
+
+struct track* track_get_empty(void)
+{
+    empty.refcount++;
+    return &empty;
+}
+
+void track_get(struct track *t)
+{
+    /* Bring a track back into use */
+
+    if (t->refcount == 0) {
+        list_del(&t->retained);
+        held -= t->blocks * sizeof(struct track_block);
+    }
+
+    t->refcount++;
+}
+
+/*
+ * Stop an importer which is no longer wanted
+ *
+ * Closing the pipe means the importer can't block on writing to it.
+ */
+
+static void kill_import(struct track_import *im)
+{
+    assert(im->job != NULL);
+
+    if (!im->finished && close(im->fd) == -1)
+        abort();
+
+    importer_forget(im->job);
+
+    im->job = NULL;
+    im->finished = false;
+    importers--;
+}
+
+/*
+ * Request premature termination of an import operation
+ */
+
+static void terminate(struct track *t)
+{
+    assert(track_is_importing(t));
+
+    if (t->import.job != NULL)
+        importer_kill(t->import.job);
+
+    if (t->seek.job != NULL)
+        importer_kill(t->seek.job);
+
+    t->terminated = true;
+}
+
+/*
+ * Finish use of a track object
+ */
+
+void track_put(struct track *t)
+{
+    t->refcount--;
+
+    /* When importing, a reference is held. If it's the
+     * only one remaining terminate it to save resources, unless
+     * there is memory to keep it */
+
+    if (t->refcount == 1 && track_is_importing(t)) {
+        if (budget > 0)
+            return;
+
+        if (!t->queued) {
+            terminate(t);
+            return;
+        }
+
+        /* Never started, so there's nothing to wait for */
+
+        list_del(&t->queue);
+        t->queued = false;
+        t->refcount--;
+    }
+
+    if (t->refcount == 0) {
+        assert(t != &empty);
+
+        if (budget > 0 && t->complete) {
+            list_add_tail(&t->retained, &retained);
+            held += t->blocks * sizeof(struct track_block);
+            evict(0);
+            return;
+        }
+
+        track_clear(t);
+        free(t);
+    }
+}
+
+/*
+ * Get a track which is only wanted in case it is loaded
+ *
+ * Its import is abandoned if it needs more memory than the budget
+ * allows, unless the track is also used for something else.
+ *
+ * Return: pointer, or NULL if not enough resources
+ */
+
+struct track* track_get_spare(const char *importer, const char *path)
+{
+    struct track *t;
+
+    t = track_get_by_import(importer, path);
+    if (t != NULL)
+        t->spare++;
+
+    return t;
+}
+
+/*
+ * Finish use of a track from track_get_spare()
+ *
+ * Unlike track_put(), an import which has not yet started is
+ * abandoned if nothing else is using the track, even if there is
+ * memory to keep it.
+ */
+
+void track_put_spare(struct track *t)
+{
+    assert(t->spare > 0);
+    t->spare--;
+
+    if (t->refcount == 2 && t->queued) {
+        list_del(&t->queue);
+        t->queued = false;
+        t->refcount--;
+    }
+
+    track_put(t);
+}
+
+/*
+ * Get entries for use by poll(); at most TRACK_POLLFDS
+ *
+ * Pre: track is importing
+ * Return: number of entries used
+ * Post: pe contains poll entries
+ */
+
+int track_pollfd(struct track *t, struct pollfd *pe)
+{
+    int n;
+
+    assert(track_is_importing(t));
+
+    n = 0;
+
+    if (t->probing)
+        return 0; /* nothing to wait for; see track_read() */
+
+    /* An import which has finished may be waiting for the exit
+     * status of its importer; there is nothing more to read */
+
+    if (!t->import.finished) {
+        pe[n].fd = t->import.fd;
+        pe[n].events = POLLIN;
+        t->import.pe = &pe[n];
+        n++;
+    }
+
+    if (t->seek.job != NULL && !t->seek.finished) {
+        pe[n].fd = t->seek.fd;
+        pe[n].events = POLLIN;
+        t->seek.pe = &pe[n];
+        n++;
+    }
+
+    return n;
+}
+
+/*
+ * Place audio into the track from an import
+ *
+ * Return: -1 if memory could not be allocated, otherwise 0
+ */
+
+static int put(struct track *tr, struct track_import *im,
+               const char *buf, size_t len)
+{
+    while (len > 0) {
+        void *pcm;
+        size_t z;
+
+        pcm = access_pcm(tr, im, &z);
+        if (pcm == NULL)
+            return -1;
+
+        if (z > len)
+            z = len;
+
+        memcpy(pcm, buf, z);
+        commit(tr, im, z);
+
+        buf += z;
+        len -= z;
+    }
+
+    return 0;
+}
+
+/*
+ * Return: true if the output of the importer so far is the start of
+ * the given header, but too short to tell for certain
+ */
+
+static bool partial(const struct track_import *im, const char *header)
+{
+    return im->nhead < strlen(header) && !memcmp(im->head, header, im->nhead);
+}
+
+/*
+ * Return: true if the output of the importer begins with the given
+ * header
+ */
+
+static bool begins(const struct track_import *im, const char *header)
+{
+    return im->nhead >= strlen(header)
+        && !memcmp(im->head, header, strlen(header));
+}
+
+/*
+ * Parse a line giving the sample rate
+ *
+ * Return: length of the line, 0 if it is not complete, or -1 if it
+ * can't be used
+ */
+
+static ssize_t rate_line(const struct track_import *im, int *rate)
+{
+    long r;
+    char *end, *nl;
+
+    nl = memchr(im->head, '\n', im->nhead);
+    if (nl == NULL)
+        return 0;
+
+    r = strtol(im->head + sizeof HEADER - 1, &end, 10);
+    if (end != nl || r < 0 || r > INT_MAX)
+        return -1;
+
+    *rate = r;
+    return nl - im->head + 1;
+}
+
+/*
+ * Read the start of the output of the importer, which may be a header
+ * giving the sample rate of the audio which follows
+ *
+ * The header is a line "rate=<hz>", or a WAV header as written by a
+ * decoder. An importer which gives neither outputs audio at the rate
+ * it was asked for. But an importer asked to seek, or for a preview,
+ * must give one to show it has done so; a seek at the same rate as
+ * before.
+ *
+ * Return: -1 on error, otherwise 0
+ * Post: if the header is complete, im->header is false
+ */
+
+static int read_header(struct track *tr, struct track_import *im)
+{
+    int rate;
+    ssize_t z, skip;
+
+    z = read(im->fd, im->head + im->nhead, sizeof im->head - im->nhead);
+    if (z == -1) {
+        if (errno == EAGAIN) {
+            return 0;
+        } else {
+            perror("read");
+            return -1;
+        }
+    }
+
+    im->nhead += z;
+
+    if (z > 0 && (partial(im, HEADER) || partial(im, WAVE_HEADER)))
+        return 0; /* can't tell yet */
 
-    if (read_from_pipe(tr) != -1)
+    if (begins(im, HEADER)) {
+        skip = rate_line(im, &rate);
+    } else if (begins(im, WAVE_HEADER)) {
+        skip = pcmfile_stream(im->head, im->nhead, &rate);
+    } else {
+        if (im == &tr->seek || tr->preview) {
+            fprintf(stderr, "Importer can't seek; it gave no header.\n");
+            tr->unseekable = true;
+            return -1;
+        }
+
+        im->header = false;
+        return put(tr, im, im->head, im->nhead); /* this is audio */
+    }
+
+    if (skip == 0) {
+        if (z > 0 && im->nhead < sizeof im->head)
+            return 0;
+        skip = -1; /* cut short */
+    }
+
+    if (skip == -1) {
+        fprintf(stderr, "Importer gave a malformed header.\n");
+        return -1;
+    }
+
+    if (rate < TRACK_MIN_RATE || rate > TRACK_MAX_RATE) {
+        fprintf(stderr, "Importer gave an unusable sample rate.\n");
+        return -1;
+    }
+
+    if (im == &tr->seek) {
+        if (rate != tr->rate) {
+            fprintf(stderr, "Importer changed sample rate on seek.\n");
+            tr->unseekable = true;
+            return -1;
+        }
+    } else {
+        debug("importer gives audio at %dHz", rate);
+        tr->rate = rate;
+    }
+
+    /* The window of a preview is placed now that the rate is known;
+     * up to a chunk early, as meters are in whole chunks */
+
+    if (tr->preview) {
+        unsigned int start;
+
+        start = tr->at * rate;
+        start -= start % TRACK_PPM_RES;
+
+        im->start = start;
+        im->end = start;
+        tr->limit = (size_t)TRACK_PREVIEW * rate * SAMPLE;
+    }
+
+    im->header = false;
+    return put(tr, im, im->head + skip, im->nhead - skip);
+}
+
+/*
+ * Return: the number of bytes which the import can place before it
+ * reaches audio placed by another, or the end of a file
+ */
+
+static size_t space(struct track *tr, struct track_import *im)
+{
+    if (tr->direct || tr->preview)
+        return tr->limit - im->bytes;
+
+    if (im == &tr->import && tr->seeking)
+        return (size_t)(tr->seek.start - im->start) * SAMPLE - im->bytes;
+
+    return SIZE_MAX;
+}
+
+/*
+ * Read the next block of data from an import into the track's PCM
+ * data
+ *
+ * Return: -1 on completion, otherwise zero
+ */
+
+static int read_from_pipe(struct track *tr, struct track_import *im)
+{
+    if (im->header) {
+        if (read_header(tr, im) == -1)
+            return -1;
+        if (im->header)
+            return 0;
+    }
+
+    for (;;) {
+        void *pcm;
+        size_t len, room;
+        ssize_t z;
+
+        room = space(tr, im);
+        if (room == 0) {
+            if (!tr->direct && !tr->preview) {
+                tr->caught_up = true; /* to be joined to the seek */
+                return 0;
+            }
+            break;
+        }
+
+        pcm = access_pcm(tr, im, &len);
+        if (pcm == NULL)
+            return -1;
+
+        if (len > room)
+            len = room;
+
+        z = read(im->fd, pcm, len);
+        if (z == -1) {
+            if (errno == EAGAIN) {
+                return 0;
+            } else {
+                perror("read");
+                return -1;
+            }
+        }
+
+        if (z == 0) /* EOF */
+            break;
+
+        commit(tr, im, z);
+
+        /* A file is always ready to read; give others a turn between
+         * blocks */
+
+        if (tr->direct)
+            return 0;
+    }
+
+    return -1; /* completion without error */
+}
+
+/*
+ * Return: true if the exit status is that of a successful importer,
+ * otherwise false
+ */
+
+static bool succeeded(int status)
+{
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+        return true;
+
+    fprintf(stderr, "Importer exited with status %d\n", status);
+    return false;
+}
+
+/*
+ * The track is complete; send it where it is needed
+ */
+
+static void completed(struct track *t)
+{
+    fprintf(stderr, "Track import completed\n");
+    osc_send_ppm_block(t);
+    fprintf(stderr, "Sent ppm to OSC\n");
+    if (!t->terminated) {
+        t->complete = true;
+        track_get(t); /* held until it is saved */
+        list_add_tail(&t->unsaved, &unsaved);
+    }
+}
+
+/*
+ * Complete the import, once the importer has exited
+ *
+ * Pre: track is importing, and its import is finished
+ * Return: true if the import is complete, or false to try again later
+ * Post: if true is returned, the track is not importing
+ */
+
+static bool stop_import(struct track *t)
+{
+    int status;
+
+    assert(track_is_importing(t));
+    assert(t->import.finished);
+
+    if (t->direct) {
+        if (t->import.bytes == t->limit) {
+            fprintf(stderr, "Track read completed\n");
+            osc_send_ppm_block(t);
+            t->complete = !t->terminated;
+        } else if (!t->terminated) {
+            status_printf(STATUS_ERROR, "Error reading %s", t->path);
+        }
+
+        free(t->cached_ppm);
+        free(t->cached_overview);
+        t->cached_ppm = NULL;
+        t->cached_overview = NULL;
+        t->direct = false;
+        t->import.finished = false;
+        return true;
+    }
+
+    /* A preview has all it wants once its window is full; the
+     * importer is stopped, and success or not is of no interest */
+
+    if (t->preview) {
+        if (t->import.header && !t->terminated)
+            status_printf(STATUS_ERROR, "Can't preview %s", t->path);
+
+        kill_import(&t->import);
+        schedule();
+        return true;
+    }
+
+    if (!importer_exited(t->import.job, &status))
+        return false;
+
+    t->import.job = NULL;
+    t->import.finished = false;
+    importers--;
+
+    /* Audio from a seek, which was never joined to the rest, isn't
+     * part of the track */
+
+    if (t->seek.job != NULL)
+        kill_import(&t->seek);
+    t->seeking = false;
+    set_region(t, 0, 0);
+
+    if (succeeded(status)) {
+        completed(t);
+    } else if (!t->terminated) {
+        status_printf(STATUS_ERROR, "Error importing %s", t->path);
+    }
+
+    schedule();
+    return true;
+}
+
+/*
+ * Complete a seek which has no more audio, once its importer has
+ * exited
+ *
+ * If it succeeded, its audio waits to be joined to the rest of the
+ * track. Otherwise the import from the start carries on past it.
+ *
+ * Return: true if the seek is complete, or false to try again later
+ */
+
+static bool stop_seek(struct track *t)
+{
+    int status;
+    bool ok;
+
+    if (!importer_exited(t->seek.job, &status))
+        return false;
+
+    ok = succeeded(status) && !t->seek.header;
+
+    t->seek.job = NULL;
+    t->seek.finished = false;
+    importers--;
+
+    if (!ok) {
+        fprintf(stderr, "Seek in '%s' failed\n", t->path);
+        t->seeking = false;
+        set_region(t, 0, 0);
+    }
+
+    schedule();
+    return true;
+}
+
+/*
+ * Join the audio from a seek to the rest of the track, now that the
+ * import from the start has reached it
+ *
+ * The import from the start is no longer needed; the seek carries
+ * on in its place, unless it has already reached the end.
+ *
+ * Return: true if the track is complete, otherwise false
+ */
+
+static bool join(struct track *t)
+{
+    bool done;
+
+    debug("joining '%s' at sample %u", t->path, t->seek.start);
+
+    kill_import(&t->import);
+
+    /* The seek may have moved into the next block before the audio
+     * preceding it was imported */
+
+    track_join_guards(t, t->seek.start);
+
+    __sync_fetch_and_add(&t->length, t->seek.end - t->length);
+    t->seeking = false;
+
+    done = (t->seek.job == NULL);
+    if (done) {
+        completed(t);
+    } else {
+        t->import = t->seek;
+        t->seek.job = NULL;
+    }
+
+    schedule();
+    return done;
+}
+
+/*
+ * Look at the file of a new track, for audio which can be read
+ * directly, or which was decoded before, in place of an importer
+ *
+ * Pre: rig lock is not held, and this is the import thread
+ * Post: tr->import.fd is the audio to read, or -1 if an importer is
+ * needed
+ */
+
+static void probe(struct track *tr)
+{
+    int fd;
+
+    fd = -1;
+
+    if (!tr->terminated) {
+        fd = pcmfile_open(tr->path, &tr->rate, &tr->limit, &tr->swap);
+        if (fd != -1) {
+            fprintf(stderr, "Reading '%s'...\n", tr->path);
+        } else if ((fd = cache_open(tr)) != -1) {
+            fprintf(stderr, "Loading '%s' from cache...\n", tr->path);
+        }
+    }
+
+    tr->import.fd = fd;
+}
+
+/*
+ * Read the audio found by probe(), or otherwise wait in the queue for
+ * an importer
+ *
+ * Pre: rig lock is held
+ * Pre: track is probing
+ */
+
+static void probed(struct track *t)
+{
+    t->probing = false;
+
+    if (t->import.fd != -1) {
+        t->direct = true;
+        return;
+    }
+
+    if (!t->terminated) {
+        if (importers >= max_importers)
+            fprintf(stderr, "Queueing '%s' for import...\n", t->path);
+
+        list_add_tail(&t->queue, &queue);
+        t->queued = true;
+        track_get(t); /* held by the queue, in place of the rig */
+    }
+
+    list_del(&t->rig);
+    track_put(t); /* may delete the track */
+
+    schedule();
+}
+
+/*
+ * Finish reading from an import; it is completed later under the
+ * lock
+ */
+
+static void finish(struct track_import *im)
+{
+    if (close(im->fd) == -1)
+        abort();
+
+    im->finished = true;
+}
+
+/*
+ * Read any audio which is ready for this track
+ *
+ * This is the bulk of the work of an import, and is done by the
+ * import thread without the rig lock.
+ *
+ * Pre: track is importing
+ * Return: true if the import is to be completed by track_handle(),
+ * otherwise false
+ */
+
+bool track_read(struct track *tr)
+{
+    struct track_import *seek, *im;
+
+    assert(track_is_importing(tr));
+
+    if (tr->probing) {
+        probe(tr);
+        return true;
+    }
+
+    seek = &tr->seek;
+    if (seek->job != NULL && !seek->finished && seek->pe->revents != 0) {
+        if (tr->terminated || read_from_pipe(tr, seek) == -1)
+            finish(seek);
+    }
+
+    im = &tr->import;
+    if (!im->finished && im->pe->revents != 0) {
+        if (tr->direct && tr->terminated)
+            finish(im);
+        else if (read_from_pipe(tr, im) == -1)
+            finish(im);
+    }
+
+    return im->finished || seek->finished || tr->caught_up;
+}
+
+/*
+ * Complete the parts of the import of this track which track_read()
+ * has finished with
+ *
+ * Pre: rig lock is held
+ * Pre: track is importing
+ */
+
+void track_handle(struct track *tr)
+{
+    assert(track_is_importing(tr));
+
+    if (tr->probing) {
+        probed(tr);
+        return;
+    }
+
+    /* The exit status of an importer may arrive some time after the
+     * end of its audio; until then, the rest waits */
+
+    if (tr->seek.finished && !stop_seek(tr))
+        return;
+
+    if (tr->caught_up) {
+        tr->caught_up = false;
+        if (!tr->seeking)
+            return; /* the seek failed; carry on past it */
+        if (!join(tr))
+            return;
+    } else if (tr->import.finished) {
+        if (!stop_import(tr))
+            return;
+    } else {
         return;
+    }
 
-    stop_import(tr);
     list_del(&tr->rig);
     track_put(tr); /* may delete the track */
 }
+
+/*
+ * Write the tracks which have completed import to the cache
+ *
+ * Writing a whole track takes some time, so it is done without the
+ * rig lock. The reference taken by completed() keeps the track in
+ * memory, and its audio no longer changes.
+ *
+ * Pre: rig lock is not held, and this is the import thread
+ */
+
+void track_save_completed(void)
+{
+    struct track *t;
+
+    for (;;) {
+        rig_lock();
+
+        if (list_empty(&unsaved)) {
+            rig_unlock();
+            return;
+        }
+
+        t = list_entry(unsaved.next, struct track, unsaved);
+        list_del(&t->unsaved);
+
+        rig_unlock();
+
+        cache_store(t);
+
+        rig_lock();
+        track_put(t); /* may delete the track */
+        rig_unlock();
+    }
+}
+
+/*
+ * Start another importer part way through the track, if the given
+ * sample is needed and is some time away from being imported
+ *
+ * The track is then imported from both points at once, and joined
+ * together when the first catches up with the second.
+ *
+ * Pre: rig lock is held, by the import thread
+ */
+
+void track_want(struct track *tr, int s)
+{
+    unsigned int start;
+    int fd, rs, re;
+    char rate[16], offset[32];
+    struct import_job *job;
+
+    /* Seek only with an importer which has told us its rate, and
+     * only once at a time */
+
+    if (tr->import.job == NULL || tr->import.finished || tr->import.header
+        || tr->seeking || tr->unseekable || tr->terminated)
+    {
+        return;
+    }
+
+    if (s < (int)tr->length + SEEK_AHEAD * tr->rate)
+        return;
+
+    track_get_region(tr, &rs, &re);
+    if (s >= rs && s < re + SEEK_AHEAD * tr->rate)
+        return;
+
+    start = s - SEEK_LEAD * tr->rate;
+    start -= start % TRACK_PPM_RES; /* meters are in whole chunks */
+
+    snprintf(rate, sizeof rate, "%d", tr->rate);
+    snprintf(offset, sizeof offset, "%.6f", (double)start / tr->rate);
+
+    fprintf(stderr, "Importing '%s' from %ss...\n", tr->path, offset);
+
+    job = importer_start(&fd, importer_nice, tr->importer,
+                         tr->path, rate, offset);
+    if (job == NULL) {
+        tr->unseekable = true;
+        return;
+    }
+
+    importers++;
+    enlarge_pipe(fd);
+
+    import_init(&tr->seek, start);
+    tr->seek.job = job;
+    tr->seek.fd = fd;
+    tr->seek.header = true;
+
+    set_region(tr, start, start);
+    tr->seeking = true;
+}
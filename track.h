@@ -21,71 +21,224 @@
 #define TRACK_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
 #include <sys/poll.h>
 #include <sys/types.h>
 
+#include "importer.h"
 #include "list.h"
+#include "meter.h"
 
 #define TRACK_CHANNELS 2
 
-#define TRACK_MAX_BLOCKS 64
 #define TRACK_BLOCK_SAMPLES (2048 * 1024)
 #define TRACK_PPM_RES 64
 #define TRACK_OVERVIEW_RES 2048
 
+/* Sample rates at which a track can hold its audio */
+
+#define TRACK_MIN_RATE 8000
+#define TRACK_MAX_RATE 192000
+
+/* Default limits on importers */
+
+#define TRACK_IMPORTS 2 /* running at once */
+#define TRACK_NICE 10
+
+#define TRACK_PREVIEW 30 /* seconds of audio in a preview */
+
+/* Each block begins with a copy of the final samples of the previous
+ * block, so that a short run of samples which crosses from one block
+ * into the next is still contiguous in memory */
+
+#define TRACK_GUARD 4096
+
+#define TRACK_PPM_N (TRACK_BLOCK_SAMPLES / TRACK_PPM_RES)
+#define TRACK_OVERVIEW_N (TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES)
+
 struct track_block {
-    signed short pcm[TRACK_BLOCK_SAMPLES * TRACK_CHANNELS];
-    unsigned char ppm[TRACK_BLOCK_SAMPLES / TRACK_PPM_RES],
-        overview[TRACK_BLOCK_SAMPLES / TRACK_OVERVIEW_RES];
+    signed short pcm[(TRACK_GUARD + TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+    unsigned char ppm[TRACK_PPM_N], overview[TRACK_OVERVIEW_N];
+
+    /* Peak of each meter over spans of 2, 4, 8... meter values, up to
+     * the whole block; each level is half the size of the one before */
+
+    unsigned char ppm_peak[TRACK_PPM_N], overview_peak[TRACK_OVERVIEW_N];
+};
+
+/* The index of blocks is replaced by a larger one as the track grows.
+ * A reader may still be using an index which has been replaced, so it
+ * remains valid until the track is freed. Blocks not yet reached by
+ * any import are NULL */
+
+struct track_index {
+    struct track_index *prev; /* replaced by this one */
+    unsigned int size;
+    struct track_block *block[];
+};
+
+/* A source of audio for a track, from an importer or a file, which
+ * places its audio from a given sample onwards */
+
+struct track_import {
+    unsigned int start, /* first sample */
+        end; /* sample after the last one placed */
+    size_t bytes; /* loaded in, from the start */
+
+    struct import_job *job; /* or NULL if not from an importer */
+    int fd;
+    struct pollfd *pe;
+    bool finished; /* no more audio, and fd is closed */
+
+    /* The output of an importer may begin with a header giving the
+     * sample rate, which is read here before any audio */
+
+    bool header;
+    char head[128];
+    size_t nhead;
+
+    /* Current value of audio meters when loading */
+
+    struct meter meter;
 };
 
 struct track {
     struct list tracks;
-    unsigned int refcount;
+    unsigned int refcount,
+        spare; /* of the references, those held in case it is loaded */
     int rate;
 
     /* pointers to external data */
    
     const char *importer, *path;
     
-    size_t bytes; /* loaded in */
     unsigned int length, /* track length in samples */
         blocks; /* number of blocks allocated */
-    struct track_block *block[TRACK_MAX_BLOCKS];
+    struct track_index *index; /* published atomically */
+
+    /* Audio imported beyond the length, following a seek; its first
+     * sample and the sample after its last, packed together so they
+     * are published atomically */
+
+    unsigned long long region;
 
     /* State of audio import */
 
-    struct list rig;
-    pid_t pid;
-    int fd;
-    struct pollfd *pe;
-    bool terminated;
+    struct list rig, queue,
+        unsaved; /* complete, and waiting to be written to the cache */
+    struct track_import import, /* from the start of the track */
+        seek; /* from the region, to be joined to the rest */
+    bool probing, /* the file is yet to be looked at; see track_read() */
+        queued, /* waiting for an importer to be started */
+        terminated,
+        direct, /* reading a file ourselves, not from an importer */
+        swap, /* audio from the file is of the opposite byte order */
+        seeking, /* the region is yet to be joined to the rest */
+        caught_up, /* import from the start has reached the region */
+        unseekable, /* the importer can't start part way through */
+        preview; /* holds only a window of audio, in the region */
+    size_t limit; /* bytes of audio to read, when direct or a preview */
+    double at; /* seconds into the file, of a preview */
 
-    /* Current value of audio meters when loading */
-    
-    unsigned short ppm;
-    unsigned int overview;
+    /* Meters read from the cache, ahead of the audio */
+
+    unsigned char *cached_ppm, *cached_overview;
+
+    /* Retention once the track is no longer in use */
+
+    struct list retained;
+    bool complete; /* import finished without error */
 };
 
 void track_use_mlock(void);
+void track_set_budget(size_t bytes);
+void track_limit_imports(unsigned int n);
+void track_set_nice(int n);
+
+size_t track_memory(void);
+size_t track_retained(void);
+
+unsigned char track_get_ppm_peak(struct track *tr, int start, int end);
+unsigned char track_get_overview_peak(struct track *tr, int start, int end);
 
 /* Tracks are dynamically allocated and reference counted */
 
 struct track* track_get_by_import(const char *importer, const char *path);
+struct track* track_get_preview(const char *importer, const char *path,
+                                double seconds);
 struct track* track_get_empty(void);
 void track_get(struct track *t);
 void track_put(struct track *t);
+struct track* track_get_spare(const char *importer, const char *path);
+void track_put_spare(struct track *t);
 
 /* Functions used by the rig and main thread */
 
-void track_pollfd(struct track *tr, struct pollfd *pe);
+#define TRACK_POLLFDS 2 /* most entries used by a track */
+
+int track_pollfd(struct track *tr, struct pollfd *pe);
+bool track_read(struct track *tr);
 void track_handle(struct track *tr);
+void track_want(struct track *tr, int s);
+void track_save_completed(void);
 
-/* Return true if the track importer is running, otherwise false */
+/* Return true if the track is still being loaded, otherwise false */
 
 static inline bool track_is_importing(struct track *tr)
 {
-    return tr->pid != 0;
+    return tr->import.job != NULL || tr->direct || tr->queued
+        || tr->probing;
+}
+
+/*
+ * Get the region of audio imported beyond the length of the track,
+ * from start up to but not including end
+ */
+
+static inline void track_get_region(struct track *tr, int *start, int *end)
+{
+    unsigned long long r;
+
+    r = __atomic_load_n(&tr->region, __ATOMIC_ACQUIRE);
+    *start = r >> 32;
+    *end = r & 0xffffffff;
+}
+
+/*
+ * Return the length of the track, to be read from another thread
+ *
+ * The length is loaded before the index of blocks, so that a block
+ * within the length is always found there.
+ */
+
+static inline unsigned int track_get_length(struct track *tr)
+{
+    return __atomic_load_n(&tr->length, __ATOMIC_ACQUIRE);
+}
+
+/* Return true if the given sample has been imported, otherwise false */
+
+static inline bool track_has_sample(struct track *tr, int s)
+{
+    int start, end;
+
+    if (s < 0)
+        return false;
+    if (s < track_get_length(tr))
+        return true;
+
+    track_get_region(tr, &start, &end);
+    return s >= start && s < end;
+}
+
+/* Return the block containing the given sample */
+
+static inline struct track_block* track_get_block(struct track *tr, int s)
+{
+    struct track_index *i;
+    i = __atomic_load_n(&tr->index, __ATOMIC_ACQUIRE);
+    return i->block[s / TRACK_BLOCK_SAMPLES];
 }
 
 /* Return the pseudo-PPM meter value for the given sample */
@@ -93,7 +246,7 @@ static inline bool track_is_importing(struct track *tr)
 static inline unsigned char track_get_ppm(struct track *tr, int s)
 {
     struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
+    b = track_get_block(tr, s);
     return b->ppm[(s % TRACK_BLOCK_SAMPLES) / TRACK_PPM_RES];
 }
 
@@ -102,7 +255,7 @@ static inline unsigned char track_get_ppm(struct track *tr, int s)
 static inline unsigned char track_get_overview(struct track *tr, int s)
 {
     struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
+    b = track_get_block(tr, s);
     return b->overview[(s % TRACK_BLOCK_SAMPLES) / TRACK_OVERVIEW_RES];
 }
 
@@ -111,8 +264,71 @@ static inline unsigned char track_get_overview(struct track *tr, int s)
 static inline signed short* track_get_sample(struct track *tr, int s)
 {
     struct track_block *b;
-    b = tr->block[s / TRACK_BLOCK_SAMPLES];
-    return &b->pcm[(s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+    b = track_get_block(tr, s);
+    return &b->pcm[(TRACK_GUARD + s % TRACK_BLOCK_SAMPLES) * TRACK_CHANNELS];
+}
+
+/*
+ * Return a pointer to the sample data for a run of samples which is
+ * contiguous in memory, or NULL if the run reaches back into the
+ * previous block further than the guard
+ *
+ * Pre: 0 <= first <= last < tr->length
+ */
+
+static inline const signed short* track_get_run(struct track *tr,
+                                                int first, int last)
+{
+    int start;
+    struct track_block *b;
+
+    b = track_get_block(tr, last);
+    start = last - last % TRACK_BLOCK_SAMPLES;
+
+    if (first < start - TRACK_GUARD)
+        return NULL;
+
+    return &b->pcm[(TRACK_GUARD + first - start) * TRACK_CHANNELS];
+}
+
+/*
+ * Copy the final samples of the previous block into the guard of the
+ * given block, if both blocks are present
+ */
+
+static inline void track_copy_guard(struct track *tr, unsigned int n)
+{
+    struct track_block *prev, *b;
+
+    if (n == 0 || n >= tr->index->size)
+        return;
+
+    prev = tr->index->block[n - 1];
+    b = tr->index->block[n];
+    if (prev == NULL || b == NULL)
+        return;
+
+    memcpy(b->pcm, prev->pcm + TRACK_BLOCK_SAMPLES * TRACK_CHANNELS,
+           sizeof(signed short) * TRACK_GUARD * TRACK_CHANNELS);
+}
+
+/*
+ * Copy again the guards which an import from the given sample may
+ * have copied before the audio preceding it was in place
+ *
+ * This is the guard of the block after the one containing the sample,
+ * and of that block itself if the sample is at its start.
+ */
+
+static inline void track_join_guards(struct track *tr, unsigned int s)
+{
+    unsigned int n;
+
+    n = s / TRACK_BLOCK_SAMPLES;
+
+    if (s % TRACK_BLOCK_SAMPLES == 0)
+        track_copy_guard(tr, n);
+    track_copy_guard(tr, n + 1);
 }
 
 #endif
@@ -27,13 +27,17 @@
 #include <SDL.h> /* may override main() */
 
 #include "alsa.h"
+#include "cache.h"
 #include "controller.h"
 #include "device.h"
 #include "dicer.h"
+#include "importer.h"
 #include "interface.h"
 #include "jack.h"
 #include "oss.h"
+#include "prefetch.h"
 #include "realtime.h"
+#include "resample.h"
 #include "server.h"
 #include "osc.h"
 #include "thread.h"
@@ -49,6 +53,7 @@
 
 #define DEFAULT_RATE 44100
 #define DEFAULT_PRIORITY 80
+#define DEFAULT_CACHE_SIZE 2048 /* megabytes */
 
 #define DEFAULT_IMPORTER EXECDIR "/xwax-import"
 #define DEFAULT_SCANNER EXECDIR "/xwax-scan"
@@ -73,8 +78,16 @@ static void usage(FILE *fd)
       "  -q <n>         Real-time priority (0 for no priority, default %d)\n"
       "  -g <n>x<n>     Set display geometry\n"
       "  -w <path>      Set path for server\n"
+      "  --cache <dir>  Keep decoded audio in the given directory\n"
+      "  --cache-size <mb>  Size limit of the cache (default %dMb)\n"
+      "  --retain <mb>  Keep unloaded tracks in memory, up to this total\n"
+      "  --imports <n>  Number of tracks to import at once (default %d)\n"
+      "  --nice <n>     Nice value of importers (default %d)\n"
+      "  --prefetch <n> Import the selected record in advance, and up to\n"
+      "                 this many in a playlist (default 0; at most %d)\n"
       "  -h             Display this message to stdout and exit\n\n",
-      DEFAULT_PRIORITY);
+      DEFAULT_PRIORITY, DEFAULT_CACHE_SIZE, TRACK_IMPORTS, TRACK_NICE,
+      PREFETCH_MAX);
 
     fprintf(fd, "Music library options:\n"
       "  -l <path>      Location to scan for audio tracks\n"
@@ -87,6 +100,11 @@ static void usage(FILE *fd)
       "  -45            Use timecode at 45RPM\n"
       "  -c             Protect against certain operations while playing\n"
       "  -u             Allow all operations when playing\n"
+      "  --preview      Next deck plays a short part of each record loaded\n"
+      "  --sinc         Band-limited resampling, more CPU but no aliasing\n"
+      "  --cubic        Cubic resampling (default)\n"
+      "  --tolerant     Find timecode sooner, tolerating errors in it\n"
+      "  --exact        Find timecode only without errors (default)\n"
       "  -i <program>   Importer (default '%s')\n\n"
       "  -o <hostname>  Set OSC peer address",
       DEFAULT_IMPORTER);
@@ -130,13 +148,13 @@ static void usage(FILE *fd)
 
 int main(int argc, char *argv[])
 {
-    int r, n, priority;
-    const char *importer, *scanner, *geo, *server;
+    int r, n, priority, resampler, cache_size, retain, prefetch;
+    const char *importer, *scanner, *geo, *server, *cache;
     char *endptr;
     size_t nctl;
     double speed;
     struct timecode_def *timecode;
-    bool protect, use_mlock;
+    bool protect, preview, tolerant, use_mlock;
 
     struct controller ctl[2];
     struct rt rt;
@@ -161,6 +179,7 @@ int main(int argc, char *argv[])
     if (rig_init() == -1)
         return -1;
     rt_init(&rt);
+    resample_init();
     library_init(&library);
 
     ndeck = 0;
@@ -172,8 +191,15 @@ int main(int argc, char *argv[])
     timecode = NULL;
     speed = 1.0;
     protect = false;
+    preview = false;
+    resampler = RESAMPLE_CUBIC;
+    tolerant = false;
     use_mlock = false;
     server = NULL;
+    cache = NULL;
+    cache_size = DEFAULT_CACHE_SIZE;
+    retain = 0;
+    prefetch = 0;
 
 #if defined WITH_OSS || WITH_ALSA
     rate = DEFAULT_RATE;
@@ -314,6 +340,9 @@ int main(int argc, char *argv[])
             timecoder = &ld->timecoder;
             ld->importer = importer;
             ld->protect = protect;
+            ld->preview = preview;
+            ld->resampler = resampler;
+            preview = false; /* for this deck only */
 
             /* Work out which device type we are using, and initialise
              * an appropriate device. */
@@ -354,6 +383,7 @@ int main(int argc, char *argv[])
             }
 
             timecoder_init(timecoder, timecode, speed, sample_rate);
+            timecoder_set_tolerant(timecoder, tolerant);
 
             /* Connect up the elements to make an operational deck */
 
@@ -420,6 +450,41 @@ int main(int argc, char *argv[])
             argv++;
             argc--;
 
+        } else if (!strcmp(argv[0], "--preview")) {
+
+            preview = true;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--sinc")) {
+
+            resampler = RESAMPLE_SINC;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--cubic")) {
+
+            resampler = RESAMPLE_CUBIC;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--tolerant")) {
+
+            tolerant = true;
+
+            argv++;
+            argc--;
+
+        } else if (!strcmp(argv[0], "--exact")) {
+
+            tolerant = false;
+
+            argv++;
+            argc--;
+
         } else if (!strcmp(argv[0], "-k")) {
 
             use_mlock = true;
@@ -474,6 +539,113 @@ int main(int argc, char *argv[])
             argv += 2;
             argc -= 2;
 
+        } else if (!strcmp(argv[0], "--cache")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--cache requires a pathname as an argument.\n");
+                return -1;
+            }
+
+            cache = argv[1];
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--cache-size")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--cache-size requires an integer argument.\n");
+                return -1;
+            }
+
+            cache_size = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || cache_size < 0) {
+                fprintf(stderr, "--cache-size requires an integer argument.\n");
+                return -1;
+            }
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--retain")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--retain requires an integer argument.\n");
+                return -1;
+            }
+
+            retain = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || retain < 0) {
+                fprintf(stderr, "--retain requires an integer argument.\n");
+                return -1;
+            }
+
+            track_set_budget((size_t)retain << 20);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--imports")) {
+
+            int n;
+
+            if (argc < 2) {
+                fprintf(stderr, "--imports requires an integer argument.\n");
+                return -1;
+            }
+
+            n = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || n < 1) {
+                fprintf(stderr, "--imports requires a positive integer "
+                        "argument.\n");
+                return -1;
+            }
+
+            track_limit_imports(n);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--nice")) {
+
+            int n;
+
+            if (argc < 2) {
+                fprintf(stderr, "--nice requires an integer argument.\n");
+                return -1;
+            }
+
+            n = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || n < -20 || n > 19) {
+                fprintf(stderr, "--nice requires an integer argument "
+                        "from -20 to 19.\n");
+                return -1;
+            }
+
+            track_set_nice(n);
+
+            argv += 2;
+            argc -= 2;
+
+        } else if (!strcmp(argv[0], "--prefetch")) {
+
+            if (argc < 2) {
+                fprintf(stderr, "--prefetch requires an integer argument.\n");
+                return -1;
+            }
+
+            prefetch = strtol(argv[1], &endptr, 10);
+            if (*endptr != '\0' || prefetch < 0 || prefetch > PREFETCH_MAX) {
+                fprintf(stderr, "--prefetch requires an integer argument "
+                        "from 0 to %d.\n", PREFETCH_MAX);
+                return -1;
+            }
+
+            prefetch_set_depth(prefetch);
+
+            argv += 2;
+            argc -= 2;
+
         } else if (!strcmp(argv[0], "-i")) {
 
             /* Importer script for subsequent decks */
@@ -562,6 +734,17 @@ int main(int argc, char *argv[])
         return -1;
     }
 
+    /* Records imported in advance are kept only within the memory
+     * for retained tracks */
+
+    if (prefetch > 0 && retain == 0) {
+        fprintf(stderr, "--prefetch needs memory given by --retain.\n");
+        return -1;
+    }
+
+    if (cache != NULL && cache_init(cache, (size_t)cache_size << 20) == -1)
+        return -1;
+
     for (n = 0; n < nctl; n++) {
         if (rt_add_controller(&rt, &ctl[n]) == -1)
             return -1;
@@ -594,6 +777,7 @@ int main(int argc, char *argv[])
 
     interface_stop();
     rt_stop(&rt);
+    interface_clear();
 
     for (n = 0; n < ndeck; n++)
         deck_clear(&deck[n]);
@@ -605,6 +789,7 @@ int main(int argc, char *argv[])
     library_clear(&library);
     rt_clear(&rt);
     rig_clear();
+    importer_clear();
     server_stop();
     osc_stop();
     thread_global_clear();